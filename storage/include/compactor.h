@@ -0,0 +1,24 @@
+#ifndef COMPACTOR_H_
+#define COMPACTOR_H_
+
+using namespace std;
+
+
+// What compaction has done since the server started
+struct CompactionStats{
+  long passes;         // Times that every data file was looked at
+  long filesCompacted;
+  long bytesReclaimed;
+};
+
+// Compact the data files in the background, every COMPACTION_INTERVAL seconds
+// (called by configServer(), once the files are open). Files are only
+// rewritten when at least COMPACTION_MIN_DEAD percent of their bytes belong to
+// items that aren't needed anymore, and never faster than COMPACTION_RATE
+// kilobytes per second. Files that are being resharded are left alone.
+void startCompactor();
+
+CompactionStats getCompactionStats();
+
+
+#endif
@@ -3,6 +3,7 @@
 
 #include <string>
 #include <map>
+#include <memory>
 using namespace std;
 
 
@@ -29,6 +30,7 @@ struct Relation{
   string firstUsername;
   char direction;
   string secondUsername;
+  string timestamp; // When the follow was made
 };
 
 struct ProfilePost{
@@ -53,6 +55,17 @@ enum StoredFileType{
   TimelinePostFile,
 };
 
+// A data file: its type, the generation of the layout it belongs to (see
+// layout.h) and its number among the files of that type. While the files are
+// being resharded, getStoredFile() keeps the file from being moved for as long
+// as the guard is held.
+struct StoredFile{
+  StoredFileType type;
+  unsigned int bucket;
+  unsigned int generation;
+  shared_ptr<void> guard;
+};
+
 // Absolute path to the user data files of the application
 extern const string STORAGE_FILES_PATH;
 
@@ -63,12 +76,42 @@ extern const map<StoredFileType, string> storedFileTypes;
 extern map<string, int> configParams;
 
 // Before each session: creates the user data files of the application if they
-// don't exist and makes other relevant params available
+// don't exist, opens all of them and makes other relevant params available
 void configServer();
 
+// Get the stored file that holds the user's data of the given type
+StoredFile getStoredFile(StoredFileType storedFileType, const string& username);
+
+// Get the absolute path to a stored file
+string getStoredFilePath(const StoredFile& storedFile);
+
+// Get the absolute path to the index of a stored file (see fileindex.h)
+string getStoredIndexPath(const StoredFile& storedFile);
+
+// Get the absolute path to the post index of a timeline file (see DataFile in
+// filehandler.h)
+string getStoredPostIndexPath(const StoredFile& storedFile);
+
 // Get the absolute path to a stored file, provided its type as well as the
 // username of the user
 string getStoredFilePath(StoredFileType storedFileType, const string& username);
 
+// Field that the files of the given type are chosen by (see getStoredFile()):
+// USERNAME, or FIRST_USERNAME for relations
+const string& getOwnerField(const string& dataType);
+
+// True if the items of the given type are stored with the chained layout
+// (CHAINED_LAYOUT in config.txt)
+bool isChained(const string& dataType);
+
+// Number of items that each user keeps in the files of the given type, in a
+// ring that overwrites the oldest one (0 if items are only ever appended). Only
+// timelines have rings (TIMELINE_RING_SIZE in config.txt).
+int getRingSize(const string& dataType);
+
+// Size of each record in the files of the given type: the serialized item,
+// followed by the position of the previous item of the same user if chained
+int getRecordSize(const string& dataType);
+
 
 #endif
@@ -0,0 +1,84 @@
+#ifndef FANOUT_H_
+#define FANOUT_H_
+
+#include <string>
+#include <vector>
+#include <functional>
+using namespace std;
+
+
+// Posts are copied to their followers' timelines in the background when
+// FANOUT_WORKERS (in config.txt) isn't 0: savePost() only waits until the
+// post is in the author's profile file and its fan-out is recorded in
+// fanout.log (next to the data files). Posts whose fan-out hadn't finished
+// when the server stopped are fanned out again when it restarts.
+
+// Start the workers and queue the posts that are still in fanout.log (called
+// by configServer(), once the files are open)
+void startFanout();
+
+// True if posts are fanned out in the background
+bool isFanoutAsync();
+
+// Record that the post (a serialized PROFILE_POST) has to be fanned out, which
+// is as durable as WAL_MODE asks once this returns. Returns the number that
+// queueFanout() takes.
+long logFanoutIntent(const string& serializedPost);
+
+// Fan the post out in the background (once it's in the profile file). Posts of
+// the same author are fanned out in the order in which they're queued.
+void queueFanout(long intent, const string& serializedPost);
+
+// Wait until every post of the user (or of everyone, if username is empty)
+// that is queued has been fanned out
+void waitForFanout(const string& username = "");
+
+// Posts queued and fanned out since the server started, how many are queued
+// right now, and how long they waited until they were in every timeline
+struct FanoutStats{
+  long queued;
+  long delivered;
+  long depth;
+  double averageLag; // Seconds
+  double maxLag;
+};
+
+FanoutStats getFanoutStats();
+
+// Hybrid fan-out: the posts of authors with more than FANOUT_THRESHOLD
+// followers (0 turns it off) aren't copied to the timelines at all.
+// getTimelinePosts() merges in the newest posts of the ones that the user
+// follows instead (those saved since the follow), which are cached (up to
+// FANOUT_CACHE_POSTS per author).
+bool isHybridFanout();
+
+// True if the user's posts aren't fanned out (their number of followers is
+// cached)
+bool isHighFollower(const string& username);
+
+// The user's newest active profile posts, newest first (all of them if limit
+// is -1)
+vector<string> getRecentPosts(const string& username, int limit);
+
+// The high-follower accounts that the user follows, with the time of each
+// follow (cached)
+vector<pair<string, string>> getHighFollowerFriends(const string& username);
+
+// Make a change to the user's followers (e.g. apply a batch that follows
+// them) that returns by how many it changed their number
+void changeFollowers(const string& username, const function<long()>& change);
+
+// Forget what is cached about the user, since who they follow or their posts
+// have changed
+void forgetFriends(const string& username);
+void forgetPosts(const string& username);
+
+// Copy the user's newest posts (up to FANOUT_CATCHUP_POSTS) to the timelines
+// of their followers that were merging them in and don't have them yet, for
+// authors that stopped being high-follower ones. Done in the background if
+// posts are fanned out in the background. Authors that become high-follower
+// ones need nothing: the copies that timelines have already stay there.
+void catchUpFanout(const string& username);
+
+
+#endif
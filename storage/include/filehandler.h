@@ -4,21 +4,197 @@
 #include <string>
 #include <map>
 #include <vector>
+#include <mutex>
+#include <atomic>
+#include <memory>
+#include <functional>
+#include <tuple>
+#include <unordered_map>
 #include "config.h"
+#include "rwlock.h"
+#include "fileindex.h"
+#include "workerpool.h"
 using namespace std;
 
 
-void appendToDataFile(const string& filePath, const string& content);
+struct FileMapping;
+
+// A data file, open for as long as the server runs. Readers share items with
+// one another; changes to the items that are already in the file (e.g. their
+// active flags) hold it exclusively. Appends only take the appends mutex and
+// publish the new size of the file once they're done: readers never look past
+// it.
+struct DataFile{
+  string path;
+  int fd;
+  RWLock items;
+  mutex appends;
+  atomic<long> size;
+
+  // Latest mapping of the file (see READER_BACKEND in config.txt)
+  shared_ptr<FileMapping> mapping;
+  mutex mappingAccess;
+
+  // Where each user's items are: the newest one of each user if the file has
+  // the chained layout, all of them otherwise
+  bool chained;
+  HeadTable heads;
+  FileIndex index;
+
+  // Timeline files without rings also know where the copies of each post are,
+  // by author and timestamp (e.g. TIMELINE_POST_3.pidx)
+  bool postsIndexed;
+  FileIndex posts;
+
+  // While resharding, the items of the file are moved to the target layout
+  // once no one is using it (see getStoredFile()), after which it's migrated
+  RWLock migration;
+  atomic<bool> migrated;
+
+  // Readers and appenders hold it for as long as they use the file; compaction
+  // holds it exclusively to swap the file for its compacted copy. Changes to
+  // the active flags are counted so that compaction knows when its copy is
+  // stale, along with the items that have been deactivated since it last
+  // looked at the file.
+  RWLock compaction;
+  atomic<long> flagChanges;
+  atomic<long> deactivated;
+};
+
+// Open every data file of every open layout (called by configServer(), once
+// the files exist)
+void openDataFiles();
+
+// Make everything that has been written to the data files durable
+void syncDataFiles();
+
+// The open data file (throws if configServer() hasn't been called)
+DataFile& getDataFile(const StoredFile& storedFile);
+
+// True if the copies of posts in the file can be found through its post index
+bool hasPostIndex(const StoredFile& storedFile);
+
+// Number of the user's items in the file, active or not (-1 if the file has
+// the chained layout, which doesn't count them)
+long countItems(const StoredFile& storedFile, const string& username);
+
+// Workers (one per core) for requests that go through several data files at
+// once, one file per task. Their tasks must not use the pool themselves.
+WorkerPool& getFileWorkers();
+
+// Records are appended as they are, even to files with rings (see
+// getRingSize(), which resharding relies on to move rings whole)
+void appendToDataFile(const StoredFile& storedFile, const string& content);
+
+// The following compile matchArgs once (see MatchPredicate in serializers.h)
+// and match every item that they visit against it
 
 // Iterates through the file backwards and returns an offset (in bytes) of the
 // first matching entry
-int itemMatch(const string& filePath, string& dataType, const map<string, string> matchArgs);
+int itemMatch(const StoredFile& storedFile, string& dataType, const map<string, string>& matchArgs);
 
 // Iterates through the file backwards and returns relevant entries
-vector<string> itemMatchSweep(const string& filePath, string& dataType, map<string, string> matchArgs, int limit);
+vector<string> itemMatchSweep(const StoredFile& storedFile, string& dataType,
+                              const map<string, string>& matchArgs, int limit);
 
 // Iterates through the file backwards and modifies each entry's "active" status
-int setActiveFlag(bool active, const string& filePath, string& dataType, map<string, string> matchArgs);
+int setActiveFlag(bool active, const StoredFile& storedFile, string& dataType,
+                  const map<string, string>& matchArgs);
+
+// Iterates through the file backwards and returns the positions of the
+// matching entries. Nothing is locked once it returns, so the positions only
+// stay valid while a batch holds the file (see WriteBatch::hold()).
+vector<long> itemMatchPositions(const StoredFile& storedFile, string& dataType,
+                                const map<string, string>& matchArgs);
+
+// Changes that make up one logical operation (e.g. a post and its copies in
+// the followers' timelines), made together by apply(): each file is locked
+// once for all of its changes, and the changes are logged as a single entry
+// that is durable before any of them is made, so that a crash leaves either
+// all of them or none (as long as WAL_MODE isn't 0). Readers may still see
+// one file changed before another. The locks that a batch takes are released
+// by apply(), so a batch is made and applied on a single thread.
+class WriteBatch{
+public:
+  // Append content to the file, after whatever else the batch appends to it
+  // (or, if the file has rings, put each item in its user's ring)
+  void append(const StoredFile& storedFile, const string& content);
+
+  // Find the items that match now (like setActiveFlag()) and set their active
+  // flag when the batch is applied. Returns how many there are. The file
+  // isn't compacted until then. Flags are only written if they're different
+  // once apply() has locked the file's appends (other batches may have
+  // changed them since); if flipped isn't null, apply() adds to it how many
+  // were.
+  int setActiveFlag(bool active, const StoredFile& storedFile, string& dataType,
+                    const map<string, string>& matchArgs, int* flipped = nullptr);
+
+  // Same, for the owner's copy (or copies) of a post in a timeline file. The
+  // first time that the batch looks for the post in the file, every copy there
+  // is found at once through the file's post index.
+  int setPostActiveFlag(bool active, const StoredFile& storedFile, const string& owner,
+                        const string& author, const string& timestamp);
+
+  // Make sure that the file has an active item whose fields are keyArgs once
+  // the batch is applied: the newest item with those fields is overwritten by
+  // record (which is active) if it isn't active, and record is appended if
+  // there's none. The file is only looked up by apply(), once its appends are
+  // locked out, so that batches that upsert the same item at the same time
+  // don't both append it. If changed isn't null, apply() sets it to whether
+  // the item had to be written.
+  void upsert(const StoredFile& storedFile, const string& record,
+              const map<string, string>& keyArgs, bool* changed = nullptr);
+
+  // Keep the file from being compacted until the batch is applied, so that
+  // positions that are found in it in the meantime (e.g. by other threads,
+  // through itemMatchPositions()) don't move
+  void hold(const StoredFile& storedFile);
+
+  // Set the active flag of the items at the given positions, found since the
+  // batch held the file, when the batch is applied
+  void setActiveFlag(bool active, const StoredFile& storedFile, const vector<long>& positions);
+
+  // Make every change (files are locked in the same order by every batch)
+  void apply();
+
+private:
+  struct BatchedFile{
+    StoredFile storedFile;
+    string content;
+
+    // New active flags, by position, with where to count the ones that change
+    vector<tuple<long, char, int*>> flags;
+    shared_ptr<SharedLock> compacting;
+
+    // Copies of the posts that have been looked for, by post, then by owner
+    map<string, unordered_multimap<string, long>> postCopies;
+
+    // Items to upsert, with their key fields and where to say if they changed
+    vector<tuple<string, map<string, string>, bool*>> upserts;
+
+    // Items that upserts overwrite, by position
+    vector<pair<long, string>> overwrites;
+  };
+
+  map<tuple<StoredFileType, unsigned int, unsigned int>, BatchedFile> files;
+
+  BatchedFile& getBatchedFile(const StoredFile& storedFile);
+
+  void resolveUpserts(BatchedFile& batched);
+
+  void resolveFlags(BatchedFile& batched);
+};
+
+// Rewrite the file without its inactive items (nor, for relations, the rows
+// that a newer one with the same fields supersedes) and swap it in, unless
+// less than minDead percent of its bytes would be reclaimed. deadBytes is set
+// to how many would be. Items are copied while the file is in use; readers
+// and appenders are only locked out while the copy is brought up to date and
+// swapped in. pace is called with the number of bytes that are about to be
+// read or written, so that the caller may throttle compaction. Returns the
+// number of bytes that were reclaimed.
+long compactDataFile(const StoredFile& storedFile, int minDead, long& deadBytes,
+                     const function<void(long)>& pace);
 
 
 #endif
@@ -0,0 +1,95 @@
+#ifndef FILEINDEX_H_
+#define FILEINDEX_H_
+
+#include <string>
+#include <vector>
+#include <unordered_map>
+#include <mutex>
+#include <atomic>
+#include "schema.h"
+using namespace std;
+
+
+// Positions (in bytes from the start) of the items of each user in a data file.
+// Many users share each data file, so this lets a reader skip everyone else's
+// items. Users are identified by the field that the file was chosen by (see
+// getStoredFile()): USERNAME, or FIRST_USERNAME for relations. Other fields
+// may be picked instead, in which case items are found by their values
+// (unpadded, joined by ':').
+//
+// The index is persisted next to the data file (e.g. RELATION_3.idx), one
+// "key position" line per item, and is only ever appended to.
+class FileIndex {
+public:
+  FileIndex();
+  ~FileIndex();
+
+  // Load the index that is stored at indexPath (or build it if it's missing)
+  // and add the items of the data file that it doesn't cover yet. Opening it
+  // again replaces whatever had been loaded before.
+  void open(const string& indexPath, int dataFd, long dataSize, const string& dataType,
+            const vector<string>& keyFields = vector<string>());
+
+  // Record the items that were appended to the data file at the given position
+  void add(const string& content, long position);
+
+  // Positions of the user's items (or of those with the given key) before
+  // end, in the order in which they were appended
+  vector<long> find(const string& key, long end);
+
+  // Number of the user's items (or of those with the given key)
+  size_t count(const string& key);
+
+private:
+  string dataType;
+  vector<FieldBounds> keyFields; // Looked up once, when the index is opened
+  int itemSize;
+  int fd;
+  mutex positionsAccess;
+  unordered_map<string, vector<long>> positions;
+
+  // Add the items to the positions and to the file
+  void addItems(const char* items, size_t length, long position);
+
+  FileIndex(const FileIndex&);
+  FileIndex& operator=(const FileIndex&);
+};
+
+// Position of the newest item of each user in a data file with the chained
+// layout (CHAINED_LAYOUT in config.txt). Every item is followed by the position
+// of the previous item of the same user, so the rest of them are found from
+// there. The table is rebuilt from the data file when the server starts.
+class HeadTable {
+public:
+  // Find the newest item of each user in the data file (opening it again
+  // replaces whatever had been found before)
+  void open(int dataFd, long dataSize, const string& dataType);
+
+  // Turn the items that are about to be appended at the given position into
+  // records (i.e. chain them). Only one appender may call this at a time, and
+  // the new heads don't take effect until publish() is called.
+  string chain(const string& content, long position);
+
+  // Make the heads of the last chain() visible along with the new size of the
+  // file (which is published here)
+  void publish(atomic<long>& size, long newSize);
+
+  // Position of the newest item of the user (-1 if there's none), and the size
+  // of the file that was published along with it
+  long find(const string& username, long& size, const atomic<long>& publishedSize);
+
+  // Position of the previous item of the same user, from a record's chain field
+  long previous(const char* record) const;
+
+private:
+  string dataType;
+  FieldBounds ownerField;
+  int itemSize;
+  int chainSize;
+  mutex headsAccess;
+  unordered_map<string, long> heads;
+  unordered_map<string, long> pending; // Heads of the records being appended
+};
+
+
+#endif
@@ -0,0 +1,53 @@
+#ifndef LAYOUT_H_
+#define LAYOUT_H_
+
+#include <string>
+#include <vector>
+#include "config.h"
+using namespace std;
+
+
+// How usernames are hashed to the files of each type (HASH_FUNCTION in
+// config.txt)
+enum HashFunction{
+  SumHash = 0, // Sum of the characters (what the first volumes were laid out with)
+  FnvHash = 1, // 32-bit FNV-1a
+};
+
+// How the files of one type are laid out: how many there are and how users are
+// spread among them. Each resharding moves the files to a new generation.
+struct StorageLayout{
+  unsigned int count;
+  HashFunction hash;
+  unsigned int generation;
+};
+
+// Number that the hash function maps the username to
+unsigned int hashUsername(HashFunction hash, const string& username);
+
+// Decide the layout of the files of each type (called by configServer(),
+// before the files are created). Volumes keep the layout they were created
+// with (layout.cfg, next to the data files): if FILE_COUNT_* or HASH_FUNCTION
+// don't match it anymore, the server refuses to start unless RESHARD is 1.
+// Relation files of an older record format are upgraded first.
+void setStorageLayouts();
+
+// Layout of the files of the given type (their current layout while they're
+// being resharded)
+const StorageLayout& getStorageLayout(StoredFileType storedFileType);
+
+// True if the files of the given type are being resharded, in which case
+// target is set to the layout that they're being moved to
+bool getTargetLayout(StoredFileType storedFileType, StorageLayout& target);
+
+// Every layout whose files have to be open: the current one, followed by the
+// target while resharding
+vector<StorageLayout> getOpenLayouts(StoredFileType storedFileType);
+
+// Move the items of the files that are being resharded to their new layout, one
+// file at a time, in the background (called by configServer() once the files
+// are open). Users whose file has been moved are served from the new layout.
+void startResharding();
+
+
+#endif
@@ -0,0 +1,71 @@
+#ifndef MATCHKERNEL_H_
+#define MATCHKERNEL_H_
+
+#include <string>
+#include <vector>
+#include <stdint.h>
+#include "serializers.h"
+using namespace std;
+
+
+// Items are fixed-width, so a batch of them (one after the other) can be
+// matched against a MatchPredicate at once. The kernels compare each field of
+// each item 32 (AVX2) or 16 (SSE4.2) bytes at a time, or with memcmp() on
+// CPUs that have neither. The best one that the CPU supports is picked the
+// first time that a batch is matched.
+enum MatchKernel{
+  ScalarKernel = 0,
+  SseKernel = 1,
+  Avx2Kernel = 2,
+};
+
+// True if the CPU can run the kernel (its features are only looked up once)
+bool isKernelSupported(MatchKernel kernel);
+
+// The kernel that matchItems() uses
+MatchKernel getMatchKernel();
+
+const char* getKernelName(MatchKernel kernel);
+
+// A predicate compiled for a kernel: its fields are split into the pieces that
+// each compare covers once, so that a scan does it once for all of its batches
+class BatchMatcher{
+public:
+  // Throws if the CPU can't run the kernel
+  BatchMatcher(const MatchPredicate& predicate, MatchKernel kernel = getMatchKernel());
+
+  // Match numItems items, itemSize bytes apart, against the predicate. Bit i
+  // of bitmap (bitmap[i / 64] >> i % 64) is set if item i matches. bitmap is
+  // resized to fit and may be reused from one batch to the next.
+  void match(const char* items, size_t numItems, size_t itemSize, vector<uint64_t>& bitmap) const;
+
+  // A piece of a field that one vector compare covers: where it is in the
+  // item, the bytes that it has to hold (zeros past its length) and the bits
+  // of the compare's mask that count
+  struct Chunk{
+    int start;
+    uint32_t mask;
+    char expected[32];
+  };
+
+private:
+  MatchPredicate predicate;
+  MatchKernel kernel;
+  vector<Chunk> chunks;
+  size_t reach; // How far into an item the compares read
+};
+
+// Same as BatchMatcher::match(), for a single batch
+void matchItems(const char* items, size_t numItems, size_t itemSize,
+                const MatchPredicate& predicate, vector<uint64_t>& bitmap);
+
+// Same, with the given kernel (which has to be supported)
+void matchItems(const char* items, size_t numItems, size_t itemSize,
+                const MatchPredicate& predicate, vector<uint64_t>& bitmap, MatchKernel kernel);
+
+inline bool isMatch(const vector<uint64_t>& bitmap, size_t i){
+  return (bitmap[i / 64] >> (i % 64)) & 1;
+}
+
+
+#endif
@@ -0,0 +1,70 @@
+#ifndef PARSER_H_
+#define PARSER_H_
+
+#include <string>
+#include <cstddef>
+using namespace std;
+
+
+// Part of a buffer that is owned by someone else (parsing allocates nothing)
+struct StringRef{
+  const char* data;
+  size_t length;
+
+  string str() const { return string(data, length); }
+};
+
+// Commands that clients may send (see the README for their formats). Their
+// values are also their opcodes in the binary protocol.
+enum CommandType{
+  InvalidCommand = 0,
+  ExistsCommand = 1,
+  VerifyCredentialCommand = 2,
+  GetProfilePostsCommand = 3,
+  GetTimelinePostsCommand = 4,
+  IsFollowingCommand = 5,
+  GetFollowersCommand = 6,
+  GetFriendsCommand = 7,
+  SaveCredentialCommand = 8,
+  SavePostCommand = 9,
+  FollowCommand = 10,
+  DeleteCredentialCommand = 11,
+  DeletePostCommand = 12,
+  UnfollowCommand = 13,
+  PersistentModeCommand = 14,
+  FramedModeCommand = 15,
+  BinaryModeCommand = 16,
+  BatchCommand = 17,
+};
+
+// Most sub-commands a batch may hold
+const int maxBatchSize = 64;
+
+// A parsed command. Its fields point into the buffer that was parsed, so they
+// are only valid for as long as that buffer is.
+struct Command{
+  CommandType type;
+  StringRef username;
+  StringRef argument; // Password, friend's username, text or timestamp
+  int limit; // Also the number of sub-commands of a batch
+};
+
+// Determine which command the input (without its '\0' terminator) holds and
+// where its fields are. The type is InvalidCommand if it matches none.
+Command parseCommand(const char* input, size_t length);
+
+// Same as parseCommand(), for a command of the binary protocol:
+//  opcode (1 byte) | limit (4 bytes) | number of fields (1 byte) | fields
+// where each field is its length (2 bytes) followed by its characters, and
+// numbers are in network byte order. consumed is set to the number of bytes
+// the command takes up (0 if the input doesn't hold all of it yet).
+Command parseBinaryCommand(const char* input, size_t length, size_t& consumed);
+
+// True if the command changes how the connection is treated (MODE/...)
+bool isModeCommand(const Command& command);
+
+// True if the command only reads data (GET/...), and so may be batched
+bool isReadCommand(const Command& command);
+
+
+#endif
@@ -1,9 +1,26 @@
 #ifndef PROTOCOL_H_
 #define PROTOCOL_H_
 
+#include <string>
+using namespace std;
 
-// Analyze the user's request, perform the required action, and reply
-void handleRequest(const int connfd);
+
+// A client's connection. By default it only serves one command, but the
+// client may ask for it to stay open (MODE/persistent\0) and pipeline commands.
+// Likewise, replies follow the ACK handshake unless the client asks for them to
+// be length-prefixed (MODE/framed\0), and commands are text unless the client
+// switches to the binary protocol (MODE/binary\0).
+struct Connection{
+  int connfd;
+  bool persistent;
+  bool framed;
+  bool binary;
+  string pending; // Received bytes that are not part of a full command yet
+};
+
+// Analyze the commands the client has sent, perform the required actions, and
+// reply to each one in order. True if the connection should stay open.
+bool handleRequest(Connection& conn);
 
 
 #endif
@@ -0,0 +1,51 @@
+#ifndef RWLOCK_H_
+#define RWLOCK_H_
+
+#include <pthread.h>
+using namespace std;
+
+
+// Lock that any number of readers may hold at once, or a single writer
+// (C++11 has no shared_mutex). Readers get in while a writer waits unless the
+// lock prefers writers, in which case a thread must not take it as a reader
+// while it already holds it.
+class RWLock {
+public:
+  RWLock(bool preferWriters = false);
+  ~RWLock();
+
+  void lockShared();
+  void unlockShared();
+
+  void lock();
+  void unlock();
+
+private:
+  pthread_rwlock_t rwlock;
+
+  RWLock(const RWLock&);
+  RWLock& operator=(const RWLock&);
+};
+
+// Holds an RWLock as a reader until it falls out of scope
+class SharedLock {
+public:
+  SharedLock(RWLock& rwlock) : rwlock(rwlock) { rwlock.lockShared(); }
+  ~SharedLock() { rwlock.unlockShared(); }
+
+private:
+  RWLock& rwlock;
+};
+
+// Holds an RWLock as a writer until it falls out of scope
+class ExclusiveLock {
+public:
+  ExclusiveLock(RWLock& rwlock) : rwlock(rwlock) { rwlock.lock(); }
+  ~ExclusiveLock() { rwlock.unlock(); }
+
+private:
+  RWLock& rwlock;
+};
+
+
+#endif
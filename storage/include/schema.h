@@ -0,0 +1,126 @@
+#ifndef SCHEMA_H_
+#define SCHEMA_H_
+
+#include <string>
+#include "config.h"
+using namespace std;
+
+
+// The fields of the serialized items of each type are fixed at compile time
+// (RecordSchema<type> below). config.txt lists them too, and validateSchemas()
+// makes sure that both agree when the server starts, so code that goes
+// through many items looks their fields up in these tables instead of
+// building the names of config parameters.
+
+// Where a field is in a serialized item, and the FIELD_SIZE_* parameter that
+// gives its size. Padded fields are filled with fillerChar on the left.
+struct FieldBounds{
+  const char* name;
+  int start;
+  int end;
+  const char* sizeParam;
+  bool padded;
+};
+
+template<StoredFileType T> struct RecordSchema;
+
+template<> struct RecordSchema<CredentialFile>{
+  enum Field {ACTIVE, USERNAME, PASSWORD, NUM_FIELDS};
+
+  static constexpr const char* dataType = "CREDENTIAL";
+  static constexpr int serialSize = 41;
+  static constexpr FieldBounds fields[NUM_FIELDS] = {
+    {"ACTIVE", 0, 1, "FIELD_SIZE_ACTIVE", false},
+    {"USERNAME", 1, 21, "FIELD_SIZE_USERNAME", true},
+    {"PASSWORD", 21, 41, "FIELD_SIZE_PASSWORD", true}
+  };
+};
+
+template<> struct RecordSchema<RelationFile>{
+  enum Field {ACTIVE, FIRST_USERNAME, DIRECTION, SECOND_USERNAME, TIMESTAMP, NUM_FIELDS};
+
+  static constexpr const char* dataType = "RELATION";
+  static constexpr int serialSize = 52;
+  static constexpr FieldBounds fields[NUM_FIELDS] = {
+    {"ACTIVE", 0, 1, "FIELD_SIZE_ACTIVE", false},
+    {"FIRST_USERNAME", 1, 21, "FIELD_SIZE_USERNAME", true},
+    {"DIRECTION", 21, 22, "FIELD_SIZE_DIRECTION", false},
+    {"SECOND_USERNAME", 22, 42, "FIELD_SIZE_USERNAME", true},
+    {"TIMESTAMP", 42, 52, "FIELD_SIZE_TIMESTAMP", false}
+  };
+};
+
+template<> struct RecordSchema<ProfilePostFile>{
+  enum Field {ACTIVE, USERNAME, TIMESTAMP, TEXT, NUM_FIELDS};
+
+  static constexpr const char* dataType = "PROFILE_POST";
+  static constexpr int serialSize = 131;
+  static constexpr FieldBounds fields[NUM_FIELDS] = {
+    {"ACTIVE", 0, 1, "FIELD_SIZE_ACTIVE", false},
+    {"USERNAME", 1, 21, "FIELD_SIZE_USERNAME", true},
+    {"TIMESTAMP", 21, 31, "FIELD_SIZE_TIMESTAMP", false},
+    {"TEXT", 31, 131, "FIELD_SIZE_TEXT", true}
+  };
+};
+
+template<> struct RecordSchema<TimelinePostFile>{
+  enum Field {ACTIVE, USERNAME, AUTHOR, TIMESTAMP, TEXT, NUM_FIELDS};
+
+  static constexpr const char* dataType = "TIMELINE_POST";
+  static constexpr int serialSize = 151;
+  static constexpr FieldBounds fields[NUM_FIELDS] = {
+    {"ACTIVE", 0, 1, "FIELD_SIZE_ACTIVE", false},
+    {"USERNAME", 1, 21, "FIELD_SIZE_USERNAME", true},
+    {"AUTHOR", 21, 41, "FIELD_SIZE_USERNAME", true},
+    {"TIMESTAMP", 41, 51, "FIELD_SIZE_TIMESTAMP", false},
+    {"TEXT", 51, 151, "FIELD_SIZE_TEXT", true}
+  };
+};
+
+// Shorter names for the schemas (e.g. RelationSchema::TIMESTAMP)
+typedef RecordSchema<CredentialFile> CredentialSchema;
+typedef RecordSchema<RelationFile> RelationSchema;
+typedef RecordSchema<ProfilePostFile> ProfilePostSchema;
+typedef RecordSchema<TimelinePostFile> TimelinePostSchema;
+
+// True if the fields start at 0, follow one another and end at serialSize
+constexpr bool isContiguous(const FieldBounds* fields, int numFields, int serialSize, int start = 0){
+  return !numFields ? start == serialSize :
+         fields[0].start == start && fields[0].end > start &&
+         isContiguous(fields + 1, numFields - 1, serialSize, fields[0].end);
+}
+
+template<StoredFileType T>
+constexpr bool isContiguous(){
+  return isContiguous(RecordSchema<T>::fields, RecordSchema<T>::NUM_FIELDS, RecordSchema<T>::serialSize);
+}
+
+static_assert(isContiguous<CredentialFile>(), "CREDENTIAL fields overlap or leave gaps");
+static_assert(isContiguous<RelationFile>(), "RELATION fields overlap or leave gaps");
+static_assert(isContiguous<ProfilePostFile>(), "PROFILE_POST fields overlap or leave gaps");
+static_assert(isContiguous<TimelinePostFile>(), "TIMELINE_POST fields overlap or leave gaps");
+
+// The schema of a type that is only known at runtime (e.g. from a dataType
+// string), for code that isn't specialized for each type
+struct RecordLayout{
+  StoredFileType type;
+  const char* dataType;
+  int serialSize;
+  int numFields;
+  const FieldBounds* fields;
+
+  // Bounds of the named field (throws if the items have no such field)
+  const FieldBounds& getField(const string& fieldType) const;
+};
+
+const RecordLayout& getRecordLayout(StoredFileType type);
+
+// Throws if dataType isn't one of the types of stored data
+const RecordLayout& getRecordLayout(const string& dataType);
+
+// Make sure that the schemas match the sizes and bounds in config.txt (called
+// by configServer(), once the config parameters are loaded)
+void validateSchemas();
+
+
+#endif
@@ -3,7 +3,9 @@
 
 #include <string>
 #include <map>
+#include <vector>
 #include "config.h"
+#include "schema.h"
 using namespace std;
 
 
@@ -16,8 +18,49 @@ string serializeProfilePost(ProfilePost& profilePost);
 
 string serializeTimelinePost(TimelinePost& timelinePost);
 
+// The following append the fields of a serialized item that a client can't
+// infer from its request to out, in compact form (used by the binary protocol):
+// strings are unpadded and prefixed by their length (1 byte), and timestamps
+// are 4-byte integers in network byte order
+void appendCompactProfilePost(string& out, const string& serialized);
+
+void appendCompactTimelinePost(string& out, const string& serialized);
+
+void appendCompactRelation(string& out, const string& serialized);
+
 // Knowing what type of data was serialized, match it against a set of arguments
-bool matchesSerialized(const string& serialized, string& dataType, const map<string, string> matchArgs);
+// (looks the fields up by name on every call: readers compile the arguments
+// into a MatchPredicate instead)
+bool matchesSerialized(const string& serialized, string& dataType, const map<string, string>& matchArgs);
+
+// A set of arguments compiled once for the items of a type, for code that
+// matches many items against it: each field's offset and the bytes that it
+// has to hold (padded like the serializers pad them), most selective field
+// first. Matching an item is then one memcmp() per field, and allocates
+// nothing.
+class MatchPredicate{
+public:
+  MatchPredicate(const string& dataType, const map<string, string>& matchArgs);
+
+  // serialized has to hold a whole item
+  bool matches(const char* serialized) const;
+  bool matches(const string& serialized) const;
+
+  // What is compared, in order (see also matchkernel.h)
+  struct FieldMatch{
+    int start;
+    string expected;
+  };
+
+  const vector<FieldMatch>& getFields() const { return fields; }
+
+  bool isSatisfiable() const { return satisfiable; }
+
+private:
+  vector<FieldMatch> fields;
+  size_t serialSize;
+  bool satisfiable; // False if one of the values can't be in its field
+};
 
 // Pad value with as many instances of fillerChar as fieldSize requires
 string pad(const string& value, unsigned int fieldSize);
@@ -26,7 +69,19 @@ string pad(const string& value, unsigned int fieldSize);
 string unpad(const string& value);
 
 // Knowing what type of data was serialized, extract a given field from the string
+// (looks the field up by name: code that goes through many items uses the
+// versions below)
 string extractField(const string& serialized, string& dataType, string& fieldType);
 
+// Extract the field with the given bounds from the string
+string extractField(const string& serialized, const FieldBounds& field);
+
+// Same, for items whose type is known at compile time, e.g.
+// extractField<RelationFile>(serialized, RelationSchema::TIMESTAMP)
+template<StoredFileType T>
+string extractField(const string& serialized, typename RecordSchema<T>::Field field){
+  return extractField(serialized, RecordSchema<T>::fields[field]);
+}
+
 
 #endif
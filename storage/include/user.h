@@ -6,6 +6,8 @@
 using namespace std;
 
 
+class WriteBatch;
+
 bool exists(const string& username);
 
 bool verifyCredential(const string& username, const string& password);
@@ -19,6 +21,12 @@ bool deleteCredential(const string& username, const string& password);
 // true if success, false otherwise
 bool savePost(const string& username, const string& text);
 
+// Add the post's copies in the timelines of the user's followers to the batch.
+// Posts that are fanned out again after a restart are only copied to the
+// timelines that don't have them yet (and only if they're still stored).
+void fanOutPost(WriteBatch& batch, const string& username, const string& timestamp,
+                const string& text, bool recovering);
+
 // true if success, false otherwise
 bool deletePost(const string& username, const string& timestamp);
 
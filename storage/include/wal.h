@@ -0,0 +1,70 @@
+#ifndef WAL_H_
+#define WAL_H_
+
+#include <string>
+#include <memory>
+#include <vector>
+#include "config.h"
+#include "rwlock.h"
+using namespace std;
+
+
+// How durable a change is before it's acknowledged (WAL_MODE in config.txt)
+enum DurabilityMode{
+  NoDurability = 0,      // Not logged: changes are durable whenever the OS writes them
+  GroupDurability = 1,   // Logged; concurrent changes share each fsync() of the log
+  RequestDurability = 2, // Logged; every change fsync()s the log on its own
+};
+
+// Every change to a data file is recorded in the write-ahead log (wal.log, next
+// to the data files), durably, before it's made, so that changes that were acknowledged
+// but hadn't reached the data files when the server stopped are made again when
+// it restarts. The log is emptied by checkpoints, which make every data file
+// durable before the entries that they replace are deleted.
+
+// Apply whatever is in the log to the data files, make them durable and empty
+// the log (called by configServer(), before anything else reads the files)
+void replayLog();
+
+// Record an append that is about to be made at the given position of a data
+// file. Returns once the entry is as durable as WAL_MODE asks (the append may
+// only be made afterwards). Checkpoints wait until the returned lock is
+// released, which has to be once the change is in the data file (nothing is
+// returned if changes aren't logged).
+unique_ptr<SharedLock> logAppend(const StoredFile& storedFile, long position, const string& records);
+
+// One of the changes of a write batch (or of a sweep of active flags): records
+// appended at the given position, or the new active flag of the item there
+struct LoggedChange{
+  bool append;
+  StoredFile storedFile;
+  long position;
+  string data;
+};
+
+// Record the changes of a write batch as a single entry, so that either all of
+// them or none are made again after a crash. Returns once the entry is durable,
+// like logAppend().
+unique_ptr<SharedLock> logBatch(const vector<LoggedChange>& changes);
+
+// Checkpoint the log if it has grown past WAL_CHECKPOINT_SIZE bytes (called
+// once all of a request's changes have been made, when none are in flight)
+void commitLog();
+
+// How many changes have waited for their entries to be durable, and how many
+// times the log has been fsync()ed for them, since the server started
+struct LogStats{
+  long commits;
+  long syncs;
+};
+
+LogStats getLogStats();
+
+// Swap the log for an empty one, make every data file durable and delete the
+// old log. Also done whenever the log grows past WAL_CHECKPOINT_SIZE bytes, and
+// before compaction swaps a file (positions in the log would point into the
+// old one).
+void checkpointLog();
+
+
+#endif
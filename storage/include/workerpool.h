@@ -0,0 +1,42 @@
+#ifndef WORKERPOOL_H_
+#define WORKERPOOL_H_
+
+#include <functional>
+#include <queue>
+#include <vector>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+using namespace std;
+
+
+// Fixed-size set of threads that execute submitted tasks in FIFO order
+class WorkerPool {
+public:
+  // Launch numWorkers threads (one per core if numWorkers is zero)
+  WorkerPool(unsigned int numWorkers = 0);
+
+  // Finish the queued tasks and join all of the workers
+  ~WorkerPool();
+
+  // Queue a task to be executed by the first available worker
+  void submit(const function<void()>& task);
+
+  // Queue all of the tasks and wait until every one of them has been executed.
+  // Must not be called from one of the pool's own workers.
+  void runAll(const vector<function<void()>>& tasks);
+
+  unsigned int size() const { return workers.size(); }
+
+private:
+  vector<thread> workers;
+  queue<function<void()>> tasks;
+  mutex tasksAccess;
+  condition_variable tasksAvailable;
+  bool stopping;
+
+  void work();
+};
+
+
+#endif
@@ -0,0 +1,77 @@
+#include <iostream>
+#include <map>
+#include <thread>
+#include <atomic>
+#include <chrono>
+#include "config.h"
+#include "filehandler.h"
+#include "layout.h"
+#include "compactor.h"
+using namespace std;
+
+
+atomic<long> compactionPasses(0), filesCompacted(0), bytesReclaimed(0);
+
+void compactFiles();
+
+void paceCompaction(long numBytes);
+
+
+void startCompactor(){
+  // Assumes that openDataFiles() has been called
+  if(configParams.at("COMPACTION_INTERVAL") <= 0) return;
+
+  thread(compactFiles).detach();
+}
+
+CompactionStats getCompactionStats(){
+  return {compactionPasses.load(), filesCompacted.load(), bytesReclaimed.load()};
+}
+
+void compactFiles(){
+  // Files are only read again once enough of their items have been deactivated
+  // since they were last looked at (everything is read on the first pass)
+  int minDead = configParams.at("COMPACTION_MIN_DEAD");
+  map<DataFile*, long> knownDead; // Dead bytes found the last time, by file
+
+  for(;;){
+    this_thread::sleep_for(chrono::seconds(configParams.at("COMPACTION_INTERVAL")));
+
+    for(auto const& x : storedFileTypes){
+      StorageLayout layout = getStorageLayout(x.first), target;
+      if(getTargetLayout(x.first, target)) continue;
+
+      int recordSize = getRecordSize(x.second);
+
+      for(unsigned int bucket = 0; bucket < layout.count; bucket++){
+        StoredFile storedFile = {x.first, bucket, layout.generation, nullptr};
+        DataFile& dataFile = getDataFile(storedFile);
+
+        auto known = knownDead.find(&dataFile);
+        long dead = known == knownDead.end() ? 0 : known->second + dataFile.deactivated * recordSize;
+
+        if(known != knownDead.end() && (!dead || dead * 100 < (long) minDead * dataFile.size)) continue;
+
+        long deadBytes;
+        long reclaimed = compactDataFile(storedFile, minDead, deadBytes, paceCompaction);
+        knownDead[&dataFile] = reclaimed ? 0 : deadBytes;
+
+        if(reclaimed){
+          filesCompacted++;
+          bytesReclaimed += reclaimed;
+
+          cerr << "Compacted " << dataFile.path << ": " << reclaimed << " bytes reclaimed (";
+          cerr << bytesReclaimed << " since the server started)\n";
+        }
+      }
+    }
+
+    compactionPasses++;
+  }
+}
+
+void paceCompaction(long numBytes){
+  // Take as long as moving the bytes at COMPACTION_RATE would
+  long bytesPerSecond = configParams.at("COMPACTION_RATE") * 1024L;
+  if(bytesPerSecond > 0) this_thread::sleep_for(chrono::microseconds(numBytes * 1000000 / bytesPerSecond));
+}
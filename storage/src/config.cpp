@@ -2,10 +2,16 @@
 #include <fstream>
 #include <sstream>
 #include <stdexcept>
+#include <algorithm>
 #include <cstring>
 #include <mutex>
 #include "filehandler.h"
+#include "layout.h"
+#include "compactor.h"
+#include "fanout.h"
+#include "wal.h"
 #include "utils.h"
+#include "schema.h"
 #include "config.h"
 using namespace std;
 
@@ -28,7 +34,14 @@ void initiateStorage();
 
 void configServer(){
   setConfigParams();
+  validateSchemas();
+  replayLog();
+  setStorageLayouts();
   initiateStorage();
+  openDataFiles();
+  startResharding();
+  startCompactor();
+  startFanout();
 }
 
 void setConfigParams(){
@@ -60,48 +73,85 @@ void setConfigParams(){
 }
 
 void initiateStorage(void){
-  // Assumes that setStorageFilesPath() setConfigParams() have been called
-	// Get the constants that denote file counts (start with this:)
-	string match = "FILE_COUNT_";
-
-  for(auto const& x : configParams){
-		if(startswith(x.first, match)){
-			string fileType = x.first.substr(match.length());
-
-			for(int fileNum = 0; fileNum < x.second; fileNum++){
-				string fileName = fileType + "_" + to_string(fileNum) + ".txt";
-				string absPath = STORAGE_FILES_PATH + '/' + fileName;
-
-				// Create the file if it does not exist
-				if(!isValidPath(absPath)){
-					ofstream createdFile(absPath);
-					cerr << "Adding storage file... " << absPath << "\n";
-				}
-			}
-		}
+  // Assumes that setConfigParams() and setStorageLayouts() have been called.
+  // While resharding, the files of both layouts are needed.
+  for(auto const& x : storedFileTypes){
+    for(auto const& layout : getOpenLayouts(x.first)){
+      for(unsigned int fileNum = 0; fileNum < layout.count; fileNum++){
+        string absPath = getStoredFilePath({x.first, fileNum, layout.generation, nullptr});
+
+        // Create the file if it does not exist
+        if(!isValidPath(absPath)){
+          ofstream createdFile(absPath);
+          cerr << "Adding storage file... " << absPath << "\n";
+        }
+      }
+    }
   }
 }
 
-string getStoredFilePath(StoredFileType storedFileType, const string& username){
-  // "Hash" the username to a number within the relevant file's limits
-  // and return the path of the file that corresponds to that hash
+StoredFile getStoredFile(StoredFileType storedFileType, const string& username){
+  // Hash the username to one of the files of the relevant type
+  const StorageLayout& layout = getStorageLayout(storedFileType);
+  StoredFile storedFile = {storedFileType, hashUsername(layout.hash, username) % layout.count,
+                           layout.generation, nullptr};
 
-  string param = "FILE_COUNT_" + storedFileTypes.at(storedFileType);
-  unsigned int maxFileNum = configParams.at(param);
+  StorageLayout target;
+  if(!getTargetLayout(storedFileType, target)) return storedFile;
 
-  if(!maxFileNum){
-    throw std::runtime_error("maxFileNum is zero. Likely that configServer() has not been called.");
-  }
+  // While resharding, the user's file isn't moved for as long as it's used.
+  // Once it has been, the user's items are in the target layout.
+  DataFile& dataFile = getDataFile(storedFile);
+  storedFile.guard = make_shared<SharedLock>(dataFile.migration);
 
-  unsigned int numericUsername = 0;
-  for(unsigned int i = 0; i < username.size(); i++) {
-    numericUsername += username[i];
-  }
+  if(!dataFile.migrated) return storedFile;
+
+  return {storedFileType, hashUsername(target.hash, username) % target.count,
+          target.generation, nullptr};
+}
+
+string getStoredFilePath(const StoredFile& storedFile){
+  // Matches the format set by initiateStorage(): the files of the first
+  // generation are <TYPE>_<bucket>.txt, later ones <TYPE>_<bucket>.<generation>.txt
+  string fileName = storedFileTypes.at(storedFile.type) + "_" + to_string(storedFile.bucket);
+  if(storedFile.generation) fileName += "." + to_string(storedFile.generation);
+
+  return STORAGE_FILES_PATH + '/' + fileName + ".txt";
+}
+
+string getStoredIndexPath(const StoredFile& storedFile){
+  // Next to the data file (e.g. RELATION_3.idx)
+  string dataPath = getStoredFilePath(storedFile);
+  return dataPath.substr(0, dataPath.rfind('.')) + ".idx";
+}
 
-  unsigned int fileNum = numericUsername % maxFileNum;
+string getStoredPostIndexPath(const StoredFile& storedFile){
+  // Next to the data file (e.g. TIMELINE_POST_3.pidx)
+  string dataPath = getStoredFilePath(storedFile);
+  return dataPath.substr(0, dataPath.rfind('.')) + ".pidx";
+}
+
+string getStoredFilePath(StoredFileType storedFileType, const string& username){
+  return getStoredFilePath(getStoredFile(storedFileType, username));
+}
+
+const string& getOwnerField(const string& dataType){
+  static const string username = "USERNAME", firstUsername = "FIRST_USERNAME";
+  return dataType == "RELATION" ? firstUsername : username;
+}
+
+bool isChained(const string& dataType){
+  // Credentials are only ever looked up one at a time
+  return configParams.at("CHAINED_LAYOUT") && dataType != "CREDENTIAL";
+}
+
+int getRingSize(const string& dataType){
+  return dataType == "TIMELINE_POST" ? max(0, configParams.at("TIMELINE_RING_SIZE")) : 0;
+}
 
-  // Matches the format set by initiateStorage()
-  string fileName = storedFileTypes.at(storedFileType) + "_" + to_string(fileNum) + ".txt";
+int getRecordSize(const string& dataType){
+  int recordSize = getRecordLayout(dataType).serialSize;
+  if(isChained(dataType)) recordSize += configParams.at("FIELD_SIZE_CHAIN");
 
-  return STORAGE_FILES_PATH + '/' + fileName;
+  return recordSize;
 }
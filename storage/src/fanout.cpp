@@ -0,0 +1,571 @@
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <iomanip>
+#include <stdexcept>
+#include <map>
+#include <set>
+#include <list>
+#include <functional>
+#include <vector>
+#include <memory>
+#include <mutex>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <unistd.h>
+#include <fcntl.h>
+#include "config.h"
+#include "serializers.h"
+#include "utils.h"
+#include "layout.h"
+#include "workerpool.h"
+#include "filehandler.h"
+#include "user.h"
+#include "wal.h"
+#include "fanout.h"
+using namespace std;
+
+
+// Entries in fanout.log are fixed-size: their kind, the post's number (in
+// intentDigits characters) and, for intents, the post. Posts are done once
+// they're in every timeline. Whatever is left in the log once every queued
+// post is done isn't needed anymore, so it's emptied then. Since posts may
+// keep coming without the queue ever draining, the log is also rewritten with
+// only the unfinished intents once it holds more than compactionEntries
+// entries (and twice as many as there are unfinished intents).
+const char intentEntry = 'I';
+const char doneEntry = 'D';
+const int intentDigits = 16;
+const long compactionEntries = 1024;
+
+// One single-threaded pool per worker: each author's posts go to the same one,
+// so that they reach the timelines in order
+vector<unique_ptr<WorkerPool>> fanoutWorkers;
+
+// Intents are synced like the write-ahead log: the first request that finds
+// its intent unsynced syncs every intent written by then, while the others
+// wait for it
+mutex intentsAccess;
+condition_variable intentsSynced, postsDelivered;
+int intentsFd = -1;
+long nextIntent = 0, syncedIntents = 0;
+bool syncingIntents = false;
+
+// Queued posts, by author
+map<string, long> pendingPosts;
+long numPending = 0;
+
+// Posts of the intents that aren't done yet, and the number of entries in the
+// log (both guarded by intentsAccess)
+map<long, string> unfinishedIntents;
+long numEntries = 0;
+
+atomic<long> numQueued(0), numDelivered(0);
+double totalLag = 0, maxLag = 0; // Guarded by intentsAccess
+
+// Values computed from the data files, by username, until they're forgotten
+// or, once FANOUT_CACHE_USERS users have one, evicted (least recently used
+// first). A value that was being computed when it was forgotten or updated
+// isn't kept (it may be stale): users have a version while their value is
+// being computed or updated, and only then.
+template<typename T>
+class UserCache{
+public:
+  T get(const string& username, const function<T()>& compute){
+    unique_lock<mutex> lck(access);
+
+    auto cached = values.find(username);
+    if(cached != values.end()){
+      recency.splice(recency.begin(), recency, cached->second.second);
+      return cached->second.first;
+    }
+
+    InFlight& inFlight = startChange(username);
+    long version = inFlight.version, cleared = numCleared;
+    lck.unlock();
+
+    T value = compute();
+
+    lck.lock();
+    if(inFlight.version == version && numCleared == cleared) keep(username, value);
+    finishChange(username);
+
+    return value;
+  }
+
+  // Make a change to what the user's value is computed from, then adjust the
+  // value if it's cached. Returns false if it wasn't.
+  bool update(const string& username, const function<void()>& change, const function<void(T&)>& adjust){
+    unique_lock<mutex> lck(access);
+    InFlight& inFlight = startChange(username);
+    inFlight.version++;
+    lck.unlock();
+
+    change();
+
+    lck.lock();
+    inFlight.version++;
+    finishChange(username);
+
+    auto cached = values.find(username);
+    if(cached == values.end()) return false;
+
+    adjust(cached->second.first);
+    return true;
+  }
+
+  void forget(const string& username){
+    unique_lock<mutex> lck(access);
+
+    auto cached = values.find(username);
+    if(cached != values.end()){
+      recency.erase(cached->second.second);
+      values.erase(cached);
+    }
+
+    auto inFlight = changing.find(username);
+    if(inFlight != changing.end()) inFlight->second.version++;
+  }
+
+  void forgetAll(){
+    unique_lock<mutex> lck(access);
+    values.clear();
+    recency.clear();
+    numCleared++;
+  }
+
+private:
+  // How many computes and updates of a user's value are under way
+  struct InFlight{
+    long version;
+    int count;
+  };
+
+  mutex access;
+  map<string, pair<T, list<string>::iterator>> values;
+  list<string> recency; // Most recently used first
+  map<string, InFlight> changing;
+  long numCleared = 0;
+
+  InFlight& startChange(const string& username){
+    // Assumes that access is held (as the rest do)
+    InFlight& inFlight = changing[username];
+    inFlight.count++;
+    return inFlight;
+  }
+
+  void finishChange(const string& username){
+    auto inFlight = changing.find(username);
+    if(!--inFlight->second.count) changing.erase(inFlight);
+  }
+
+  void keep(const string& username, const T& value){
+    size_t capacity = max(0, configParams.at("FANOUT_CACHE_USERS"));
+    if(!capacity) return;
+
+    // Concurrent computes may both keep their value
+    auto cached = values.find(username);
+    if(cached != values.end()){
+      recency.erase(cached->second.second);
+      values.erase(cached);
+    }
+
+    while(values.size() >= capacity){
+      values.erase(recency.back());
+      recency.pop_back();
+    }
+
+    recency.push_front(username);
+    values[username] = make_pair(value, recency.begin());
+  }
+};
+
+UserCache<long> followerCounts;
+UserCache<vector<string>> recentPosts;
+
+// The high-follower accounts that each user follows, with the time of each
+// follow. Every list is forgotten when an account crosses the threshold.
+UserCache<vector<pair<string, string>>> highFollowerFriends;
+
+string getFanoutLogPath();
+
+string getPostField(const string& serializedPost, ProfilePostSchema::Field field);
+
+int getEntrySize();
+
+void writeEntry(char kind, long intent, const string& serializedPost);
+
+void compactIntents();
+
+void deliverPost(long intent, const string& serializedPost, bool recovering,
+                 chrono::steady_clock::time_point queuedAt);
+
+void finishPost(const string& author, long intent);
+
+void catchUpTimeline(const string& follower, const string& author, const string& followTime,
+                     const vector<string>& posts);
+
+WorkerPool& getAuthorWorker(const string& author);
+
+
+void startFanout(){
+  // Assumes that openDataFiles() has been called
+  int numWorkers = max(0, configParams.at("FANOUT_WORKERS"));
+
+  for(int i = 0; i < numWorkers; i++){
+    fanoutWorkers.push_back(unique_ptr<WorkerPool>(new WorkerPool(1)));
+  }
+
+  // Posts that were logged but aren't done yet
+  ifstream infile(getFanoutLogPath(), ios::binary);
+  string log((istreambuf_iterator<char>(infile)), istreambuf_iterator<char>());
+
+  map<long, string> unfinished;
+  int entrySize = getEntrySize();
+
+  for(size_t offset = 0; offset + entrySize <= log.length(); offset += entrySize){
+    long intent = stol(log.substr(offset + 1, intentDigits));
+    nextIntent = max(nextIntent, intent + 1);
+
+    if(log[offset] == intentEntry) unfinished[intent] = log.substr(offset + 1 + intentDigits);
+    else unfinished.erase(intent);
+  }
+
+  syncedIntents = nextIntent;
+  unfinishedIntents = unfinished;
+  numEntries = log.length() / entrySize;
+
+  intentsFd = open(getFanoutLogPath().c_str(), O_WRONLY | O_CREAT | O_APPEND, 0644);
+  if(intentsFd == -1 || (unfinished.empty() && ftruncate(intentsFd, 0) == -1))
+    throw std::runtime_error("Could not open " + getFanoutLogPath());
+
+  if(unfinished.empty()){
+    numEntries = 0;
+
+  }else if(numEntries > (long) unfinished.size()){
+    compactIntents();
+  }
+
+  if(!unfinished.empty()) cerr << "Fanning out " << unfinished.size() << " posts again\n";
+
+  for(auto const& x : unfinished){
+    string author = unpad(getPostField(x.second, ProfilePostSchema::USERNAME));
+
+    {
+      unique_lock<mutex> lck(intentsAccess);
+      pendingPosts[author]++;
+      numPending++;
+    }
+
+    numQueued++;
+    auto queuedAt = chrono::steady_clock::now();
+
+    // Without workers (e.g. FANOUT_WORKERS was 0 when the server restarted),
+    // they're fanned out before the server starts
+    if(fanoutWorkers.empty()) deliverPost(x.first, x.second, true, queuedAt);
+    else getAuthorWorker(author).submit(bind(deliverPost, x.first, x.second, true, queuedAt));
+  }
+}
+
+bool isFanoutAsync(){
+  return !fanoutWorkers.empty();
+}
+
+long logFanoutIntent(const string& serializedPost){
+  // The post counts as queued from here on, so that the log isn't emptied
+  // before it's done
+  string author = unpad(getPostField(serializedPost, ProfilePostSchema::USERNAME));
+
+  unique_lock<mutex> lck(intentsAccess);
+  long intent = nextIntent++;
+
+  writeEntry(intentEntry, intent, serializedPost);
+  unfinishedIntents[intent] = serializedPost;
+  pendingPosts[author]++;
+  numPending++;
+
+  DurabilityMode durabilityMode = (DurabilityMode) configParams.at("WAL_MODE");
+  if(durabilityMode == NoDurability) return intent;
+
+  while(syncedIntents <= intent){
+    if(syncingIntents && durabilityMode == GroupDurability){
+      intentsSynced.wait(lck);
+      continue;
+    }
+
+    // Only the group commit lets more intents in while syncing
+    long end = nextIntent;
+    syncingIntents = true;
+
+    if(durabilityMode == GroupDurability) lck.unlock();
+    if(fdatasync(intentsFd) == -1) throw std::runtime_error("Could not sync " + getFanoutLogPath());
+    if(durabilityMode == GroupDurability) lck.lock();
+
+    syncedIntents = max(syncedIntents, end);
+    syncingIntents = false;
+    intentsSynced.notify_all();
+  }
+
+  return intent;
+}
+
+void queueFanout(long intent, const string& serializedPost){
+  string author = unpad(getPostField(serializedPost, ProfilePostSchema::USERNAME));
+  numQueued++;
+
+  getAuthorWorker(author).submit(bind(deliverPost, intent, serializedPost, false,
+                                     chrono::steady_clock::now()));
+}
+
+void waitForFanout(const string& username){
+  unique_lock<mutex> lck(intentsAccess);
+
+  if(username.empty()){
+    postsDelivered.wait(lck, []{ return !numPending; });
+
+  }else{
+    postsDelivered.wait(lck, [&username]{ return !pendingPosts.count(username); });
+  }
+}
+
+FanoutStats getFanoutStats(){
+  unique_lock<mutex> lck(intentsAccess);
+  long delivered = numDelivered.load();
+
+  return {numQueued.load(), delivered, numPending, delivered ? totalLag / delivered : 0, maxLag};
+}
+
+void deliverPost(long intent, const string& serializedPost, bool recovering,
+                 chrono::steady_clock::time_point queuedAt){
+  // Copy the post to every timeline at once, wait until the copies are
+  // durable and mark the post as done
+  string author = unpad(getPostField(serializedPost, ProfilePostSchema::USERNAME));
+
+  WriteBatch batch;
+  fanOutPost(batch, author, getPostField(serializedPost, ProfilePostSchema::TIMESTAMP),
+             unpad(getPostField(serializedPost, ProfilePostSchema::TEXT)), recovering);
+  batch.apply();
+  commitLog();
+
+  chrono::duration<double> lag = chrono::steady_clock::now() - queuedAt;
+
+  {
+    unique_lock<mutex> lck(intentsAccess);
+    numDelivered++;
+    totalLag += lag.count();
+    maxLag = max(maxLag, lag.count());
+  }
+
+  finishPost(author, intent);
+}
+
+void finishPost(const string& author, long intent){
+  // Posts that weren't logged (intent is -1) have nothing to mark
+  unique_lock<mutex> lck(intentsAccess);
+  if(!--pendingPosts[author]) pendingPosts.erase(author);
+  if(intent != -1) unfinishedIntents.erase(intent);
+
+  if(!--numPending){
+    if(ftruncate(intentsFd, 0) == -1) throw std::runtime_error("Could not empty " + getFanoutLogPath());
+    numEntries = 0;
+
+  }else if(intent != -1){
+    writeEntry(doneEntry, intent, string());
+
+    // Not while intents are being synced, since that uses the old log
+    bool tooLong = numEntries > compactionEntries && numEntries > 2 * (long) unfinishedIntents.size();
+    if(tooLong && !syncingIntents) compactIntents();
+  }
+
+  postsDelivered.notify_all();
+}
+
+bool isHybridFanout(){
+  return configParams.at("FANOUT_THRESHOLD") > 0;
+}
+
+bool isHighFollower(const string& username){
+  if(!isHybridFanout()) return false;
+
+  long numFollowers = followerCounts.get(username, [&username]{
+    return (long) getFollowers(username, -1).size();
+  });
+
+  return numFollowers > configParams.at("FANOUT_THRESHOLD");
+}
+
+vector<string> getRecentPosts(const string& username, int limit){
+  // Only the newest posts are cached: readers that want more read them all
+  int numCached = configParams.at("FANOUT_CACHE_POSTS");
+  if(limit == -1 || limit > numCached) return getProfilePosts(username, limit);
+
+  vector<string> posts = recentPosts.get(username, [&username, numCached]{
+    return getProfilePosts(username, numCached);
+  });
+
+  if((int) posts.size() > limit) posts.resize(limit);
+  return posts;
+}
+
+vector<pair<string, string>> getHighFollowerFriends(const string& username){
+  if(!isHybridFanout()) return vector<pair<string, string>>();
+
+  return highFollowerFriends.get(username, [&username]{
+    vector<pair<string, string>> friends;
+
+    for(string& serializedRelation : getFriends(username, -1)){
+      string friendUsername = unpad(extractField<RelationFile>(serializedRelation, RelationSchema::SECOND_USERNAME));
+
+      if(isHighFollower(friendUsername))
+        friends.push_back(make_pair(friendUsername,
+                                    extractField<RelationFile>(serializedRelation, RelationSchema::TIMESTAMP)));
+    }
+
+    return friends;
+  });
+}
+
+void changeFollowers(const string& username, const function<long()>& change){
+  // The count is cached first, so that crossing the threshold is noticed (if
+  // it can't be adjusted, it's assumed to have crossed it)
+  isHighFollower(username);
+
+  long threshold = configParams.at("FANOUT_THRESHOLD"), delta = 0;
+  bool crossed = true;
+
+  followerCounts.update(username, [&change, &delta]{ delta = change(); },
+                        [threshold, &delta, &crossed](long& numFollowers){
+    crossed = (numFollowers > threshold) != (numFollowers + delta > threshold);
+    numFollowers += delta;
+  });
+
+  if(crossed && isHybridFanout()) highFollowerFriends.forgetAll();
+}
+
+void forgetFriends(const string& username){
+  highFollowerFriends.forget(username);
+}
+
+void forgetPosts(const string& username){
+  recentPosts.forget(username);
+}
+
+void catchUpFanout(const string& username){
+  // Only the newest FANOUT_CATCHUP_POSTS posts are copied, and each timeline
+  // only gets those that it was merging in (saved since its user followed the
+  // author), so there's at most that many per follower
+  auto catchUp = [username]{
+    vector<string> posts = getProfilePosts(username, configParams.at("FANOUT_CATCHUP_POSTS"));
+
+    for(string& serializedRelation : getFollowers(username, -1)){
+      catchUpTimeline(unpad(extractField<RelationFile>(serializedRelation, RelationSchema::SECOND_USERNAME)),
+                      username, extractField<RelationFile>(serializedRelation, RelationSchema::TIMESTAMP), posts);
+    }
+
+    commitLog();
+  };
+
+  if(fanoutWorkers.empty()){
+    catchUp();
+    return;
+  }
+
+  {
+    unique_lock<mutex> lck(intentsAccess);
+    pendingPosts[username]++;
+    numPending++;
+  }
+
+  getAuthorWorker(username).submit([username, catchUp]{
+    catchUp();
+    finishPost(username, -1);
+  });
+}
+
+void catchUpTimeline(const string& follower, const string& author, const string& followTime,
+                     const vector<string>& posts){
+  // The posts (newest first) are copied oldest first, in a single batch,
+  // except for those that the timeline has already
+  StoredFile timelinePostFile = getStoredFile(StoredFileType::TimelinePostFile, follower);
+  string dataType = "TIMELINE_POST";
+
+  map<string, string> matchArgs = {
+    {"ACTIVE", "1"},
+    {"USERNAME", follower},
+    {"AUTHOR", author}
+  };
+
+  set<pair<string, string>> copied; // Timestamp and text
+  for(string& copy : itemMatchSweep(timelinePostFile, dataType, matchArgs, -1)){
+    copied.insert(make_pair(extractField<TimelinePostFile>(copy, TimelinePostSchema::TIMESTAMP),
+                            extractField<TimelinePostFile>(copy, TimelinePostSchema::TEXT)));
+  }
+
+  WriteBatch batch;
+
+  for(auto post = posts.rbegin(); post != posts.rend(); post++){
+    string timestamp = getPostField(*post, ProfilePostSchema::TIMESTAMP);
+    string text = getPostField(*post, ProfilePostSchema::TEXT);
+    if(timestamp < followTime || copied.count(make_pair(timestamp, text))) continue;
+
+    TimelinePost timelinePost = {Active::Yes, follower, author, timestamp, unpad(text)};
+    batch.append(timelinePostFile, serializeTimelinePost(timelinePost));
+  }
+
+  batch.apply();
+}
+
+WorkerPool& getAuthorWorker(const string& author){
+  return *fanoutWorkers[hashUsername(FnvHash, author) % fanoutWorkers.size()];
+}
+
+void writeEntry(char kind, long intent, const string& serializedPost){
+  // Assumes that intentsAccess is held. Done entries aren't synced: if they're
+  // lost, their posts are fanned out again, which skips the timelines that
+  // already have them.
+  ostringstream entry;
+  entry << kind << setw(intentDigits) << setfill('0') << intent;
+  entry << serializedPost << string(getEntrySize() - 1 - intentDigits - serializedPost.length(), fillerChar);
+
+  string content = entry.str();
+  if(write(intentsFd, content.data(), content.length()) != (ssize_t) content.length())
+    throw std::runtime_error("Could not write to " + getFanoutLogPath());
+
+  numEntries++;
+}
+
+void compactIntents(){
+  // Assumes that intentsAccess is held and that no intents are being synced.
+  // The unfinished intents are written to a temporary file that then replaces
+  // the log (like saveStorageLayouts() does), so there's always a complete
+  // one. Every intent in it is synced, including those that weren't yet.
+  string tmpPath = getFanoutLogPath() + ".tmp";
+  int fd = open(tmpPath.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_APPEND, 0644);
+  if(fd == -1) throw std::runtime_error("Could not write " + tmpPath);
+
+  int oldFd = intentsFd;
+  intentsFd = fd;
+  numEntries = 0;
+
+  for(auto const& x : unfinishedIntents){ writeEntry(intentEntry, x.first, x.second); }
+
+  if(fsync(fd) == -1 || rename(tmpPath.c_str(), getFanoutLogPath().c_str()) == -1)
+    throw std::runtime_error("Could not compact " + getFanoutLogPath());
+
+  close(oldFd);
+  syncedIntents = nextIntent;
+}
+
+string getFanoutLogPath(){
+  // Next to the data files, like the write-ahead log
+  return STORAGE_FILES_PATH + "/fanout.log";
+}
+
+string getPostField(const string& serializedPost, ProfilePostSchema::Field field){
+  return extractField<ProfilePostFile>(serializedPost, field);
+}
+
+int getEntrySize(){
+  return 1 + intentDigits + configParams.at("SERIAL_SIZE_PROFILE_POST");
+}
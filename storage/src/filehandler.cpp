@@ -1,134 +1,574 @@
 #include <sstream>
-#include <fstream>
+#include <cstring>
+#include <iomanip>
 #include <stdexcept>
 #include <mutex>
 #include <memory>
+#include <future>
+#include <algorithm>
+#include <unordered_set>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include "config.h"
+#include "schema.h"
+#include "matchkernel.h"
 #include "serializers.h"
 #include "utils.h"
+#include "rwlock.h"
+#include "workerpool.h"
 #include "filehandler.h"
+#include "layout.h"
+#include "wal.h"
 using namespace std;
 
 
-// Map file paths to their respective files' mutexes
-map<string, shared_ptr<mutex>> fileMutexes = {};
-mutex fileMutexesAccess;
+// Every data file of the application, by type, then by generation (there are
+// two of them while resharding) and then by bucket. Built once by
+// openDataFiles() and never modified afterwards, so it's read without locks.
+vector<map<unsigned int, vector<shared_ptr<DataFile>>>> dataFiles;
 
-// Get a pointer to a mutex corresponding to a given file path
-// Ex.:
-//  auto mut = getDataFileMutex(someFilePath);
-//  unique_lock<mutex> lck(*mut); // how to use it
-shared_ptr<mutex> getDataFileMutex(const string& filePath){
-  unique_lock<mutex> lock(fileMutexesAccess);
+void openDataFiles(){
+  // Assumes that initiateStorage() has created all of the files
+  if(!dataFiles.empty()) return;
 
-  if(!fileMutexes.count(filePath)){
-    shared_ptr<mutex> mut(new mutex());
-    fileMutexes.insert(std::make_pair(filePath, mut));
+  if(getRingSize("TIMELINE_POST") && isChained("TIMELINE_POST"))
+    throw std::runtime_error("TIMELINE_RING_SIZE needs CHAINED_LAYOUT=0");
+
+  dataFiles.resize(storedFileTypes.size());
+
+  for(auto const& x : storedFileTypes){
+    for(auto const& layout : getOpenLayouts(x.first)){
+      for(unsigned int bucket = 0; bucket < layout.count; bucket++){
+        StoredFile storedFile = {x.first, bucket, layout.generation, nullptr};
+
+        shared_ptr<DataFile> dataFile(new DataFile());
+        dataFile->path = getStoredFilePath(storedFile);
+
+        dataFile->fd = open(dataFile->path.c_str(), O_RDWR);
+        if(dataFile->fd == -1) throw std::runtime_error("Could not open " + dataFile->path);
+
+        struct stat fileStat;
+        if(fstat(dataFile->fd, &fileStat) == -1)
+          throw std::runtime_error("Could not stat " + dataFile->path);
+
+        dataFile->size = fileStat.st_size;
+
+        // Files with the chained layout only need the newest item of each user.
+        // The others are indexed, next to the file (e.g. RELATION_3.idx).
+        if(isChained(x.second)){
+          dataFile->heads.open(dataFile->fd, dataFile->size, x.second);
+
+        }else{
+          dataFile->index.open(getStoredIndexPath(storedFile), dataFile->fd, dataFile->size, x.second);
+        }
+
+        dataFile->postsIndexed = x.first == StoredFileType::TimelinePostFile && !getRingSize(x.second);
+        if(dataFile->postsIndexed){
+          dataFile->posts.open(getStoredPostIndexPath(storedFile), dataFile->fd, dataFile->size, x.second,
+                               {"AUTHOR", "TIMESTAMP"});
+        }
+
+        dataFile->chained = isChained(x.second);
+        dataFile->migrated = false;
+        dataFile->flagChanges = 0;
+        dataFile->deactivated = 0;
+
+        dataFiles[x.first][layout.generation].push_back(dataFile);
+      }
+    }
+  }
+}
+
+void syncDataFiles(){
+  for(auto const& type : dataFiles){
+    for(auto const& generation : type){
+      for(auto const& dataFile : generation.second){
+        if(fsync(dataFile->fd) == -1) throw std::runtime_error("Could not sync " + dataFile->path);
+      }
+    }
+  }
+}
+
+DataFile& getDataFile(const StoredFile& storedFile){
+  if(dataFiles.empty())
+    throw std::runtime_error("No data files are open. Likely that configServer() has not been called.");
+
+  auto generation = dataFiles[storedFile.type].find(storedFile.generation);
+  if(generation == dataFiles[storedFile.type].end())
+    throw std::runtime_error("No data files of generation " + to_string(storedFile.generation) + " are open");
+
+  return *generation->second.at(storedFile.bucket);
+}
+
+// How LReader reads the items of a file (READER_BACKEND in config.txt)
+enum ReaderBackend{
+  ItemBackend = 0,  // pread() of every item
+  MmapBackend = 1,  // Pointer arithmetic on a mapping of the whole file
+  BlockBackend = 2, // pread() of READER_BLOCK_SIZE bytes at a time
+};
+
+// Read-only mapping of a data file as it was when it was mapped. Readers hold
+// onto it while they scan, even if the file is remapped in the meantime.
+struct FileMapping{
+  const char* data;
+  size_t size;
+
+  FileMapping(int fd, size_t size) : data(NULL), size(size){
+    // Empty files can't be mapped (and there's nothing to read from them)
+    if(!size) return;
+
+    void* mapped = mmap(NULL, size, PROT_READ, MAP_SHARED, fd, 0);
+    if(mapped == MAP_FAILED) throw std::runtime_error("Could not map data file");
+
+    data = (const char*) mapped;
+  }
+
+  ~FileMapping(){
+    if(data) munmap((void*) data, size);
+  }
+};
+
+// Get a mapping of the first size bytes of the file (those that have been
+// published). Files are only remapped when they have grown since they were last
+// mapped.
+shared_ptr<FileMapping> getFileMapping(DataFile& dataFile, size_t size){
+  unique_lock<mutex> lock(dataFile.mappingAccess);
+
+  if(!dataFile.mapping || dataFile.mapping->size != size){
+    dataFile.mapping = shared_ptr<FileMapping>(new FileMapping(dataFile.fd, size));
+  }
+
+  return dataFile.mapping;
+}
+
+// Read the part of a file between two offsets, locking it while doing so
+vector<char> readBlock(DataFile* dataFile, int start, int end){
+  vector<char> block(end - start);
+  SharedLock lck(dataFile->items);
+
+  for(size_t numRead = 0; numRead < block.size();){
+    ssize_t n = pread(dataFile->fd, block.data() + numRead, block.size() - numRead, start + numRead);
+
+    if(n <= 0) throw std::runtime_error("Could not read data file");
+    numRead += n;
   }
 
-  return fileMutexes.at(filePath);
+  return block;
 }
 
+// Workers that read the blocks that readers are about to need
+WorkerPool& getPrefetchers(){
+  static WorkerPool prefetchers;
+  return prefetchers;
+}
+
+WorkerPool& getFileWorkers(){
+  static WorkerPool fileWorkers;
+  return fileWorkers;
+}
+
+// Number of items that scans match at once (see matchkernel.h)
+const size_t scanBatchSize = 256;
+
 class LReader {
 public:
-  LReader(const string& filePath, const string& dataType) : filePath(filePath){
-    // Iterator which locks the relevant file according to the provided filePath
+  LReader(const StoredFile& storedFile, const string& dataType, const map<string, string>& matchArgs)
+    : matchedDataFile(::getDataFile(storedFile)), compacting(matchedDataFile.compaction){
+    // Iterator which locks the relevant file according to the provided storedFile.
+    // If matchArgs only asks for the items of one user, it only visits those.
+    // The file isn't swapped for a compacted copy while the iterator exists.
 
     // Make sure that the type of stored data in the application is valid
-    if(configParams.at("FILE_COUNT_" + dataType) == -1)
-      throw std::runtime_error("Given dataType is unknown");
+    // (throws otherwise)
+    const RecordLayout& layout = getRecordLayout(dataType);
 
-    // Size of each item in the file (allows to analyze one-by-one)
-    itemSize = configParams.at("SERIAL_SIZE_" + dataType);
+    // Size of each item in the file (allows to analyze one-by-one). With the
+    // chained layout, items are followed by the position of the previous one.
+    chained = isChained(dataType);
+    itemSize = getRecordSize(dataType);
+    serialSize = layout.serialSize;
 
     // Start from the bottom of the file
     offsetFromEnd = 0;
 
-    // Save the mutex that corresponds to the file we're observing
-    matchedFileMut = getDataFileMutex(filePath);
-    unique_lock<mutex> lck(*matchedFileMut);
+    // Only the items that had been fully appended by now are read (the file
+    // itself is already open). If they all belong to one user, only that
+    // user's items are visited: they're either chained from the newest one or
+    // looked up in the index.
+    auto owner = matchArgs.find(getOwnerField(dataType));
+    following = chained && owner != matchArgs.end();
+    indexed = !chained && owner != matchArgs.end();
+
+    if(following){
+      long publishedSize;
+      nextPosition = matchedDataFile.heads.find(owner->second, publishedSize, matchedDataFile.size);
+      fileSize = publishedSize;
 
-    // Open this for reads and writes
-    matchedFile = fopen(filePath.c_str(), "rb+");
+    }else{
+      fileSize = matchedDataFile.size.load();
+    }
+
+    if(indexed){
+      positions = matchedDataFile.index.find(owner->second, fileSize);
+
+      // Rings are visited from their newest item back to their oldest one
+      if(getRingSize(dataType) && !positions.empty()) positions = getRingPositions(dataType, positions[0]);
+      cursor = positions.size();
+    }
 
-    fileSize = getFileSize(filePath);
+    if(configParams.at("READER_BACKEND") == MmapBackend){
+      // The items are read straight from memory
+      mapping = getFileMapping(matchedDataFile, fileSize);
+    }
+
+    // Blocks hold a whole number of items (at least one). Readers that skip
+    // from item to item don't read whole blocks.
+    if(configParams.at("READER_BACKEND") == BlockBackend && !indexed && !following){
+      blockLength = max(1, configParams.at("READER_BLOCK_SIZE") / itemSize) * itemSize;
+    }else{
+      blockLength = 0;
+    }
+
+    blockStart = blockEnd = fileSize;
+    prefetching = false;
   }
 
   ~LReader() {
-    unique_lock<mutex> lck(*matchedFileMut);
-    fclose(matchedFile);
+    // The prefetch may still be reading from the file
+    if(prefetching) prefetched.wait();
   }
 
-  bool hasNext() { return offsetFromEnd < fileSize; }
+  bool hasNext() {
+    if(following) return nextPosition != -1;
+    if(indexed) return cursor > 0;
+
+    return offsetFromEnd + itemSize <= fileSize;
+  }
 
   string next() {
+    string item;
+    next(item);
+
+    return item;
+  }
+
+  // Same, into item, whose buffer is reused from one item to the next (so
+  // scans don't allocate one per item)
+  void next(string& item) {
     if(hasNext()){
-      offsetFromEnd += itemSize;
-      return readItem(offsetFromEnd);
+      advance();
+
+      item.resize(itemSize);
+      readItem(offsetFromEnd, &item[0]);
+      if(following) nextPosition = matchedDataFile.heads.previous(item.data());
+      if(chained) item.resize(serialSize);
 
     }else{
-      return string();
+      item.clear();
+    }
+  }
+
+  // Match up to maxItems of the items that next() would return at once, and
+  // add the positions of those that match (and, if matches isn't null, the
+  // items themselves) to the end of positions, in the same order. Readers that
+  // go through the whole file with MmapBackend or BlockBackend match the
+  // items where they already are; the others read them into a buffer first.
+  // Returns how many items were visited.
+  size_t nextMatches(const BatchMatcher& matcher, size_t maxItems, vector<long>& positions,
+                     string* matches = nullptr) {
+    if(!indexed && !following && (mapping || blockLength)){
+      // The next items come before the last one, one after the other
+      long end = fileSize - offsetFromEnd;
+      size_t numItems = min(maxItems, (size_t) (end / itemSize));
+      if(!numItems) return 0;
+
+      if(blockLength){
+        if(end - itemSize < blockStart || end > blockEnd) loadBlock(end - itemSize);
+        numItems = min(numItems, (size_t) ((end - blockStart) / itemSize));
+      }
+
+      long first = end - numItems * itemSize;
+      offsetFromEnd += numItems * itemSize;
+
+      if(mapping){
+        // The items may change while they're matched and copied (see readItem())
+        SharedLock lck(matchedDataFile.items);
+        collectMatches(matcher, mapping->data + first, numItems, first, true, positions, matches);
+
+      }else{
+        collectMatches(matcher, block.data() + first - blockStart, numItems, first, true, positions, matches);
+      }
+
+      return numItems;
+    }
+
+    batchItems.resize(maxItems * itemSize);
+    batchPositions.clear();
+
+    while(batchPositions.size() < maxItems && hasNext()){
+      advance();
+
+      char* record = &batchItems[batchPositions.size() * itemSize];
+      readItem(offsetFromEnd, record);
+      if(following) nextPosition = matchedDataFile.heads.previous(record);
+
+      batchPositions.push_back(getItemPosition());
     }
+
+    size_t numItems = batchPositions.size();
+    if(numItems) collectMatches(matcher, batchItems.data(), numItems, -1, false, positions, matches);
+
+    return numItems;
   }
 
-  bool hasPrev() { return offsetFromEnd >= itemSize; }
+  // Chains only lead backwards
+  bool hasPrev() {
+    if(following) return false;
+    if(indexed) return cursor + 1 < positions.size();
+
+    return offsetFromEnd >= itemSize;
+  }
 
   string prev() {
     if(hasPrev()){
-      offsetFromEnd -= itemSize;
-      return readItem(offsetFromEnd);
+      offsetFromEnd = indexed ? fileSize - positions[++cursor] : offsetFromEnd - itemSize;
+
+      string item(itemSize, '\0');
+      readItem(offsetFromEnd, &item[0]);
+      if(chained) item.resize(serialSize);
+
+      return item;
 
     }else{
       return string();
     }
   }
 
-  int getItemSize() { return itemSize; }
+  int getItemSize() { return serialSize; }
 
   int getReadPtr() { return offsetFromEnd; }
 
-  FILE* getFilePtr() { return matchedFile; }
+  // Offset of the last item that was read from the start of the file
+  int getItemPosition() { return fileSize - offsetFromEnd; }
+
+  DataFile& getDataFile() { return matchedDataFile; }
 
 private:
-  const string& filePath;
-  FILE* matchedFile;
-  shared_ptr<mutex> matchedFileMut;
+  DataFile& matchedDataFile;
+  SharedLock compacting;
+  shared_ptr<FileMapping> mapping; // Only used by MmapBackend
   int fileSize;
-  int itemSize;
+  int itemSize;   // Size of each record (what is read)
+  int serialSize; // Size of each item (what is returned)
   int offsetFromEnd;
 
-  string readItem(int offsetFromEnd) {
-    // Lock the relevant file before reading each item (maximize granularity)
-    char buff[itemSize];
-    unique_lock<mutex> lck(*matchedFileMut);
+  // Chained layout: position of the next item of the user to visit
+  bool chained, following;
+  long nextPosition;
+
+  // Positions of the items that are visited, if they come from the index
+  bool indexed;
+  vector<long> positions;
+  size_t cursor;
+
+  // Only used by nextMatches(), for the items that it reads: the items and
+  // their positions, and which ones matched
+  string batchItems;
+  vector<long> batchPositions;
+  vector<uint64_t> matched;
+
+  // Only used by BlockBackend: the items between blockStart and blockEnd (in
+  // bytes from the start of the file), and the block that is being read ahead
+  vector<char> block;
+  int blockLength, blockStart, blockEnd;
+  future<vector<char>> prefetched;
+  int prefetchStart, prefetchEnd;
+  bool prefetching;
+
+  vector<long> getRingPositions(const string& dataType, long header) {
+    // Slots that have been written, in the order in which they were written
+    // (the header counts them)
+    string record(itemSize, '\0');
+    {
+      SharedLock lck(matchedDataFile.items);
+      if(pread(matchedDataFile.fd, &record[0], itemSize, header) != itemSize)
+        throw std::runtime_error("Could not read data file");
+    }
+
+    long count = stol(extractField<TimelinePostFile>(record, TimelinePostSchema::TIMESTAMP));
+    long ringSize = getRingSize(dataType);
+
+    vector<long> slots;
+    for(long k = max(0L, count - ringSize); k < count; k++){
+      slots.push_back(header + itemSize * (1 + k % ringSize));
+    }
+
+    return slots;
+  }
+
+  void advance() {
+    // Move to the next item (assumes that there's one)
+    if(following) offsetFromEnd = fileSize - nextPosition;
+    else if(indexed) offsetFromEnd = fileSize - positions[--cursor];
+    else offsetFromEnd += itemSize;
+  }
+
+  void readItem(int offsetFromEnd, char* item) {
+    // Read itemSize bytes into item. Lock the relevant file before reading
+    // each item (maximize granularity). Other readers hold the same lock at
+    // the same time; only changes to the items that were already there
+    // (setActiveFlag()) exclude them.
+    if(mapping){
+      SharedLock lck(matchedDataFile.items);
+      memcpy(item, mapping->data + fileSize - offsetFromEnd, itemSize);
+      return;
+    }
+
+    if(blockLength){
+      // Blocks are locked as a whole when they're read
+      int position = fileSize - offsetFromEnd;
+
+      if(position < blockStart || position + itemSize > blockEnd) loadBlock(position);
+      memcpy(item, block.data() + position - blockStart, itemSize);
+      return;
+    }
+
+    SharedLock lck(matchedDataFile.items);
+
+    // The end of the file moves as items are appended: count from the start
+    if(pread(matchedDataFile.fd, item, itemSize, fileSize - offsetFromEnd) != itemSize)
+      throw std::runtime_error("Could not read data file");
+  }
+
+  void collectMatches(const BatchMatcher& matcher, const char* items, size_t numItems, long first,
+                      bool inFileOrder, vector<long>& positions, string* matches) {
+    // Items are either in the order of the file, starting at position first,
+    // or in the order of next(), at batchPositions
+    matcher.match(items, numItems, itemSize, matched);
+
+    for(size_t n = 0; n < numItems; n++){
+      size_t i = inFileOrder ? numItems - 1 - n : n;
+      if(!isMatch(matched, i)) continue;
+
+      positions.push_back(inFileOrder ? first + i * itemSize : batchPositions[i]);
+      if(matches) matches->append(items + i * itemSize, serialSize);
+    }
+  }
+
+  void loadBlock(int position) {
+    // Read the block that holds the item at the given position. Readers
+    // usually move backwards (next()), so the block ends with the item unless
+    // the reader is moving forward (prev()).
+    bool backwards = position < blockStart;
+    bool firstBlock = blockStart == blockEnd;
+    int start, end;
+
+    if(backwards){
+      end = position + itemSize;
+      start = max(0, end - blockLength);
+    }else{
+      start = position;
+      end = min(fileSize, start + blockLength);
+    }
+
+    bool fetched = false;
+
+    if(prefetching){
+      prefetching = false;
+
+      if(prefetchStart == start && prefetchEnd == end){
+        block = prefetched.get();
+        fetched = true;
+
+      }else{
+        prefetched.wait();
+      }
+    }
+
+    if(!fetched) block = readBlock(&matchedDataFile, start, end);
+
+    blockStart = start;
+    blockEnd = end;
 
-    fseek(matchedFile, -offsetFromEnd, SEEK_END);
-    fread(buff, itemSize, 1, matchedFile);
+    // Once the scan has gone past its first block, it's likely to go on: read
+    // the one before this one while this one is being served
+    if(backwards && !firstBlock && start > 0){
+      prefetchEnd = start;
+      prefetchStart = max(0, start - blockLength);
 
-    buff[itemSize] = '\0'; // Cap the garbage (without this, it is appended)
-    return string(buff);
+      auto task = make_shared<packaged_task<vector<char>()>>(
+        bind(readBlock, &matchedDataFile, prefetchStart, prefetchEnd)
+      );
+
+      prefetched = task->get_future();
+      prefetching = true;
+
+      getPrefetchers().submit([task] { (*task)(); });
+    }
   }
 };
 
-void appendToDataFile(const string& filePath, const string& content){
-  ofstream outfile;
+void writeRecords(DataFile& dataFile, const string& records, long position);
+
+void publishRecords(DataFile& dataFile, const string& records, long position);
+
+vector<pair<long, string>> placeInRings(DataFile& dataFile, const string& dataType,
+                                        const string& content, long end);
+
+string getRingHeader(const string& owner, long count);
 
-  // This entails access of a shared resource, so use a lock.
-  auto mut = getDataFileMutex(filePath);
-  unique_lock<mutex> lck(*mut);
+void appendToDataFile(const StoredFile& storedFile, const string& content){
+  // Appends only contend with other appends: readers don't look past the size
+  // that was published when they started, so they aren't locked out.
+  DataFile& dataFile = getDataFile(storedFile);
+  SharedLock compacting(dataFile.compaction);
+  unique_lock<mutex> lck(dataFile.appends);
 
-  outfile.open(filePath, ios_base::app);
-  outfile << content;
+  // Every append goes through here, so the published size is the end of the file
+  long end = dataFile.size.load();
+  string records = dataFile.chained ? dataFile.heads.chain(content, end) : content;
+  auto logged = logAppend(storedFile, end, records);
+
+  writeRecords(dataFile, records, end);
+  publishRecords(dataFile, records, end);
+}
+
+void writeRecords(DataFile& dataFile, const string& records, long position){
+  for(size_t numWritten = 0; numWritten < records.length();){
+    ssize_t n = pwrite(dataFile.fd, records.data() + numWritten, records.length() - numWritten,
+                       position + numWritten);
+
+    if(n <= 0) throw std::runtime_error("Could not append to " + dataFile.path);
+    numWritten += n;
+  }
 }
 
-int itemMatch(const string& filePath, string& dataType, const map<string, string> matchArgs){
+void publishRecords(DataFile& dataFile, const string& records, long position){
+  // Publish the new items once all of them are in the file (and in the index,
+  // or at the heads of their chains)
+  if(dataFile.chained){
+    dataFile.heads.publish(dataFile.size, position + records.length());
+
+  }else{
+    dataFile.index.add(records, position);
+    dataFile.size += records.length();
+  }
+
+  if(dataFile.postsIndexed) dataFile.posts.add(records, position);
+}
+
+int itemMatch(const StoredFile& storedFile, string& dataType, const map<string, string>& matchArgs){
   // Iterate through the relevant file and determine whether there's a match
-  LReader reader = LReader(filePath, dataType);
+  LReader reader(storedFile, dataType, matchArgs);
+  MatchPredicate predicate(dataType, matchArgs);
+  string item;
 
   while(reader.hasNext()){
-    auto item = reader.next();
+    reader.next(item);
 
-    if(matchesSerialized(item, dataType, matchArgs)){
+    if(predicate.matches(item)){
       return reader.getReadPtr();
     }
   }
@@ -136,26 +576,36 @@ int itemMatch(const string& filePath, string& dataType, const map<string, string
   return -1;
 }
 
-vector<string> itemMatchSweep(const string& filePath, string& dataType, map<string, string> matchArgs, int limit){
-  // Iterate through the relevant file and obtain the matches
+vector<string> itemMatchSweep(const StoredFile& storedFile, string& dataType,
+                              const map<string, string>& matchArgs, int limit){
+  // Iterate through the relevant file and obtain the matches, a batch of items
+  // at a time (no more than are still wanted)
 
   vector<string> allMatches;
   if(!limit) return allMatches;
 
-  LReader reader = LReader(filePath, dataType);
+  LReader reader(storedFile, dataType, matchArgs);
+  BatchMatcher matcher(MatchPredicate(dataType, matchArgs));
+  int serialSize = reader.getItemSize();
 
-  while(reader.hasNext()){
-    auto item = reader.next();
+  string matches;
+  vector<long> positions;
 
+  for(;;){
     // Compare each item to its corresponding serialized version using the
-    // criteria listed by matchArgs
-    if(matchesSerialized(item, dataType, matchArgs)){
-      // Append to the vector of known matches. Return if we have enough.
-      // Interpret limit == -1 to mean "take all".
-      allMatches.push_back(item);
+    // criteria listed by matchArgs (only the matches are copied)
+    size_t wanted = limit == -1 ? scanBatchSize : min(scanBatchSize, limit - allMatches.size());
+    matches.clear();
+
+    if(!reader.nextMatches(matcher, wanted, positions, &matches)) break;
+
+    // Append to the vector of known matches. Return if we have enough.
+    // Interpret limit == -1 to mean "take all".
+    for(size_t offset = 0; offset < matches.length(); offset += serialSize){
+      allMatches.push_back(matches.substr(offset, serialSize));
 
       if(limit != -1 && (int) allMatches.size() >= limit){
-        break;
+        return allMatches;
       }
     }
   }
@@ -163,37 +613,569 @@ vector<string> itemMatchSweep(const string& filePath, string& dataType, map<stri
   return allMatches;
 }
 
-int setActiveFlag(bool active, const string& filePath, string& dataType, map<string, string> matchArgs){
+int setActiveFlag(bool active, const StoredFile& storedFile, string& dataType,
+                  const map<string, string>& matchArgs){
   // There's supposed to be a '1' if the item is active and a '0' if it's not
   char activeFlag = active ? '1' : '0';
   unsigned int numModified = 0;
 
-  LReader reader = LReader(filePath, dataType);
+  LReader reader(storedFile, dataType, matchArgs);
+  BatchMatcher matcher(MatchPredicate(dataType, matchArgs));
+  vector<long> positions;
 
-  // Might need the file's mutex when tweaking the active bit after calling
-  // matchesSerialized()
-  auto mut = getDataFileMutex(filePath);
+  // Might need to lock readers out of the file when tweaking the active bit
+  // after matching the item
+  DataFile& dataFile = reader.getDataFile();
 
-  while(reader.hasNext()){
-    auto item = reader.next();
+  // Compare each item to its corresponding serialized version using the
+  // criteria listed by matchArgs
+  while(reader.nextMatches(matcher, scanBatchSize, positions)){
+    // The matches of each scan batch are logged together, so that a sweep
+    // waits for the log once per batch rather than once per item
+    if(positions.empty()) continue;
 
-    // Compare each item to its corresponding serialized version using the
-    // criteria listed by matchArgs
-    if(matchesSerialized(item, dataType, matchArgs)){
+    vector<LoggedChange> changes;
+    for(long position : positions){ changes.push_back({false, storedFile, position, string(1, activeFlag)}); }
+
+    auto logged = logBatch(changes);
+
+    for(long position : positions){
       // For each successful match, step back, modify the active bit to be
       // what was specified, and keep going.
-      unique_lock<mutex> lck(*mut);
+      ExclusiveLock lck(dataFile.items);
 
-      auto filePtr = reader.getFilePtr();
-      auto currReadPtr = reader.getReadPtr();
+      if(pwrite(dataFile.fd, &activeFlag, 1, position) != 1)
+        throw std::runtime_error("Could not write to " + dataFile.path);
 
-      fseek(filePtr, -currReadPtr, SEEK_END);
-      fwrite(&activeFlag, 1, 1, filePtr);
-      fseek(filePtr, -currReadPtr, SEEK_END);
+      dataFile.flagChanges++;
+      if(!active) dataFile.deactivated++;
 
       numModified++;
     }
+
+    positions.clear();
   }
 
   return numModified;
 }
+
+void WriteBatch::append(const StoredFile& storedFile, const string& content){
+  getBatchedFile(storedFile).content += content;
+}
+
+int WriteBatch::setActiveFlag(bool active, const StoredFile& storedFile, string& dataType,
+                              const map<string, string>& matchArgs, int* flipped){
+  // The positions stay valid since the file isn't compacted in the meantime
+  hold(storedFile);
+
+  char activeFlag = active ? '1' : '0';
+  BatchedFile& batched = getBatchedFile(storedFile);
+  vector<long> positions = itemMatchPositions(storedFile, dataType, matchArgs);
+
+  for(long position : positions){ batched.flags.push_back(make_tuple(position, activeFlag, flipped)); }
+
+  return positions.size();
+}
+
+void WriteBatch::hold(const StoredFile& storedFile){
+  BatchedFile& batched = getBatchedFile(storedFile);
+  if(!batched.compacting) batched.compacting = make_shared<SharedLock>(getDataFile(storedFile).compaction);
+}
+
+void WriteBatch::setActiveFlag(bool active, const StoredFile& storedFile, const vector<long>& positions){
+  char activeFlag = active ? '1' : '0';
+  BatchedFile& batched = getBatchedFile(storedFile);
+
+  for(long position : positions){ batched.flags.push_back(make_tuple(position, activeFlag, nullptr)); }
+}
+
+vector<long> itemMatchPositions(const StoredFile& storedFile, string& dataType,
+                                const map<string, string>& matchArgs){
+  LReader reader(storedFile, dataType, matchArgs);
+  BatchMatcher matcher(MatchPredicate(dataType, matchArgs));
+  vector<long> positions;
+
+  while(reader.nextMatches(matcher, scanBatchSize, positions)){}
+
+  return positions;
+}
+
+bool hasPostIndex(const StoredFile& storedFile){
+  // Files with rings overwrite their items, so their post index (if they had
+  // one before) can't be trusted
+  return getDataFile(storedFile).postsIndexed && !getRingSize(storedFileTypes.at(storedFile.type));
+}
+
+long countItems(const StoredFile& storedFile, const string& username){
+  DataFile& dataFile = getDataFile(storedFile);
+  return dataFile.chained ? -1 : (long) dataFile.index.count(username);
+}
+
+int WriteBatch::setPostActiveFlag(bool active, const StoredFile& storedFile, const string& owner,
+                                  const string& author, const string& timestamp){
+  // Without a post index, the owner's items are read instead
+  string dataType = "TIMELINE_POST";
+  DataFile& dataFile = getDataFile(storedFile);
+
+  if(!hasPostIndex(storedFile)){
+    map<string, string> matchArgs = {
+      {"ACTIVE", active ? "0" : "1"},
+      {"USERNAME", owner},
+      {"AUTHOR", author},
+      {"TIMESTAMP", timestamp}
+    };
+
+    return setActiveFlag(active, storedFile, dataType, matchArgs);
+  }
+
+  BatchedFile& batched = getBatchedFile(storedFile);
+  if(!batched.compacting) batched.compacting = make_shared<SharedLock>(dataFile.compaction);
+
+  string key = author + ":" + timestamp;
+  auto found = batched.postCopies.find(key);
+
+  if(found == batched.postCopies.end()){
+    // Positions only point at copies of the post (items are never moved
+    // without rebuilding the index), whose flags may have changed since
+    int recordSize = getRecordSize(dataType);
+    string record(recordSize, '\0');
+
+    found = batched.postCopies.insert(make_pair(key, unordered_multimap<string, long>())).first;
+
+    for(long position : dataFile.posts.find(key, dataFile.size)){
+      {
+        SharedLock lck(dataFile.items);
+        if(pread(dataFile.fd, &record[0], recordSize, position) != recordSize)
+          throw std::runtime_error("Could not read " + dataFile.path);
+      }
+
+      if(extractField<TimelinePostFile>(record, TimelinePostSchema::ACTIVE) == (active ? "1" : "0")) continue;
+      found->second.insert(make_pair(unpad(extractField<TimelinePostFile>(record, TimelinePostSchema::USERNAME)),
+                                     position));
+    }
+  }
+
+  char activeFlag = active ? '1' : '0';
+  int numFound = 0;
+
+  auto copies = found->second.equal_range(owner);
+  for(auto copy = copies.first; copy != copies.second; copy++){
+    batched.flags.push_back(make_tuple(copy->second, activeFlag, nullptr));
+    numFound++;
+  }
+
+  // Asking for them again doesn't change them twice
+  found->second.erase(owner);
+  return numFound;
+}
+
+void WriteBatch::upsert(const StoredFile& storedFile, const string& record,
+                        const map<string, string>& keyArgs, bool* changed){
+  getBatchedFile(storedFile).upserts.push_back(make_tuple(record, keyArgs, changed));
+}
+
+void WriteBatch::apply(){
+  // Every file is locked (as appendToDataFile() does) before anything is
+  // logged, so that the positions of the appends are known. Files are locked
+  // in the order of the map, which is the same for every batch.
+  vector<unique_lock<mutex>> appending;
+  vector<LoggedChange> changes;
+
+  for(auto& x : files){
+    BatchedFile& batched = x.second;
+    DataFile& dataFile = getDataFile(batched.storedFile);
+    if(!batched.compacting) batched.compacting = make_shared<SharedLock>(dataFile.compaction);
+
+    // Upserts are looked up, and flags compared, once no other batch can
+    // change the file
+    if(!batched.content.empty() || !batched.upserts.empty() || !batched.flags.empty()){
+      appending.push_back(unique_lock<mutex>(dataFile.appends));
+      resolveUpserts(batched);
+      resolveFlags(batched);
+    }
+
+    for(auto const& flag : batched.flags){
+      changes.push_back({false, batched.storedFile, get<0>(flag), string(1, get<1>(flag))});
+    }
+
+    for(auto const& overwrite : batched.overwrites){
+      changes.push_back({true, batched.storedFile, overwrite.first, overwrite.second});
+    }
+
+    if(batched.content.empty()) continue;
+
+    long end = dataFile.size.load();
+    string dataType = storedFileTypes.at(batched.storedFile.type);
+
+    if(getRingSize(dataType)){
+      // Items overwrite the oldest ones in their users' rings: only new rings
+      // are appended
+      for(auto const& write : placeInRings(dataFile, dataType, batched.content, end)){
+        changes.push_back({true, batched.storedFile, write.first, write.second});
+      }
+
+      continue;
+    }
+
+    if(dataFile.chained) batched.content = dataFile.heads.chain(batched.content, end);
+
+    changes.push_back({true, batched.storedFile, end, batched.content});
+  }
+
+  if(!changes.empty()){
+    auto logged = logBatch(changes);
+
+    for(auto const& change : changes){
+      DataFile& dataFile = getDataFile(change.storedFile);
+
+      if(change.append && change.position >= dataFile.size){
+        writeRecords(dataFile, change.data, change.position);
+        publishRecords(dataFile, change.data, change.position);
+        continue;
+      }
+
+      // Readers may be looking at the items that are overwritten (which
+      // compaction has to copy again, like flags)
+      ExclusiveLock lck(dataFile.items);
+
+      if(change.append){
+        writeRecords(dataFile, change.data, change.position);
+        dataFile.flagChanges++;
+        continue;
+      }
+
+      if(pwrite(dataFile.fd, change.data.data(), 1, change.position) != 1)
+        throw std::runtime_error("Could not write to " + dataFile.path);
+
+      dataFile.flagChanges++;
+      if(change.data[0] == '0') dataFile.deactivated++;
+    }
+  }
+
+  // Let the files go (in the opposite order)
+  while(!appending.empty()) appending.pop_back();
+  files.clear();
+}
+
+void WriteBatch::resolveUpserts(BatchedFile& batched){
+  // Assumes that the appends mutex is held, so the newest item with the key
+  // fields is either in the file already or in the batch. Only that one is
+  // read: it supersedes the older ones. It's overwritten as a whole (only the
+  // part that readers return, in chained files), since the fields that aren't
+  // keys may have changed (e.g. the time of a follow).
+  string dataType = storedFileTypes.at(batched.storedFile.type);
+  const RecordLayout& layout = getRecordLayout(batched.storedFile.type);
+  const FieldBounds& activeField = layout.getField("ACTIVE");
+  int serialSize = layout.serialSize;
+
+  for(auto const& x : batched.upserts){
+    const string& record = get<0>(x);
+    const map<string, string>& keyArgs = get<1>(x);
+    bool* changed = get<2>(x);
+
+    MatchPredicate predicate(dataType, keyArgs);
+    bool batchedAlready = false;
+
+    for(size_t offset = 0; !batchedAlready && offset + serialSize <= batched.content.length();
+        offset += serialSize){
+      batchedAlready = predicate.matches(batched.content.data() + offset);
+    }
+
+    if(changed) *changed = false;
+    if(batchedAlready) continue;
+
+    LReader reader(batched.storedFile, dataType, keyArgs);
+    bool found = false;
+    string item;
+
+    while(!found && reader.hasNext()){
+      reader.next(item);
+      if(!predicate.matches(item)) continue;
+
+      found = true;
+      if(extractField(item, activeField) != "1"){
+        batched.overwrites.push_back(make_pair(reader.getItemPosition(), record));
+        if(changed) *changed = true;
+      }
+    }
+
+    if(!found){
+      batched.content += record;
+      if(changed) *changed = true;
+    }
+  }
+
+  batched.upserts.clear();
+}
+
+void WriteBatch::resolveFlags(BatchedFile& batched){
+  // Assumes that the appends mutex is held. Flags that are already what the
+  // batch would set them to (e.g. because a concurrent batch got there first)
+  // are dropped, so that they're neither written nor counted.
+  DataFile& dataFile = getDataFile(batched.storedFile);
+  map<long, char> current;
+  vector<tuple<long, char, int*>> flipping;
+
+  for(auto const& flag : batched.flags){
+    long position = get<0>(flag);
+    auto known = current.find(position);
+
+    if(known == current.end()){
+      char onDisk;
+      SharedLock lck(dataFile.items);
+
+      if(pread(dataFile.fd, &onDisk, 1, position) != 1)
+        throw std::runtime_error("Could not read " + dataFile.path);
+
+      known = current.insert(make_pair(position, onDisk)).first;
+    }
+
+    if(known->second == get<1>(flag)) continue;
+
+    known->second = get<1>(flag);
+    if(get<2>(flag)) (*get<2>(flag))++;
+    flipping.push_back(flag);
+  }
+
+  batched.flags.swap(flipping);
+}
+
+vector<pair<long, string>> placeInRings(DataFile& dataFile, const string& dataType,
+                                        const string& content, long end){
+  // Assumes that the appends mutex is held (and that these are timeline
+  // posts, the only items kept in rings). Each user's ring is a header (an
+  // inactive item whose timestamp counts the items that the user has been
+  // given) followed by its slots, and is found through the index. Users that
+  // don't have one yet get one at the end of the file.
+  int ringSize = getRingSize(dataType);
+  int recordSize = getRecordSize(dataType);
+
+  map<string, pair<long, long>> rings; // Header and count, by user
+  map<long, string> writes;            // By position (the last write wins)
+  string appended;
+
+  for(size_t offset = 0; offset + recordSize <= content.length(); offset += recordSize){
+    string record = content.substr(offset, recordSize);
+    string owner = unpad(extractField<TimelinePostFile>(record, TimelinePostSchema::USERNAME));
+
+    auto ring = rings.find(owner);
+    if(ring == rings.end()){
+      vector<long> positions = dataFile.index.find(owner, end);
+      long header = end + appended.length(), count = 0;
+
+      if(positions.empty()){
+        for(int slot = 0; slot <= ringSize; slot++){ appended += getRingHeader(owner, 0); }
+
+      }else{
+        string headerRecord(recordSize, '\0');
+        header = positions[0];
+
+        if(pread(dataFile.fd, &headerRecord[0], recordSize, header) != recordSize)
+          throw std::runtime_error("Could not read " + dataFile.path);
+
+        count = stol(extractField<TimelinePostFile>(headerRecord, TimelinePostSchema::TIMESTAMP));
+      }
+
+      ring = rings.insert(make_pair(owner, make_pair(header, count))).first;
+    }
+
+    long& count = ring->second.second;
+    writes[ring->second.first + (long) recordSize * (1 + count % ringSize)] = record;
+    count++;
+  }
+
+  for(auto const& ring : rings){ writes[ring.second.first] = getRingHeader(ring.first, ring.second.second); }
+
+  // Writes to the new rings are made before they're appended
+  vector<pair<long, string>> placed;
+
+  for(auto const& write : writes){
+    if(write.first >= end) appended.replace(write.first - end, recordSize, write.second);
+    else placed.push_back(write);
+  }
+
+  if(!appended.empty()) placed.push_back(make_pair(end, appended));
+  return placed;
+}
+
+string getRingHeader(const string& owner, long count){
+  // Also what empty slots hold
+  ostringstream counted;
+  counted << setw(configParams.at("FIELD_SIZE_TIMESTAMP")) << setfill('0') << count;
+
+  TimelinePost header = {Active::No, owner, "", counted.str(), ""};
+  return serializeTimelinePost(header);
+}
+
+WriteBatch::BatchedFile& WriteBatch::getBatchedFile(const StoredFile& storedFile){
+  auto key = make_tuple(storedFile.type, storedFile.generation, storedFile.bucket);
+
+  auto batched = files.find(key);
+  if(batched == files.end()){
+    batched = files.insert(make_pair(key, BatchedFile())).first;
+    batched->second.storedFile = storedFile;
+  }
+
+  return batched->second;
+}
+
+// Read the items (without their chain fields) between two positions of a file,
+// a chunk at a time
+string readItems(DataFile& dataFile, const string& dataType, long start, long end,
+                 const function<void(long)>& pace){
+  int recordSize = getRecordSize(dataType);
+  int serialSize = getRecordLayout(dataType).serialSize;
+  long chunkSize = max(1, configParams.at("READER_BLOCK_SIZE") / recordSize) * recordSize;
+
+  string items;
+  items.reserve((end - start) / recordSize * serialSize);
+
+  for(long chunkStart = start; chunkStart < end; chunkStart += chunkSize){
+    long chunkEnd = min(end, chunkStart + chunkSize);
+    if(pace) pace(chunkEnd - chunkStart);
+
+    vector<char> chunk = readBlock(&dataFile, chunkStart, chunkEnd);
+
+    for(long offset = 0; offset + recordSize <= (long) chunk.size(); offset += recordSize){
+      items.append(chunk.data() + offset, serialSize);
+    }
+  }
+
+  return items;
+}
+
+// The items that are still needed, in the same order: active ones, except for
+// relations that a newer row between the same users (in the same direction)
+// supersedes
+string keepLiveItems(const string& items, const string& dataType){
+  const RecordLayout& layout = getRecordLayout(dataType);
+  int itemSize = layout.serialSize;
+  int activeStart = layout.getField("ACTIVE").start;
+  bool relations = dataType == "RELATION";
+
+  vector<long> kept;
+  unordered_set<string> seen; // Usernames and direction of the newer relations
+  const FieldBounds* timestamp = relations ? &layout.getField("TIMESTAMP") : nullptr;
+
+  for(long offset = (long) items.length() - itemSize; offset >= 0; offset -= itemSize){
+    if(relations){
+      string fields = items.substr(offset, itemSize);
+      fields.erase(timestamp->start, timestamp->end - timestamp->start);
+      fields.erase(activeStart, 1);
+
+      if(!seen.insert(fields).second) continue;
+    }
+
+    if(items[offset + activeStart] == '1') kept.push_back(offset);
+  }
+
+  string live;
+  live.reserve(kept.size() * itemSize);
+
+  for(auto offset = kept.rbegin(); offset != kept.rend(); offset++){
+    live.append(items, *offset, itemSize);
+  }
+
+  return live;
+}
+
+long compactDataFile(const StoredFile& storedFile, int minDead, long& deadBytes,
+                     const function<void(long)>& pace){
+  // Copy the live items while the file is in use. Then lock everyone out, copy
+  // what was appended in the meantime (and everything again if flags changed),
+  // and swap the copy in.
+  DataFile& dataFile = getDataFile(storedFile);
+  string dataType = storedFileTypes.at(storedFile.type);
+  int recordSize = getRecordSize(dataType);
+  int serialSize = getRecordLayout(storedFile.type).serialSize;
+
+  // Rings don't grow: their oldest items are overwritten instead
+  if(getRingSize(dataType)){
+    deadBytes = 0;
+    return 0;
+  }
+
+  dataFile.deactivated = 0;
+  long flagChanges = dataFile.flagChanges.load();
+  long copied = dataFile.size.load();
+
+  string items = readItems(dataFile, dataType, 0, copied, pace);
+  string live = keepLiveItems(items, dataType);
+
+  deadBytes = (items.length() - live.length()) / serialSize * recordSize;
+  if(!deadBytes || deadBytes * 100 < (long) minDead * copied) return 0;
+
+  // Pace the writes before locking everyone out, not while they wait
+  if(pace) pace(live.length() / serialSize * recordSize);
+
+  ExclusiveLock compacting(dataFile.compaction);
+  unique_lock<mutex> appending(dataFile.appends);
+
+  long size = dataFile.size.load();
+
+  if(dataFile.flagChanges != flagChanges) items = readItems(dataFile, dataType, 0, copied, nullptr);
+  items += readItems(dataFile, dataType, copied, size, nullptr);
+
+  live = keepLiveItems(items, dataType);
+  deadBytes = size - live.length() / serialSize * recordSize;
+
+  // Chains are rebuilt from scratch, since every position changes
+  string records = live;
+
+  if(dataFile.chained){
+    HeadTable chains;
+    chains.open(-1, 0, dataType);
+    records = chains.chain(live, 0);
+  }
+
+  // The index goes first: if the server stops before the copy is swapped in,
+  // it's rebuilt from the old file, which is still complete
+  string compactPath = dataFile.path + ".compact";
+  int fd = open(compactPath.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+  if(fd == -1) throw std::runtime_error("Could not create " + compactPath);
+
+  for(size_t numWritten = 0; numWritten < records.length();){
+    ssize_t n = write(fd, records.data() + numWritten, records.length() - numWritten);
+
+    if(n <= 0) throw std::runtime_error("Could not write to " + compactPath);
+    numWritten += n;
+  }
+
+  if(fsync(fd) == -1) throw std::runtime_error("Could not sync " + compactPath);
+
+  // Changes in the write-ahead log point into the old file: they have to be in
+  // it (durably) before it's replaced
+  checkpointLog();
+
+  if(!dataFile.chained) unlink(getStoredIndexPath(storedFile).c_str());
+  if(dataFile.postsIndexed) unlink(getStoredPostIndexPath(storedFile).c_str());
+
+  if(rename(compactPath.c_str(), dataFile.path.c_str()) == -1)
+    throw std::runtime_error("Could not replace " + dataFile.path);
+
+  // The descriptor keeps its number, so nothing that holds on to it notices
+  // the swap. Mappings of the old file stay valid until they're dropped.
+  if(dup2(fd, dataFile.fd) == -1) throw std::runtime_error("Could not reopen " + dataFile.path);
+  close(fd);
+
+  dataFile.size = records.length();
+
+  {
+    unique_lock<mutex> lck(dataFile.mappingAccess);
+    dataFile.mapping.reset();
+  }
+
+  if(dataFile.chained){
+    dataFile.heads.open(dataFile.fd, dataFile.size, dataType);
+
+  }else{
+    dataFile.index.open(getStoredIndexPath(storedFile), dataFile.fd, dataFile.size, dataType);
+  }
+
+  if(dataFile.postsIndexed){
+    dataFile.posts.open(getStoredPostIndexPath(storedFile), dataFile.fd, dataFile.size, dataType,
+                        {"AUTHOR", "TIMESTAMP"});
+  }
+
+  return size - records.length();
+}
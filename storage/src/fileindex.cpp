@@ -0,0 +1,196 @@
+#include <fstream>
+#include <sstream>
+#include <stdexcept>
+#include <algorithm>
+#include <unistd.h>
+#include <fcntl.h>
+#include "config.h"
+#include "schema.h"
+#include "serializers.h"
+#include "fileindex.h"
+using namespace std;
+
+
+// Read the data file in chunks of this many items when catching up
+const int itemsPerChunk = 1024;
+
+FileIndex::FileIndex() : itemSize(0), fd(-1){}
+
+FileIndex::~FileIndex(){
+  if(fd != -1) close(fd);
+}
+
+void FileIndex::open(const string& indexPath, int dataFd, long dataSize, const string& dataType,
+                     const vector<string>& keyFields){
+  const RecordLayout& layout = getRecordLayout(dataType);
+
+  this->dataType = dataType;
+  this->keyFields.clear();
+  for(auto& field : keyFields.empty() ? vector<string>(1, getOwnerField(dataType)) : keyFields){
+    this->keyFields.push_back(layout.getField(field));
+  }
+  itemSize = getRecordSize(dataType);
+
+  // Load whatever has been recorded so far. Lines that point past the end of
+  // the data file (or that weren't fully written) are dropped.
+  unique_lock<mutex> lck(positionsAccess);
+  positions.clear();
+  if(fd != -1) close(fd);
+  lck.unlock();
+
+  long covered = 0;
+  ifstream infile(indexPath);
+
+  string line, key;
+  long position;
+
+  while(std::getline(infile, line)){
+    istringstream iss(line);
+    if(!(iss >> key >> position) || position + itemSize > dataSize) continue;
+
+    positions[key].push_back(position);
+    covered = max(covered, position + itemSize);
+  }
+
+  fd = ::open(indexPath.c_str(), O_WRONLY | O_CREAT | O_APPEND, 0644);
+  if(fd == -1) throw std::runtime_error("Could not open " + indexPath);
+
+  // Catch up with the items that were appended after the index was last
+  // written to (all of them if it was missing)
+  vector<char> chunk(itemsPerChunk * itemSize);
+
+  for(long start = covered; start + itemSize <= dataSize;){
+    long length = min((long) chunk.size(), (dataSize - start) / itemSize * itemSize);
+
+    if(pread(dataFd, chunk.data(), length, start) != length)
+      throw std::runtime_error("Could not read the data file of " + indexPath);
+
+    addItems(chunk.data(), length, start);
+    start += length;
+  }
+}
+
+void FileIndex::add(const string& content, long position){
+  addItems(content.data(), content.length(), position);
+}
+
+vector<long> FileIndex::find(const string& key, long end){
+  unique_lock<mutex> lck(positionsAccess);
+  auto match = positions.find(key);
+
+  if(match == positions.end()) return vector<long>();
+
+  // Positions are in ascending order: drop those that the reader can't see
+  const vector<long>& userPositions = match->second;
+  auto last = lower_bound(userPositions.begin(), userPositions.end(), end);
+
+  return vector<long>(userPositions.begin(), last);
+}
+
+size_t FileIndex::count(const string& key){
+  unique_lock<mutex> lck(positionsAccess);
+  auto match = positions.find(key);
+
+  return match == positions.end() ? 0 : match->second.size();
+}
+
+void FileIndex::addItems(const char* items, size_t length, long position){
+  ostringstream lines;
+  string item;
+
+  {
+    unique_lock<mutex> lck(positionsAccess);
+
+    for(size_t offset = 0; offset + itemSize <= length; offset += itemSize){
+      item.assign(items + offset, itemSize);
+      string key;
+
+      for(auto& field : keyFields){
+        if(!key.empty()) key += ':';
+        key += unpad(extractField(item, field));
+      }
+
+      positions[key].push_back(position + offset);
+      lines << key << ' ' << position + offset << '\n';
+    }
+  }
+
+  string persisted = lines.str();
+  if(write(fd, persisted.data(), persisted.length()) != (ssize_t) persisted.length())
+    throw std::runtime_error("Could not write to the index of a " + dataType + " file");
+}
+
+void HeadTable::open(int dataFd, long dataSize, const string& dataType){
+  this->dataType = dataType;
+  ownerField = getRecordLayout(dataType).getField(getOwnerField(dataType));
+  itemSize = getRecordLayout(dataType).serialSize;
+  chainSize = configParams.at("FIELD_SIZE_CHAIN");
+
+  {
+    unique_lock<mutex> lck(headsAccess);
+    heads.clear();
+  }
+
+  // The newest item of each user is the last one that is found
+  int recordSize = itemSize + chainSize;
+  string item;
+  vector<char> chunk(itemsPerChunk * recordSize);
+
+  for(long start = 0; start + recordSize <= dataSize;){
+    long length = min((long) chunk.size(), (dataSize - start) / recordSize * recordSize);
+
+    if(pread(dataFd, chunk.data(), length, start) != length)
+      throw std::runtime_error("Could not read a " + dataType + " file");
+
+    for(long offset = 0; offset < length; offset += recordSize){
+      item.assign(chunk.data() + offset, itemSize);
+      heads[unpad(extractField(item, ownerField))] = start + offset;
+    }
+
+    start += length;
+  }
+}
+
+string HeadTable::chain(const string& content, long position){
+  // Only appenders change the heads, so they can be read without locking
+  string records, item;
+  pending.clear();
+
+  for(size_t offset = 0; offset + itemSize <= content.length(); offset += itemSize){
+    item = content.substr(offset, itemSize);
+    string username = unpad(extractField(item, ownerField));
+
+    long previous = -1;
+    if(pending.count(username)) previous = pending.at(username);
+    else if(heads.count(username)) previous = heads.at(username);
+
+    records += item;
+    records += pad(previous == -1 ? "" : to_string(previous), chainSize);
+
+    pending[username] = position + records.length() - itemSize - chainSize;
+  }
+
+  return records;
+}
+
+void HeadTable::publish(atomic<long>& size, long newSize){
+  unique_lock<mutex> lck(headsAccess);
+
+  for(auto const& x : pending){ heads[x.first] = x.second; }
+  pending.clear();
+
+  size = newSize;
+}
+
+long HeadTable::find(const string& username, long& size, const atomic<long>& publishedSize){
+  unique_lock<mutex> lck(headsAccess);
+  size = publishedSize.load();
+
+  auto match = heads.find(username);
+  return match == heads.end() ? -1 : match->second;
+}
+
+long HeadTable::previous(const char* record) const{
+  string position = unpad(string(record + itemSize, chainSize));
+  return position.empty() ? -1 : stol(position);
+}
@@ -0,0 +1,457 @@
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <stdexcept>
+#include <thread>
+#include <map>
+#include <vector>
+#include <unistd.h>
+#include <fcntl.h>
+#include "config.h"
+#include "schema.h"
+#include "serializers.h"
+#include "utils.h"
+#include "rwlock.h"
+#include "filehandler.h"
+#include "layout.h"
+using namespace std;
+
+
+// Files of one type that are being moved to a new layout, one bucket of the
+// current layout at a time
+struct Resharding{
+  StorageLayout target;
+  unsigned int migrated; // Buckets that have already been moved
+  map<unsigned int, long> targetSizes; // Sizes of the target files before the
+                                       // bucket that is being moved
+};
+
+// Decided by setStorageLayouts() before the server starts. Afterwards, only
+// the progress of each resharding changes (in the resharding thread, which is
+// also the only one that saves them): files that have been resharded keep
+// being reached through their old layout until the server restarts.
+map<StoredFileType, StorageLayout> storageLayouts;
+map<StoredFileType, Resharding> reshardings;
+
+// Version of the format of the items (RECORD_FORMAT in layout.cfg). Relations
+// of format 1 had no TIMESTAMP: they were 42 bytes long. Volumes of an older
+// format are upgraded by setStorageLayouts(), one relation file at a time.
+const long currentRecordFormat = 2;
+const int untimedRelationSize = 42;
+
+long recordFormat = currentRecordFormat;
+unsigned int numUpgraded = 0; // Relation files that have been upgraded
+
+string getLayoutPath();
+
+map<string, long> readLayoutFile();
+
+void saveStorageLayouts();
+
+bool isSameLayout(const StorageLayout& first, const StorageLayout& second);
+
+void scrubPartialMove(StoredFileType storedFileType, const Resharding& resharding);
+
+void reshardFiles(StoredFileType storedFileType);
+
+void upgradeRelations(const map<string, long>& saved);
+
+void upgradeRelationFile(const StoredFile& storedFile);
+
+
+unsigned int hashUsername(HashFunction hash, const string& username){
+  unsigned int hashed = 0;
+
+  if(hash == SumHash){
+    for(unsigned int i = 0; i < username.size(); i++){ hashed += username[i]; }
+    return hashed;
+  }
+
+  // FNV-1a, followed by a final mix so that the low bits (the ones that the
+  // modulo keeps) depend on every character
+  hashed = 2166136261u;
+  for(unsigned int i = 0; i < username.size(); i++){
+    hashed ^= (unsigned char) username[i];
+    hashed *= 16777619u;
+  }
+
+  hashed ^= hashed >> 16;
+  hashed *= 0x85ebca6bu;
+  hashed ^= hashed >> 13;
+  hashed *= 0xc2b2ae35u;
+  hashed ^= hashed >> 16;
+
+  return hashed;
+}
+
+void setStorageLayouts(){
+  // Assumes that setConfigParams() has been called
+  map<string, long> saved = readLayoutFile();
+
+  for(auto const& x : storedFileTypes){
+    const string& name = x.second;
+
+    StorageLayout wanted = {(unsigned int) configParams.at("FILE_COUNT_" + name),
+                            (HashFunction) configParams.at("HASH_FUNCTION"), 0};
+    if(!wanted.count) throw std::runtime_error("FILE_COUNT_" + name + " is zero");
+
+    // Volumes from before layout.cfg existed are laid out with the sum of the
+    // characters of each username
+    StorageLayout current = wanted;
+
+    if(saved.count("COUNT_" + name)){
+      current = {(unsigned int) saved["COUNT_" + name], (HashFunction) saved["HASH_" + name],
+                 (unsigned int) saved["GENERATION_" + name]};
+
+    }else if(isValidPath(getStoredFilePath({x.first, 0, 0, nullptr}))){
+      current.hash = SumHash;
+    }
+
+    storageLayouts[x.first] = current;
+
+    if(saved.count("TARGET_COUNT_" + name)){
+      // Pick up where the last resharding left off
+      Resharding resharding;
+      resharding.target = {(unsigned int) saved["TARGET_COUNT_" + name],
+                           (HashFunction) saved["TARGET_HASH_" + name],
+                           (unsigned int) saved["TARGET_GENERATION_" + name]};
+      resharding.migrated = saved["MIGRATED_" + name];
+
+      for(unsigned int bucket = 0; bucket < resharding.target.count; bucket++){
+        string key = "TARGET_SIZE_" + name + "_" + to_string(bucket);
+        if(saved.count(key)) resharding.targetSizes[bucket] = saved[key];
+      }
+
+      if(!isSameLayout(resharding.target, wanted))
+        throw std::runtime_error("The " + name + " files are being resharded to another layout: "
+                                 "set FILE_COUNT_" + name + " and HASH_FUNCTION back to it");
+
+      scrubPartialMove(x.first, resharding);
+      reshardings[x.first] = resharding;
+
+    }else if(!isSameLayout(current, wanted)){
+      // Data would be lost if the files were just read with the new layout
+      if(!configParams.at("RESHARD"))
+        throw std::runtime_error("The " + name + " files were laid out with another FILE_COUNT_" +
+                                 name + " or HASH_FUNCTION: set RESHARD=1 to move them");
+
+      wanted.generation = current.generation + 1;
+      reshardings[x.first] = {wanted, 0, map<unsigned int, long>()};
+    }
+  }
+
+  upgradeRelations(saved);
+  saveStorageLayouts();
+}
+
+void upgradeRelations(const map<string, long>& saved){
+  // Volumes from before layout.cfg existed, and layouts saved without a
+  // RECORD_FORMAT, have the first format (unless there's nothing in them yet)
+  const StorageLayout& layout = getStorageLayout(StoredFileType::RelationFile);
+  bool untouched = saved.empty();
+
+  for(unsigned int bucket = 0; untouched && bucket < layout.count; bucket++){
+    string path = getStoredFilePath({StoredFileType::RelationFile, bucket, layout.generation, nullptr});
+    untouched = !isValidPath(path) || !getFileSize(path);
+  }
+
+  recordFormat = saved.count("RECORD_FORMAT") ? saved.at("RECORD_FORMAT") : untouched ? currentRecordFormat : 1;
+  if(recordFormat == currentRecordFormat) return;
+
+  if(recordFormat > currentRecordFormat)
+    throw std::runtime_error("The data files have items of format " + to_string(recordFormat) +
+                             ", which is newer than this server's");
+
+  // Copies that resharding made in the old format aren't tracked by bucket
+  // (a resharding that was set up during the upgrade hasn't copied anything)
+  if(saved.count("TARGET_COUNT_RELATION") && !saved.count("UPGRADED_RELATION"))
+    throw std::runtime_error("The RELATION files are being resharded: let the server that started it "
+                             "finish before upgrading them");
+
+  // Each file is rewritten next to itself, and swapped in once layout.cfg says
+  // that it was (an upgrade that was cut short finishes that swap first)
+  numUpgraded = saved.count("UPGRADED_RELATION") ? saved.at("UPGRADED_RELATION") : 0;
+
+  if(numUpgraded){
+    StoredFile last = {StoredFileType::RelationFile, numUpgraded - 1, layout.generation, nullptr};
+    string upgradePath = getStoredFilePath(last) + ".upgrade";
+
+    if(isValidPath(upgradePath) && rename(upgradePath.c_str(), getStoredFilePath(last).c_str()) == -1)
+      throw std::runtime_error("Could not replace " + getStoredFilePath(last));
+  }
+
+  cerr << "Upgrading RELATION files to format " << currentRecordFormat << "\n";
+
+  for(unsigned int bucket = numUpgraded; bucket < layout.count; bucket++){
+    StoredFile storedFile = {StoredFileType::RelationFile, bucket, layout.generation, nullptr};
+    if(!isValidPath(getStoredFilePath(storedFile))) continue;
+
+    upgradeRelationFile(storedFile);
+  }
+
+  recordFormat = currentRecordFormat;
+}
+
+void upgradeRelationFile(const StoredFile& storedFile){
+  // Relations of the first format were followed before anyone can tell: they
+  // get the earliest possible time of the follow, so that their users keep
+  // seeing every post of the accounts that they follow
+  string path = getStoredFilePath(storedFile), upgradePath = path + ".upgrade";
+  string dataType = "RELATION";
+
+  bool chained = isChained(dataType);
+  int chainSize = chained ? configParams.at("FIELD_SIZE_CHAIN") : 0;
+  int oldSize = untimedRelationSize + chainSize;
+  string timestamp(configParams.at("FIELD_SIZE_TIMESTAMP"), '0');
+
+  ifstream infile(path, ios::binary);
+  string old((istreambuf_iterator<char>(infile)), istreambuf_iterator<char>());
+
+  string records;
+  for(size_t offset = 0; offset + oldSize <= old.length(); offset += oldSize){
+    records += old.substr(offset, untimedRelationSize) + timestamp;
+  }
+
+  // Chains point at the positions of the items, which have all moved
+  if(chained){
+    HeadTable chains;
+    chains.open(-1, 0, dataType);
+    records = chains.chain(records, 0);
+  }
+
+  int fd = open(upgradePath.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  if(fd == -1) throw std::runtime_error("Could not create " + upgradePath);
+
+  for(size_t numWritten = 0; numWritten < records.length();){
+    ssize_t n = write(fd, records.data() + numWritten, records.length() - numWritten);
+
+    if(n <= 0) throw std::runtime_error("Could not write to " + upgradePath);
+    numWritten += n;
+  }
+
+  if(fsync(fd) == -1) throw std::runtime_error("Could not sync " + upgradePath);
+  close(fd);
+
+  // The index points into the old file: it's rebuilt when the file is opened
+  unlink(getStoredIndexPath(storedFile).c_str());
+
+  numUpgraded = storedFile.bucket + 1;
+  saveStorageLayouts();
+
+  if(rename(upgradePath.c_str(), path.c_str()) == -1)
+    throw std::runtime_error("Could not replace " + path);
+}
+
+const StorageLayout& getStorageLayout(StoredFileType storedFileType){
+  auto layout = storageLayouts.find(storedFileType);
+  if(layout == storageLayouts.end())
+    throw std::runtime_error("No storage layout is set. Likely that configServer() has not been called.");
+
+  return layout->second;
+}
+
+bool getTargetLayout(StoredFileType storedFileType, StorageLayout& target){
+  auto resharding = reshardings.find(storedFileType);
+  if(resharding == reshardings.end()) return false;
+
+  target = resharding->second.target;
+  return true;
+}
+
+vector<StorageLayout> getOpenLayouts(StoredFileType storedFileType){
+  vector<StorageLayout> layouts(1, getStorageLayout(storedFileType));
+
+  StorageLayout target;
+  if(getTargetLayout(storedFileType, target)) layouts.push_back(target);
+
+  return layouts;
+}
+
+void startResharding(){
+  // Assumes that openDataFiles() has been called. The buckets that were moved
+  // before the server last stopped are already served from the target layout.
+  if(reshardings.empty()) return;
+
+  for(auto const& x : reshardings){
+    const StorageLayout& layout = getStorageLayout(x.first);
+
+    for(unsigned int bucket = 0; bucket < x.second.migrated && bucket < layout.count; bucket++){
+      getDataFile({x.first, bucket, layout.generation, nullptr}).migrated = true;
+    }
+  }
+
+  thread([]{
+    for(auto const& x : reshardings){ reshardFiles(x.first); }
+  }).detach();
+}
+
+void reshardFiles(StoredFileType storedFileType){
+  // Move one bucket at a time: its file is locked out (users of that bucket
+  // wait) while its items are copied to the target files, in the same order
+  Resharding& resharding = reshardings.at(storedFileType);
+  const StorageLayout& layout = getStorageLayout(storedFileType);
+  const StorageLayout& target = resharding.target;
+
+  string dataType = storedFileTypes.at(storedFileType);
+  const FieldBounds& ownerField = getRecordLayout(storedFileType).getField(getOwnerField(dataType));
+
+  cerr << "Resharding " << dataType << " files: " << layout.count << " -> " << target.count << "\n";
+
+  while(resharding.migrated < layout.count){
+    StoredFile storedFile = {storedFileType, resharding.migrated, layout.generation, nullptr};
+    DataFile& dataFile = getDataFile(storedFile);
+
+    // Remember where the copies start, in case the server stops halfway
+    for(unsigned int bucket = 0; bucket < target.count; bucket++){
+      resharding.targetSizes[bucket] = getDataFile({storedFileType, bucket, target.generation, nullptr}).size;
+    }
+    saveStorageLayouts();
+
+    ExclusiveLock lck(dataFile.migration);
+
+    // Inactive items are moved as well (e.g. relations may be reactivated)
+    vector<string> items = itemMatchSweep(storedFile, dataType, map<string, string>(), -1);
+    map<unsigned int, string> moved;
+
+    for(auto item = items.rbegin(); item != items.rend(); item++){
+      string owner = unpad(extractField(*item, ownerField));
+      moved[hashUsername(target.hash, owner) % target.count] += *item;
+    }
+
+    for(auto const& x : moved){
+      appendToDataFile({storedFileType, x.first, target.generation, nullptr}, x.second);
+    }
+
+    dataFile.migrated = true;
+    resharding.migrated++;
+  }
+
+  // The target layout is saved as the current one. The old files are only
+  // kept open until the server stops (no one is routed to them anymore).
+  saveStorageLayouts();
+
+  for(unsigned int bucket = 0; bucket < layout.count; bucket++){
+    StoredFile storedFile = {storedFileType, bucket, layout.generation, nullptr};
+
+    unlink(getStoredFilePath(storedFile).c_str());
+    unlink(getStoredIndexPath(storedFile).c_str());
+    unlink(getStoredPostIndexPath(storedFile).c_str());
+  }
+
+  cerr << "Resharded " << dataType << " files\n";
+}
+
+void scrubPartialMove(StoredFileType storedFileType, const Resharding& resharding){
+  // The server stopped while a bucket was being moved: some of its items may
+  // have been copied already. They're told apart from the items of users that
+  // had been moved (which were written to the target files in the meantime) by
+  // the bucket they hash to in the current layout, and disowned so that the
+  // bucket can be moved again. Runs before the target files are opened.
+  const StorageLayout& layout = storageLayouts.at(storedFileType);
+  if(resharding.migrated >= layout.count) return;
+
+  string dataType = storedFileTypes.at(storedFileType);
+  string ownerField = getOwnerField(dataType);
+
+  int recordSize = getRecordSize(dataType);
+  const FieldBounds& ownerBounds = getRecordLayout(storedFileType).getField(ownerField);
+  int ownerStart = ownerBounds.start, ownerSize = ownerBounds.end - ownerBounds.start;
+  string disowned(ownerSize, fillerChar);
+
+  for(auto const& x : resharding.targetSizes){
+    string path = getStoredFilePath({storedFileType, x.first, resharding.target.generation, nullptr});
+    int fd = open(path.c_str(), O_RDWR);
+    if(fd == -1) continue;
+
+    long dataSize = lseek(fd, 0, SEEK_END);
+    string record(recordSize, '\0');
+
+    for(long position = x.second; position + recordSize <= dataSize; position += recordSize){
+      if(pread(fd, &record[0], recordSize, position) != recordSize) break;
+
+      string owner = unpad(record.substr(ownerStart, ownerSize));
+      if(hashUsername(layout.hash, owner) % layout.count != resharding.migrated) continue;
+
+      if(pwrite(fd, disowned.data(), ownerSize, position + ownerStart) != ownerSize)
+        throw std::runtime_error("Could not write to " + path);
+    }
+
+    close(fd);
+  }
+}
+
+string getLayoutPath(){
+  // Next to the data files, since it describes them
+  return STORAGE_FILES_PATH + "/layout.cfg";
+}
+
+map<string, long> readLayoutFile(){
+  // Same format as config.txt (empty if there's no file yet)
+  map<string, long> saved;
+  ifstream infile(getLayoutPath());
+
+  string line;
+  while(std::getline(infile, line)){
+    if(line.empty() || startswith(line, "#")) continue;
+
+    size_t divider = line.find("=");
+    if(divider == string::npos) continue;
+
+    saved[line.substr(0, divider)] = stol(line.substr(divider + 1));
+  }
+
+  return saved;
+}
+
+void saveStorageLayouts(){
+  // Written to a temporary file that then replaces the old one, so that there
+  // is always a complete layout.cfg
+  ostringstream out;
+  out << "# Layout of the data files (written by the server, don't edit)\n";
+  out << "RECORD_FORMAT=" << recordFormat << "\n";
+
+  if(recordFormat != currentRecordFormat) out << "UPGRADED_RELATION=" << numUpgraded << "\n";
+
+  for(auto const& x : storageLayouts){
+    const string& name = storedFileTypes.at(x.first);
+
+    // Files that have been resharded are laid out like the target
+    auto resharding = reshardings.find(x.first);
+    bool moving = resharding != reshardings.end();
+    bool moved = moving && resharding->second.migrated >= x.second.count;
+    const StorageLayout& layout = moved ? resharding->second.target : x.second;
+
+    out << "COUNT_" << name << "=" << layout.count << "\n";
+    out << "HASH_" << name << "=" << layout.hash << "\n";
+    out << "GENERATION_" << name << "=" << layout.generation << "\n";
+
+    if(!moving || moved) continue;
+
+    const Resharding& current = resharding->second;
+    out << "TARGET_COUNT_" << name << "=" << current.target.count << "\n";
+    out << "TARGET_HASH_" << name << "=" << current.target.hash << "\n";
+    out << "TARGET_GENERATION_" << name << "=" << current.target.generation << "\n";
+    out << "MIGRATED_" << name << "=" << current.migrated << "\n";
+
+    for(auto const& size : current.targetSizes){
+      out << "TARGET_SIZE_" << name << "_" << size.first << "=" << size.second << "\n";
+    }
+  }
+
+  string tmpPath = getLayoutPath() + ".tmp";
+  string content = out.str();
+
+  int fd = open(tmpPath.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  if(fd == -1) throw std::runtime_error("Could not write " + tmpPath);
+
+  bool written = write(fd, content.data(), content.length()) == (ssize_t) content.length() && !fsync(fd);
+  close(fd);
+
+  if(!written || rename(tmpPath.c_str(), getLayoutPath().c_str()) == -1)
+    throw std::runtime_error("Could not save " + getLayoutPath());
+}
+
+bool isSameLayout(const StorageLayout& first, const StorageLayout& second){
+  // Generations don't matter: the same users are in the same buckets
+  return first.count == second.count && first.hash == second.hash;
+}
@@ -0,0 +1,168 @@
+#include <cstring>
+#include <algorithm>
+#include <stdexcept>
+#include "serializers.h"
+#include "matchkernel.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#define VECTOR_KERNELS
+#include <immintrin.h>
+#endif
+using namespace std;
+
+
+typedef BatchMatcher::Chunk Chunk;
+
+vector<Chunk> getChunks(const MatchPredicate& predicate, int width, size_t& reach);
+
+void matchScalar(const char* items, size_t numItems, size_t itemSize, size_t first,
+                 const MatchPredicate& predicate, vector<uint64_t>& bitmap);
+
+#ifdef VECTOR_KERNELS
+void matchSse(const char* items, size_t numItems, size_t itemSize, const vector<Chunk>& chunks,
+              size_t reach, const MatchPredicate& predicate, vector<uint64_t>& bitmap);
+
+void matchAvx2(const char* items, size_t numItems, size_t itemSize, const vector<Chunk>& chunks,
+               size_t reach, const MatchPredicate& predicate, vector<uint64_t>& bitmap);
+#endif
+
+
+bool isKernelSupported(MatchKernel kernel){
+#ifdef VECTOR_KERNELS
+  static const vector<bool> supported = []{
+    __builtin_cpu_init();
+    return vector<bool>{true, (bool) __builtin_cpu_supports("sse4.2"), (bool) __builtin_cpu_supports("avx2")};
+  }();
+
+  return kernel >= ScalarKernel && kernel <= Avx2Kernel && supported[kernel];
+#else
+  return kernel == ScalarKernel;
+#endif
+}
+
+MatchKernel getMatchKernel(){
+  static const MatchKernel kernel = isKernelSupported(Avx2Kernel) ? Avx2Kernel :
+                                    isKernelSupported(SseKernel) ? SseKernel : ScalarKernel;
+  return kernel;
+}
+
+const char* getKernelName(MatchKernel kernel){
+  switch(kernel){
+    case Avx2Kernel: return "avx2";
+    case SseKernel: return "sse4.2";
+    default: return "scalar";
+  }
+}
+
+BatchMatcher::BatchMatcher(const MatchPredicate& predicate, MatchKernel kernel)
+  : predicate(predicate), kernel(kernel), reach(0){
+  if(!isKernelSupported(kernel)) throw std::runtime_error("The CPU can't run the match kernel");
+
+  // The scalar kernel compares whole fields
+  if(kernel == Avx2Kernel) chunks = getChunks(predicate, 32, reach);
+  if(kernel == SseKernel) chunks = getChunks(predicate, 16, reach);
+}
+
+void BatchMatcher::match(const char* items, size_t numItems, size_t itemSize, vector<uint64_t>& bitmap) const{
+  // Items that nothing can match are skipped altogether
+  bitmap.assign((numItems + 63) / 64, 0);
+  if(!predicate.isSatisfiable()) return;
+
+#ifdef VECTOR_KERNELS
+  if(kernel == Avx2Kernel) return matchAvx2(items, numItems, itemSize, chunks, reach, predicate, bitmap);
+  if(kernel == SseKernel) return matchSse(items, numItems, itemSize, chunks, reach, predicate, bitmap);
+#endif
+
+  matchScalar(items, numItems, itemSize, 0, predicate, bitmap);
+}
+
+void matchItems(const char* items, size_t numItems, size_t itemSize,
+                const MatchPredicate& predicate, vector<uint64_t>& bitmap){
+  matchItems(items, numItems, itemSize, predicate, bitmap, getMatchKernel());
+}
+
+void matchItems(const char* items, size_t numItems, size_t itemSize,
+                const MatchPredicate& predicate, vector<uint64_t>& bitmap, MatchKernel kernel){
+  BatchMatcher(predicate, kernel).match(items, numItems, itemSize, bitmap);
+}
+
+vector<Chunk> getChunks(const MatchPredicate& predicate, int width, size_t& reach){
+  // reach is how far into an item the compares read (past its end, for
+  // fields near it: the last items are matched by matchScalar() instead)
+  vector<Chunk> chunks;
+  reach = 0;
+
+  for(auto const& field : predicate.getFields()){
+    int length = field.expected.length();
+
+    for(int offset = 0; offset < length; offset += width){
+      int chunkLength = min(width, length - offset);
+      Chunk chunk;
+
+      chunk.start = field.start + offset;
+      chunk.mask = chunkLength == 32 ? 0xFFFFFFFF : (1u << chunkLength) - 1;
+      memset(chunk.expected, 0, sizeof(chunk.expected));
+      memcpy(chunk.expected, field.expected.data() + offset, chunkLength);
+
+      chunks.push_back(chunk);
+      reach = max(reach, (size_t) chunk.start + width);
+    }
+  }
+
+  return chunks;
+}
+
+void matchScalar(const char* items, size_t numItems, size_t itemSize, size_t first,
+                 const MatchPredicate& predicate, vector<uint64_t>& bitmap){
+  for(size_t i = first; i < numItems; i++){
+    if(predicate.matches(items + i * itemSize)) bitmap[i / 64] |= 1ULL << (i % 64);
+  }
+}
+
+#ifdef VECTOR_KERNELS
+__attribute__((target("sse4.2")))
+void matchSse(const char* items, size_t numItems, size_t itemSize, const vector<Chunk>& chunks,
+              size_t reach, const MatchPredicate& predicate, vector<uint64_t>& bitmap){
+  size_t i = 0, total = numItems * itemSize;
+
+  for(; i < numItems && i * itemSize + reach <= total; i++){
+    const char* item = items + i * itemSize;
+    bool matched = true;
+
+    for(size_t c = 0; matched && c < chunks.size(); c++){
+      __m128i loaded = _mm_loadu_si128((const __m128i*) (item + chunks[c].start));
+      __m128i expected = _mm_loadu_si128((const __m128i*) chunks[c].expected);
+      uint32_t equal = _mm_movemask_epi8(_mm_cmpeq_epi8(loaded, expected));
+
+      matched = (equal & chunks[c].mask) == chunks[c].mask;
+    }
+
+    if(matched) bitmap[i / 64] |= 1ULL << (i % 64);
+  }
+
+  matchScalar(items, numItems, itemSize, i, predicate, bitmap);
+}
+
+__attribute__((target("avx2")))
+void matchAvx2(const char* items, size_t numItems, size_t itemSize, const vector<Chunk>& chunks,
+               size_t reach, const MatchPredicate& predicate, vector<uint64_t>& bitmap){
+  size_t i = 0, total = numItems * itemSize;
+
+  for(; i < numItems && i * itemSize + reach <= total; i++){
+    const char* item = items + i * itemSize;
+    bool matched = true;
+
+    for(size_t c = 0; matched && c < chunks.size(); c++){
+      __m256i loaded = _mm256_loadu_si256((const __m256i*) (item + chunks[c].start));
+      __m256i expected = _mm256_loadu_si256((const __m256i*) chunks[c].expected);
+      uint32_t equal = _mm256_movemask_epi8(_mm256_cmpeq_epi8(loaded, expected));
+
+      matched = (equal & chunks[c].mask) == chunks[c].mask;
+    }
+
+    if(matched) bitmap[i / 64] |= 1ULL << (i % 64);
+  }
+
+  matchScalar(items, numItems, itemSize, i, predicate, bitmap);
+}
+#endif
@@ -0,0 +1,295 @@
+#include <cstring>
+#include <stdint.h>
+#include <arpa/inet.h>
+#include "parser.h"
+using namespace std;
+
+
+// Formats of the fields that follow the verb and the resource of a command
+enum FieldFormat{
+  NoField,
+  NameField,  // [a-z]+
+  LimitField, // -?[0-9]+
+  StampField, // [0-9]{10}
+  TextField,  // Anything but line breaks (may be empty)
+};
+
+// VERB/resource<first>:<second>. The first field is the command's username;
+// the second one is its argument (or its limit).
+struct CommandPattern{
+  const char* resource;
+  CommandType type;
+  FieldFormat first;
+  FieldFormat second;
+};
+
+// The resources of each verb. When several patterns share a resource, the
+// first one whose fields match wins.
+const CommandPattern getPatterns[] = {
+  {"credential/", ExistsCommand, NameField, NoField},
+  {"credential/", VerifyCredentialCommand, NameField, NameField},
+  {"posts/profile/", GetProfilePostsCommand, NameField, LimitField},
+  {"posts/timeline/", GetTimelinePostsCommand, NameField, LimitField},
+  {"relations/followers/", GetFollowersCommand, NameField, LimitField},
+  {"relations/friends/", GetFriendsCommand, NameField, LimitField},
+  {"relations/", IsFollowingCommand, NameField, NameField},
+  {NULL, InvalidCommand, NoField, NoField}
+};
+
+const CommandPattern savePatterns[] = {
+  {"credential/", SaveCredentialCommand, NameField, NameField},
+  {"posts/", SavePostCommand, NameField, TextField},
+  {"relations/", FollowCommand, NameField, NameField},
+  {NULL, InvalidCommand, NoField, NoField}
+};
+
+const CommandPattern deletePatterns[] = {
+  {"credential/", DeleteCredentialCommand, NameField, NameField},
+  {"posts/", DeletePostCommand, NameField, StampField},
+  {"relations/", UnfollowCommand, NameField, NameField},
+  {NULL, InvalidCommand, NoField, NoField}
+};
+
+const CommandPattern modePatterns[] = {
+  {"persistent", PersistentModeCommand, NoField, NoField},
+  {"framed", FramedModeCommand, NoField, NoField},
+  {"binary", BinaryModeCommand, NoField, NoField},
+  {NULL, InvalidCommand, NoField, NoField}
+};
+
+// BATCH/<n> is followed by n sub-commands (which are parsed on their own)
+const CommandPattern batchPatterns[] = {
+  {"", BatchCommand, LimitField, NoField},
+  {NULL, InvalidCommand, NoField, NoField}
+};
+
+struct VerbPatterns{
+  const char* verb;
+  const CommandPattern* patterns;
+};
+
+const VerbPatterns verbPatterns[] = {
+  {"GET/", getPatterns},
+  {"SAVE/", savePatterns},
+  {"DELETE/", deletePatterns},
+  {"MODE/", modePatterns},
+  {"BATCH/", batchPatterns},
+  {NULL, NULL}
+};
+
+// Limits are ints: don't take more digits than what's guaranteed to fit
+const size_t maxLimitDigits = 9;
+
+const size_t timestampDigits = 10;
+
+// Opcode, limit and number of fields of a binary command
+const size_t binaryHeaderSize = 1 + sizeof(int32_t) + 1;
+
+bool skipPrefix(const char*& input, size_t& length, const char* prefix);
+
+long scanField(const char* input, size_t length, FieldFormat format);
+
+bool matchFields(const char* input, size_t length, const CommandPattern& pattern, Command& command);
+
+int parseLimit(const char* input, size_t length);
+
+const CommandPattern* findPattern(CommandType type);
+
+bool checkBatchSize(Command& command);
+
+bool matchesFormat(const StringRef& field, FieldFormat format);
+
+
+Command parseCommand(const char* input, size_t length){
+  // Find the verb, then the resource, and then check the fields that follow
+  Command command = {InvalidCommand, {input, 0}, {input, 0}, 0};
+
+  for(const VerbPatterns* verb = verbPatterns; verb->verb; verb++){
+    if(!skipPrefix(input, length, verb->verb)) continue;
+
+    for(const CommandPattern* pattern = verb->patterns; pattern->resource; pattern++){
+      const char* fields = input;
+      size_t fieldsLength = length;
+
+      if(skipPrefix(fields, fieldsLength, pattern->resource) &&
+         matchFields(fields, fieldsLength, *pattern, command)){
+        command.type = pattern->type;
+        checkBatchSize(command);
+        return command;
+      }
+    }
+
+    break; // Verbs don't prefix one another
+  }
+
+  return command;
+}
+
+Command parseBinaryCommand(const char* input, size_t length, size_t& consumed){
+  // The fields are checked against the same formats as those of text commands
+  Command command = {InvalidCommand, {input, 0}, {input, 0}, 0};
+  consumed = 0;
+
+  if(length < binaryHeaderSize) return command;
+
+  uint8_t opcode = input[0];
+  uint8_t numFields = input[binaryHeaderSize - 1];
+
+  int32_t limit;
+  memcpy(&limit, input + 1, sizeof(int32_t));
+  command.limit = ntohl(limit);
+
+  // Find out where each field is (and whether all of them have arrived)
+  StringRef fields[2];
+  size_t offset = binaryHeaderSize;
+
+  for(uint8_t i = 0; i < numFields; i++){
+    uint16_t fieldLength;
+    if(length < offset + sizeof(uint16_t)) return command;
+
+    memcpy(&fieldLength, input + offset, sizeof(uint16_t));
+    fieldLength = ntohs(fieldLength);
+    offset += sizeof(uint16_t);
+
+    if(length < offset + fieldLength) return command;
+
+    if(i < 2) fields[i] = {input + offset, fieldLength};
+    offset += fieldLength;
+  }
+
+  consumed = offset;
+
+  // Limits travel in the header; every other field has to be there
+  const CommandPattern* pattern = findPattern((CommandType) opcode);
+  if(!pattern) return command;
+
+  bool hasFirst = pattern->first != NoField && pattern->first != LimitField;
+  uint8_t numExpected = hasFirst;
+  if(pattern->second != NoField && pattern->second != LimitField) numExpected++;
+
+  if(numFields != numExpected) return command;
+  if(hasFirst && !matchesFormat(fields[0], pattern->first)) return command;
+
+  if(pattern->second != NoField && pattern->second != LimitField){
+    if(!matchesFormat(fields[1], pattern->second)) return command;
+    command.argument = fields[1];
+  }
+
+  if(hasFirst) command.username = fields[0];
+  command.type = pattern->type;
+
+  checkBatchSize(command);
+  return command;
+}
+
+bool isModeCommand(const Command& command){
+  return command.type == PersistentModeCommand || command.type == FramedModeCommand ||
+         command.type == BinaryModeCommand;
+}
+
+bool isReadCommand(const Command& command){
+  return command.type >= ExistsCommand && command.type <= GetFriendsCommand;
+}
+
+bool checkBatchSize(Command& command){
+  // Batches that are empty or too large are invalid
+  if(command.type != BatchCommand) return true;
+  if(command.limit >= 1 && command.limit <= maxBatchSize) return true;
+
+  command.type = InvalidCommand;
+  return false;
+}
+
+const CommandPattern* findPattern(CommandType type){
+  // Look the command up by its type instead of by its verb and resource
+  for(const VerbPatterns* verb = verbPatterns; verb->verb; verb++){
+    for(const CommandPattern* pattern = verb->patterns; pattern->resource; pattern++){
+      if(pattern->type == type && type != InvalidCommand) return pattern;
+    }
+  }
+
+  return NULL;
+}
+
+bool matchesFormat(const StringRef& field, FieldFormat format){
+  // True if the whole field follows the format
+  return scanField(field.data, field.length, format) == (long) field.length;
+}
+
+bool skipPrefix(const char*& input, size_t& length, const char* prefix){
+  // Move past prefix if the input starts with it
+  size_t prefixLength = strlen(prefix);
+
+  if(length < prefixLength || memcmp(input, prefix, prefixLength)) return false;
+
+  input += prefixLength;
+  length -= prefixLength;
+  return true;
+}
+
+long scanField(const char* input, size_t length, FieldFormat format){
+  // Number of characters at the start of the input that follow the format
+  // (-1 if it isn't there)
+  size_t i = 0;
+
+  switch(format){
+    case NoField:
+      return 0;
+
+    case NameField:
+      while(i < length && input[i] >= 'a' && input[i] <= 'z') i++;
+      return i ? i : -1;
+
+    case LimitField:
+      if(i < length && input[i] == '-') i++;
+      while(i < length && input[i] >= '0' && input[i] <= '9') i++;
+
+      if(i == 0 || input[i - 1] == '-' || i - (input[0] == '-') > maxLimitDigits) return -1;
+      return i;
+
+    case StampField:
+      while(i < length && i < timestampDigits && input[i] >= '0' && input[i] <= '9') i++;
+      return i == timestampDigits ? i : -1;
+
+    case TextField:
+      while(i < length && input[i] != '\n' && input[i] != '\r') i++;
+      return i;
+  }
+
+  return -1;
+}
+
+bool matchFields(const char* input, size_t length, const CommandPattern& pattern, Command& command){
+  // The fields have to take up the rest of the input
+  long firstLength = scanField(input, length, pattern.first);
+  if(firstLength == -1) return false;
+
+  command.username = {input, (size_t) firstLength};
+  if(pattern.first == LimitField) command.limit = parseLimit(input, firstLength);
+
+  if(pattern.second == NoField) return (size_t) firstLength == length;
+
+  if((size_t) firstLength == length || input[firstLength] != ':') return false;
+
+  const char* second = input + firstLength + 1;
+  size_t secondLength = length - firstLength - 1;
+
+  if(scanField(second, secondLength, pattern.second) != (long) secondLength) return false;
+
+  command.argument = {second, secondLength};
+  if(pattern.second == LimitField) command.limit = parseLimit(second, secondLength);
+
+  return true;
+}
+
+int parseLimit(const char* input, size_t length){
+  // Assumes that the input follows LimitField's format
+  bool negative = input[0] == '-';
+  int limit = 0;
+
+  for(size_t i = negative; i < length; i++){
+    limit = limit * 10 + (input[i] - '0');
+  }
+
+  return negative ? -limit : limit;
+}
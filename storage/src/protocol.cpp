@@ -1,69 +1,30 @@
 #include <iostream>
 #include <sstream>
-#include <regex>
 #include <cstring>
+#include <algorithm>
+#include <map>
+#include <tuple>
+#include <errno.h>
 #include <unistd.h>
+#include <arpa/inet.h>
 #include "user.h"
 #include "config.h"
+#include "serializers.h"
+#include "parser.h"
+#include "filehandler.h"
+#include "wal.h"
 #include "protocol.h"
 using namespace std;
 
 
-// The following regex patterns are used to interpret the command that
-// the user specifies in its request
-
-/********** GET/... **********/
-regex reGet("GET/.*");
-
-// GET/credential/username\0
-regex reExists("GET/credential/([a-z]+)\0");
-
-// GET/credential/username:password\0
-regex reVerifyCredential("GET/credential/([a-z]+):([a-z]+)\0");
-
-// GET/posts/profile/username:limit\0
-regex reGetProfilePosts("GET/posts/profile/([a-z]+):(-?[0-9]+)\0");
-
-// GET/posts/timeline/username:limit\0
-regex reGetTimelinePosts("GET/posts/timeline/([a-z]+):(-?[0-9]+)\0");
-
-// GET/relations/username:friendUsername\0
-regex reIsFollowing("GET/relations/([a-z]+):([a-z]+)\0");
-
-// GET/relations/followers/username:limit\0
-regex reGetFollowers("GET/relations/followers/([a-z]+):(-?[0-9]+)\0");
-
-// GET/relations/friends/username:limit\0
-regex reGetFriends("GET/relations/friends/([a-z]+):(-?[0-9]+)\0");
-
-/********** SAVE/... **********/
-regex reSave("SAVE/.*");
-
-// SAVE/credential/username:password\0
-regex reSaveCredential("SAVE/credential/([a-z]+):([a-z]+)\0");
-
-// SAVE/posts/username:text\0
-regex reSavePost("SAVE/posts/([a-z]+):(.*)\0");
-
-// SAVE/relations/username:friendUsername\0
-regex reFollow("SAVE/relations/([a-z]+):([a-z]+)\0");
-
-/********** DELETE/... **********/
-regex reDelete("DELETE/.*");
-
-// DELETE/credential/username:password\0
-regex reDeleteCredential("DELETE/credential/([a-z]+):([a-z]+)\0");
-
-// DELETE/posts/username:timestamp\0
-regex reDeletePost("DELETE/posts/([a-z]+):([0-9]{10})\0");
-
-// DELETE/relations/username:friendUsername\0
-regex reUnfollow("DELETE/relations/([a-z]+):([a-z]+)\0");
-
-enum ClientSignal {Ack, Stop, Unknown};
+// Gone: the client hung up, or didn't say anything within CLIENT_TIMEOUT
+enum ClientSignal {Ack, Stop, Unknown, Gone};
 
 enum ServerSignal {Success, Error};
 
+// First byte of every reply in the binary protocol
+enum BinaryStatus {BinaryFalse = 0, BinaryTrue = 1, BinaryItems = 2};
+
 typedef struct {
   char* data;
   unsigned int length;
@@ -121,29 +82,121 @@ private:
 
 ClientSignal waitForClientSignal(const int connfd, const TransportBuffer& buff);
 
-ServerResponse parseRequest(const int connfd, TransportBuffer& buff);
+ServerResponse executeCommand(Connection& conn, const Command& command);
+
+size_t nextCommand(const Connection& conn, const char* input, size_t length, Command& command);
+
+string executeBatch(Connection& conn, const vector<Command>& commands);
+
+bool respond(const Connection& conn, const ServerResponse& resp, TransportBuffer& buff);
 
-void respond(const int connfd, const ServerResponse& resp, TransportBuffer& buff);
+bool sendPacket(const int connfd, const string& content, TransportBuffer& buff);
 
-void sendPacket(const int connfd, const string& content, const int buffSize);
+string framedReply(const ServerResponse& resp);
 
+string binaryReply(const Command& command, const ServerResponse& resp);
 
-void handleRequest(const int connfd){
-  cerr << "Responding to request." << endl;
+void finishFrame(string& frame);
 
+bool sendFrame(const int connfd, const string& frame);
+
+bool writeAll(const int connfd, const char* data, size_t length);
+
+
+bool handleRequest(Connection& conn){
   char data[BUFFSIZE];
   TransportBuffer buff = {data, BUFFSIZE};
 
-  ServerResponse resp = parseRequest(connfd, std::ref(buff));
-  respond(connfd, std::ref(resp), std::ref(buff));
+  // Take whatever the client has sent so far (may be several commands, or
+  // only part of one)
+  ssize_t numRead = read(conn.connfd, buff.data, buff.length);
+
+  if(numRead == -1){
+    cerr << "Error reading from connfd" << endl;
+    return false;
+  }else if(numRead == 0){
+    return false; // The client hung up
+  }
+
+  conn.pending.append(buff.data, numRead);
+
+  // Reply to the commands in the order in which they were received (they're
+  // either '\0'-terminated or binary). They're parsed in place; the bytes they
+  // take up are only dropped once all of them have been served.
+  size_t parsed = 0, consumed;
+  bool keepOpen = true, replied = true;
+  Command command;
 
-  close(connfd);
-  cerr << "Finished." << endl;
+  while(keepOpen && (consumed = nextCommand(conn, conn.pending.data() + parsed, conn.pending.length() - parsed, command))){
+    cerr << "Responding to request." << endl;
+
+    if(command.type == BatchCommand){
+      // The sub-commands follow the batch command: wait until all of them are in
+      vector<Command> commands(command.limit);
+      size_t batchLength = consumed;
+
+      for(auto& subCommand:commands){
+        size_t subLength = nextCommand(conn, conn.pending.data() + parsed + batchLength,
+                                       conn.pending.length() - parsed - batchLength, subCommand);
+        if(!subLength){ batchLength = 0; break; }
+
+        batchLength += subLength;
+      }
+
+      if(!batchLength) break;
+      consumed = batchLength;
+
+      if(conn.binary || conn.framed){
+        string frame = executeBatch(conn, commands);
+        replied = sendFrame(conn.connfd, frame);
+
+      }else{
+        // There is no way to tell the results apart without framing
+        ServerResponse resp = ServerResponse(ServerSignal::Error);
+        replied = respond(conn, std::ref(resp), std::ref(buff));
+      }
+
+    }else{
+      ServerResponse resp = executeCommand(conn, command);
+
+      if(conn.binary) replied = sendFrame(conn.connfd, binaryReply(command, resp));
+      else replied = respond(conn, std::ref(resp), std::ref(buff));
+    }
+
+    parsed += consumed;
+
+    // Without MODE/persistent\0, a connection only serves one command (other
+    // than those that set it up). Clients that stop taking replies (or
+    // acknowledging them) for CLIENT_TIMEOUT are hung up on.
+    keepOpen = replied && (conn.persistent || isModeCommand(command));
+  }
+
+  conn.pending.erase(0, parsed);
+  if(!keepOpen) return false;
+
+  if(!conn.persistent && !conn.binary && !conn.pending.empty()){
+    // Clients that only send one command aren't required to terminate it
+    Command command = parseCommand(conn.pending.data(), conn.pending.length());
+    ServerResponse resp = executeCommand(conn, command);
+    respond(conn, std::ref(resp), std::ref(buff));
+    return false;
+  }
+
+  // A command fits in the buffer; a batch fits in one buffer per sub-command
+  if(conn.pending.length() > buff.length * (maxBatchSize + 1)){
+    cerr << "Command does not fit in the buffer. Hanging up." << endl;
+    return false;
+  }
+
+  // Wait for the rest of the pipelined commands
+  return true;
 }
 
 ClientSignal waitForClientSignal(const int connfd, const TransportBuffer& buff){
-  if(read(connfd, buff.data, buff.length) == -1){
+  // Reads time out after CLIENT_TIMEOUT (see acceptConnections())
+  if(read(connfd, buff.data, buff.length) <= 0){
     cerr << "Receive failed" << endl;
+    return ClientSignal::Gone;
   }
 
   if(strncmp(buff.data, "ACK", 4)){
@@ -155,156 +208,336 @@ ClientSignal waitForClientSignal(const int connfd, const TransportBuffer& buff){
     return ClientSignal::Stop;
 
   }else{
-    cerr << "Response from user: [unknown]" << endl; // TODO: HAVE A TIMEOUT HERE AND RETURN THIS AFTER A WHILE
+    cerr << "Response from user: [unknown]" << endl;
     return ClientSignal::Unknown;
   }
 }
 
-ServerResponse parseRequest(const int connfd, TransportBuffer& buff){
-  // Read from the file descriptor
-  if(read(connfd, buff.data, buff.length) == -1) {
-    cerr << "Error reading from connfd" << endl;
-    exit(1);
+size_t nextCommand(const Connection& conn, const char* input, size_t length, Command& command){
+  // Parse the first command of the input according to the connection's
+  // protocol. Returns the number of bytes it takes up (0 if incomplete).
+  if(conn.binary){
+    size_t consumed;
+    command = parseBinaryCommand(input, length, consumed);
+    return consumed;
+  }
+
+  const char* end = (const char*) memchr(input, '\0', length);
+  if(!end) return 0;
+
+  command = parseCommand(input, end - input);
+  return end - input + 1;
+}
+
+string executeBatch(Connection& conn, const vector<Command>& commands){
+  // Execute the sub-commands of a batch and return a single frame with each of
+  // their replies (themselves frames), in order. Sub-commands that read the
+  // same data file run one after the other, in the same task; those that read
+  // different files run in parallel. Only reads may be batched. Each task
+  // releases whatever it locks before it finishes (locks may only be released
+  // by the thread that took them), and the files are only found here, without
+  // holding on to them.
+
+  vector<string> frames(commands.size());
+  map<tuple<StoredFileType, unsigned int, unsigned int>, vector<size_t>> commandsByFile;
+
+  for(size_t i = 0; i < commands.size(); i++){
+    StoredFileType storedFileType;
+
+    switch(commands[i].type){
+      case ExistsCommand: case VerifyCredentialCommand:
+        storedFileType = StoredFileType::CredentialFile; break;
+      case GetProfilePostsCommand:
+        storedFileType = StoredFileType::ProfilePostFile; break;
+      case GetTimelinePostsCommand:
+        storedFileType = StoredFileType::TimelinePostFile; break;
+      case IsFollowingCommand: case GetFollowersCommand: case GetFriendsCommand:
+        storedFileType = StoredFileType::RelationFile; break;
+
+      default:
+        frames[i] = conn.binary ? binaryReply(commands[i], ServerResponse(ServerSignal::Error))
+                                : framedReply(ServerResponse(ServerSignal::Error));
+        continue;
+    }
+
+    StoredFile storedFile = getStoredFile(storedFileType, commands[i].username.str());
+    commandsByFile[make_tuple(storedFile.type, storedFile.generation, storedFile.bucket)].push_back(i);
   }
 
-  string input(buff.data);
-  cerr << "Requested data: " << buff.data << ". Length: " << input.length() << endl;
+  vector<function<void()>> tasks;
+  for(auto& x:commandsByFile){
+    const vector<size_t>& indexes = x.second;
+
+    tasks.push_back([&conn, &commands, &frames, &indexes] {
+      for(size_t i:indexes){
+        ServerResponse resp = executeCommand(conn, commands[i]);
+        frames[i] = conn.binary ? binaryReply(commands[i], resp) : framedReply(resp);
+      }
+    });
+  }
+
+  getFileWorkers().runAll(tasks);
+
+  string frame(sizeof(uint32_t), '\0');
+  for(auto& subFrame:frames){ frame += subFrame; }
+
+  finishFrame(frame);
+  return frame;
+}
+
+ServerResponse executeCommand(Connection& conn, const Command& command){
+  // Perform the action the command asks for and build the reply
+  cerr << "Requested data: ";
+  cerr.write(command.username.data, command.username.length) << ". Type: " << command.type << endl;
 
-  // Determine which command the request matches against
-  smatch matches;
+  string username = command.username.str(), argument = command.argument.str();
+  bool succeeded = false;
 
-  if(regex_match(input, matches, reGet)){
-    // Match against all GET patterns
-    if(regex_match(input, matches, reExists)){
-      string username = matches[1];
+  switch(command.type){
+    /********** GET/... **********/
+    case ExistsCommand:
       return ServerResponse(exists(username));
 
-    }else if(regex_match(input, matches, reVerifyCredential)){
-      string username = matches[1], password = matches[2];
-      return ServerResponse(verifyCredential(username, password));
-
-    }else if(regex_match(input, matches, reGetProfilePosts)){
-      string username = matches[1];
-      int limit = stoi(matches[2], NULL, 10);
-      return ServerResponse(getProfilePosts(username, limit));
-
-    }else if(regex_match(input, matches, reGetTimelinePosts)){
-      string username = matches[1];
-      int limit = stoi(matches[2], NULL, 10);
-      return ServerResponse(getTimelinePosts(username, limit));
-
-    }else if(regex_match(input, matches, reIsFollowing)){
-      string username = matches[1], friendUsername = matches[2];
-      return ServerResponse(isFollowing(username, friendUsername));
-
-    }else if(regex_match(input, matches, reGetFollowers)){
-      string username = matches[1];
-      int limit = stoi(matches[2], NULL, 10);
-      return ServerResponse(getFollowers(username, limit));
-
-    }else if(regex_match(input, matches, reGetFriends)){
-      string username = matches[1];
-      int limit = stoi(matches[2], NULL, 10);
-      return ServerResponse(getFriends(username, limit));
-    }
+    case VerifyCredentialCommand:
+      return ServerResponse(verifyCredential(username, argument));
 
-  }else{
-    bool succeeded = false;
+    case GetProfilePostsCommand:
+      return ServerResponse(getProfilePosts(username, command.limit));
 
-    if(regex_match(input, matches, reSave)){
-      // Match against all SAVE patterns
-      if(regex_match(input, matches, reSaveCredential)){
-        string username = matches[1], password = matches[2];
-        succeeded = saveCredential(username, password);
+    case GetTimelinePostsCommand:
+      return ServerResponse(getTimelinePosts(username, command.limit));
 
-      }else if(regex_match(input, matches, reSavePost)){
-        string username = matches[1], text = matches[2];
-        succeeded = savePost(username, text);
+    case IsFollowingCommand:
+      return ServerResponse(isFollowing(username, argument));
 
-      }else if(regex_match(input, matches, reFollow)){
-        string username = matches[1], friendUsername = matches[2];
-        succeeded = follow(username, friendUsername);
-      }
+    case GetFollowersCommand:
+      return ServerResponse(getFollowers(username, command.limit));
 
-    }else if(regex_match(input, matches, reDelete)){
-      // Match against all DELETE patterns
-      if(regex_match(input, matches, reDeleteCredential)){
-        string username = matches[1], password = matches[2];
-        succeeded = deleteCredential(username, password);
+    case GetFriendsCommand:
+      return ServerResponse(getFriends(username, command.limit));
 
-      }else if(regex_match(input, matches, reDeletePost)){
-        string username = matches[1], timestamp = matches[2];
-        succeeded = deletePost(username, timestamp);
+    /********** SAVE/... **********/
+    case SaveCredentialCommand:
+      succeeded = saveCredential(username, argument);
+      break;
 
-      }else if(regex_match(input, matches, reUnfollow)){
-        string username = matches[1], friendUsername = matches[2];
-        succeeded = unfollow(username, friendUsername);
-      }
-    }
+    case SavePostCommand:
+      succeeded = savePost(username, argument);
+      break;
+
+    case FollowCommand:
+      succeeded = follow(username, argument);
+      break;
+
+    /********** DELETE/... **********/
+    case DeleteCredentialCommand:
+      succeeded = deleteCredential(username, argument);
+      break;
+
+    case DeletePostCommand:
+      succeeded = deletePost(username, argument);
+      break;
 
-    if(succeeded) return ServerResponse(ServerSignal::Success);
+    case UnfollowCommand:
+      succeeded = unfollow(username, argument);
+      break;
+
+    /********** MODE/... (they take effect on this reply) **********/
+    case PersistentModeCommand:
+      // Keep the connection open after each command
+      conn.persistent = true;
+      succeeded = true;
+      break;
+
+    case FramedModeCommand:
+      // Length-prefix the replies instead of following the handshake
+      conn.framed = true;
+      succeeded = true;
+      break;
+
+    case BinaryModeCommand:
+      // Take binary commands and reply in kind from now on
+      conn.binary = true;
+      succeeded = true;
+      break;
+
+    case BatchCommand: // Its sub-commands are executed by executeBatch()
+    case InvalidCommand:
+      break;
   }
 
+  // Changes are only acknowledged once they're as durable as WAL_MODE asks
+  if(!isModeCommand(command)) commitLog();
+
+  if(succeeded) return ServerResponse(ServerSignal::Success);
+
   // If nothing has matched, return an error
   return ServerResponse(ServerSignal::Error);
 }
 
-void respond(const int connfd, const ServerResponse& resp, TransportBuffer& buff){
+bool respond(const Connection& conn, const ServerResponse& resp, TransportBuffer& buff){
+  // False if the client didn't take the reply
+  if(conn.framed) return sendFrame(conn.connfd, framedReply(resp));
+
   // Check if the response fits the criteria to be sent
-  unsigned int singleItemSize, numItems, maxItemsPerPacket, numPacketsToExpect;
+  unsigned int singleItemSize, numItems;
   string msg;
 
   if((singleItemSize = resp.getItemSize()) > buff.length){
     msg = "500: Response is too big to fit in the given buffer. Cancelling.";
-    sendPacket(connfd, msg, buff.length);
+    return sendPacket(conn.connfd, msg, buff);
   }
 
-  if(!(numItems = resp.getNumItems())){
+  numItems = resp.getNumItems();
+
+  if(!numItems && !conn.persistent){
     cerr << "Don't have anything to reply... ending connection" << endl;
-    return;
+    return true;
   }
 
-  maxItemsPerPacket = buff.length / singleItemSize;
-  numPacketsToExpect = numItems / maxItemsPerPacket + 1;
+  // Fit as many items as possible into each packet
+  vector<string> packets;
+
+  if(!resp.getMultipleItems().empty()){
+    for(auto& item:resp.getMultipleItems()){
+      if(packets.empty() || packets.back().length() + singleItemSize > buff.length){
+        packets.push_back(string());
+      }
+
+      packets.back() += item;
+    }
+  }else if(!resp.getSingleItem().empty()){
+    packets.push_back(resp.getSingleItem());
+  }
 
   // Let the client know how many packets to expect
-  msg = "201: Expect packets: " + to_string(numPacketsToExpect);
-  sendPacket(connfd, msg, buff.length);
+  msg = "201: Expect packets: " + to_string(packets.size());
+  if(!sendPacket(conn.connfd, msg, buff)) return false;
+
+  if(conn.persistent){
+    // The client may have pipelined more commands after this one, so it can't
+    // acknowledge anything: send the packets back-to-back. Since they're all
+    // buff.length bytes long, the client knows where each one ends.
+    for(auto& packet:packets){
+      if(!sendPacket(conn.connfd, packet, buff)) return false;
+    }
+
+    return true;
+  }
 
   // Wait for the client's acknowledgement and quit if not Ack
-  if(waitForClientSignal(connfd, buff) != ClientSignal::Ack){
+  ClientSignal signal = waitForClientSignal(conn.connfd, buff);
+  if(signal == ClientSignal::Gone) return false;
+
+  if(signal != ClientSignal::Ack){
     cerr << "Did not receive an ACK from the user. Quitting..." << endl;
   }
 
+  // Send the packets, one at a time, and wait for confirmation after each one
+  for(auto& packet:packets){
+    if(!sendPacket(conn.connfd, packet, buff) || waitForClientSignal(conn.connfd, buff) == ClientSignal::Gone)
+      return false;
+  }
+
+  return true;
+}
+
+bool sendPacket(const int connfd, const string& content, TransportBuffer& buff){
+  // Every packet is buff.length bytes long: the content followed by '\0's
+  size_t contentLength = min((size_t) buff.length, content.length());
+
+  memset(buff.data, 0, buff.length);
+  memcpy(buff.data, content.data(), contentLength);
+
+  if(!writeAll(connfd, buff.data, buff.length)) return false;
+
+  cerr << "Sent: '" << content << "'" << endl;
+  return true;
+}
+
+string framedReply(const ServerResponse& resp){
+  // The whole reply, prefixed by its length. Nothing is padded and nothing has
+  // to be acknowledged.
+  string frame(sizeof(uint32_t), '\0');
+
   if(!resp.getMultipleItems().empty()){
-    // Send the packets, one at a time
-    vector<string> items = resp.getMultipleItems();
+    frame.reserve(frame.length() + resp.getNumItems() * resp.getItemSize());
+    for(auto& item:resp.getMultipleItems()){ frame += item; }
+
+  }else{
+    frame += resp.getSingleItem();
+  }
 
-    stringstream packetStream;
-    for(size_t i = 0; i < numItems; i++){
-      packetStream << items[i];
+  finishFrame(frame);
+  return frame;
+}
 
-      if(!(i % maxItemsPerPacket) || i == numItems - 1){
-        sendPacket(connfd, packetStream.str(), buff.length);
+string binaryReply(const Command& command, const ServerResponse& resp){
+  // The reply in the binary protocol. Commands that return items get
+  // BinaryItems, the number of items (4 bytes) and each of them in compact form
+  // (see serializers.h). Every other command gets BinaryTrue or BinaryFalse.
+  void (*appendCompact)(string&, const string&) = NULL;
+
+  switch(command.type){
+    case GetProfilePostsCommand: appendCompact = appendCompactProfilePost; break;
+    case GetTimelinePostsCommand: appendCompact = appendCompactTimelinePost; break;
+    case GetFollowersCommand: appendCompact = appendCompactRelation; break;
+    case GetFriendsCommand: appendCompact = appendCompactRelation; break;
+    default: break;
+  }
 
-        if(waitForClientSignal(connfd, buff) == ClientSignal::Ack){
-          packetStream.str(""); // Reset the string stream and continue
-          packetStream.clear();
-        }
-      }
-    }
-  }else if(!resp.getSingleItem().empty()){
-    // Only one item to send
-    sendPacket(connfd, resp.getSingleItem(), buff.length);
-    // Wait for confirmation from the client
-    waitForClientSignal(connfd, buff);
+  string frame(sizeof(uint32_t), '\0');
+
+  if(appendCompact){
+    uint32_t numItems = htonl(resp.getNumItems());
+
+    frame += (char) BinaryStatus::BinaryItems;
+    frame.append((const char*) &numItems, sizeof(uint32_t));
+
+    for(auto& item:resp.getMultipleItems()){ appendCompact(frame, item); }
+
+  }else{
+    string item = resp.getSingleItem();
+    bool positive = item == "true" || item == "success";
+
+    frame += (char) (positive ? BinaryStatus::BinaryTrue : BinaryStatus::BinaryFalse);
   }
+
+  finishFrame(frame);
+  return frame;
+}
+
+void finishFrame(string& frame){
+  // The first 4 bytes of a frame are reserved for the length of the rest of it
+  // (in network byte order)
+  uint32_t length = htonl(frame.length() - sizeof(uint32_t));
+  memcpy(&frame[0], &length, sizeof(uint32_t));
+}
+
+bool sendFrame(const int connfd, const string& frame){
+  if(!writeAll(connfd, frame.data(), frame.length())) return false;
+
+  cerr << "Sent " << frame.length() - sizeof(uint32_t) << " bytes." << endl;
+  return true;
 }
 
-void sendPacket(const int connfd, const string& content, const int buffSize){
-  if(write(connfd, content.c_str(), buffSize) == -1){
-    cerr << "Write to connection failed." << endl;
+bool writeAll(const int connfd, const char* data, size_t length){
+  // write() may take less than what it's given, so keep going until it's done
+  // (or until it times out after CLIENT_TIMEOUT: see acceptConnections())
+  size_t numWritten = 0;
+
+  while(numWritten < length){
+    ssize_t written = write(connfd, data + numWritten, length - numWritten);
+
+    if(written == -1 && errno == EINTR) continue;
+
+    if(written == -1){
+      cerr << (errno == EAGAIN || errno == EWOULDBLOCK ? "Write to connection timed out." : "Write to connection failed.") << endl;
+      return false;
+    }
+
+    numWritten += written;
   }
 
-  cerr << "Sent: '" << content << "'" << endl;
+  return true;
 }
@@ -3,18 +3,28 @@
 #include <unistd.h>      // close, write
 #include <sys/socket.h>  // socket, AF_INET, SOCK_STREAM, bind, listen, accept
 #include <netinet/in.h>  // servaddr, INADDR_ANY, htons
+#include <sys/epoll.h>   // epoll_create1, epoll_ctl, epoll_wait
+#include <fcntl.h>       // fcntl, O_NONBLOCK
+#include <sys/time.h>    // timeval
+#include <errno.h>
 #include <cstring>
-#include <thread>
-#include <vector>
 #include "config.h"
 #include "protocol.h"
+#include "workerpool.h"
 
 #define SA struct sockaddr
 #define LISTENQ 1024  // 2nd argument to listen()
+#define MAXEVENTS 256 // Max. number of events returned by a single epoll_wait()
 
 
 void launchDispatcher(const int listenfd);
 
+void acceptConnections(const int listenfd, const int epollfd);
+
+void serveConnection(Connection* conn, const int epollfd);
+
+void watchConnection(Connection* conn, const int epollfd, const int op);
+
 
 int main(int argc, char **argv) {
   // Perform necessary configurations before listening for connections
@@ -53,25 +63,121 @@ int main(int argc, char **argv) {
 }
 
 void launchDispatcher(const int listenfd){
-  int connfd;
-  vector<thread> requests;
+  // A single thread (this one) waits on epoll for new connections and for
+  // requests on the accepted ones. Sockets that are ready to be read are
+  // handed to a fixed pool of workers (one per core), so serving a request
+  // never pays for the creation of a thread.
+  WorkerPool workers;
+  fprintf(stderr, "Dispatching requests to %u workers.\n", workers.size());
+
+  int epollfd;
+  if ((epollfd = epoll_create1(0)) == -1) {
+    perror("Unable to create the epoll instance");
+    exit(4);
+  }
+
+  // Never block on accept(): epoll tells us when connections are waiting
+  fcntl(listenfd, F_SETFL, fcntl(listenfd, F_GETFL, 0) | O_NONBLOCK);
+
+  struct epoll_event event;
+  memset(&event, 0, sizeof(event));
+  event.events = EPOLLIN;
+  event.data.ptr = NULL; // Connections point to their Connection instead
+
+  if (epoll_ctl(epollfd, EPOLL_CTL_ADD, listenfd, &event) == -1) {
+    perror("Unable to watch the listening socket");
+    exit(4);
+  }
+
+  struct epoll_event events[MAXEVENTS];
 
-  // Block until someone connects.
   for (;;) {
-    // We could provide a sockaddr if we wanted to know details of whom we are
-    // talking to.
-    fprintf(stderr, "Ready to connect.\n");
-    if ((connfd = accept(listenfd, (SA *) NULL, NULL)) == -1) {
-      perror("accept failed");
+    int numReady = epoll_wait(epollfd, events, MAXEVENTS, -1);
+
+    if (numReady == -1) {
+      if (errno == EINTR) continue;
+      perror("epoll_wait failed");
       exit(4);
     }
+
+    for (int i = 0; i < numReady; i++) {
+      Connection* conn = (Connection*) events[i].data.ptr;
+
+      if (conn == NULL) {
+        acceptConnections(listenfd, epollfd);
+
+      } else {
+        // The connection was registered with EPOLLONESHOT, so epoll won't
+        // report it again while a worker is taking care of it
+        workers.submit([conn, epollfd] { serveConnection(conn, epollfd); });
+      }
+    }
+  }
+}
+
+void acceptConnections(const int listenfd, const int epollfd){
+  // Accept everything that is waiting and watch the new sockets for requests
+  int connfd;
+
+  // Workers block on the socket while they reply (and, for the ACK handshake,
+  // while they wait for the client), so reads and writes give up after
+  // CLIENT_TIMEOUT milliseconds: a client that stops reading or acknowledging
+  // is hung up on instead of keeping a worker busy
+  int timeout = configParams.at("CLIENT_TIMEOUT");
+  struct timeval limit;
+  limit.tv_sec = timeout / 1000;
+  limit.tv_usec = (timeout % 1000) * 1000;
+
+  // We could provide a sockaddr if we wanted to know details of whom we are
+  // talking to.
+  while ((connfd = accept(listenfd, (SA *) NULL, NULL)) != -1) {
     fprintf(stderr, "Connected.\n");
 
-    // We have a connection. Do whatever our task is.
-    requests.push_back(
-      thread([connfd] { handleRequest(connfd); })
-    );
+    if (timeout > 0 && (setsockopt(connfd, SOL_SOCKET, SO_RCVTIMEO, &limit, sizeof(limit)) == -1 ||
+                        setsockopt(connfd, SOL_SOCKET, SO_SNDTIMEO, &limit, sizeof(limit)) == -1)) {
+      perror("Unable to set the connection's timeouts");
+      close(connfd);
+      continue;
+    }
+
+    Connection* conn = new Connection();
+    conn->connfd = connfd;
+    conn->persistent = false;
+    conn->framed = false;
+    conn->binary = false;
+
+    watchConnection(conn, epollfd, EPOLL_CTL_ADD);
   }
 
-  for(thread& th:requests){ th.join(); }
+  if (errno != EAGAIN && errno != EWOULDBLOCK) {
+    perror("accept failed");
+  }
+}
+
+void serveConnection(Connection* conn, const int epollfd){
+  // Runs on a worker: reply to what the client has sent and either wait for
+  // more commands (persistent connections) or hang up
+  if (handleRequest(*conn)) {
+    watchConnection(conn, epollfd, EPOLL_CTL_MOD);
+    return;
+  }
+
+  close(conn->connfd);
+  delete conn;
+
+  fprintf(stderr, "Finished.\n");
+}
+
+void watchConnection(Connection* conn, const int epollfd, const int op){
+  // (Re)arm epoll to report the next time the client sends something
+  struct epoll_event event;
+  memset(&event, 0, sizeof(event));
+  event.events = EPOLLIN | EPOLLONESHOT;
+  event.data.ptr = conn;
+
+  if (epoll_ctl(epollfd, op, conn->connfd, &event) == -1) {
+    perror("Unable to watch the connection");
+    close(conn->connfd);
+    delete conn;
+  }
 }
@@ -0,0 +1,37 @@
+#include <stdexcept>
+#include "rwlock.h"
+using namespace std;
+
+
+RWLock::RWLock(bool preferWriters){
+  pthread_rwlockattr_t attributes;
+  pthread_rwlockattr_init(&attributes);
+
+  if(preferWriters)
+    pthread_rwlockattr_setkind_np(&attributes, PTHREAD_RWLOCK_PREFER_WRITER_NONRECURSIVE_NP);
+
+  int failed = pthread_rwlock_init(&rwlock, &attributes);
+  pthread_rwlockattr_destroy(&attributes);
+
+  if(failed) throw std::runtime_error("Could not initialize rwlock");
+}
+
+RWLock::~RWLock(){
+  pthread_rwlock_destroy(&rwlock);
+}
+
+void RWLock::lockShared(){
+  pthread_rwlock_rdlock(&rwlock);
+}
+
+void RWLock::unlockShared(){
+  pthread_rwlock_unlock(&rwlock);
+}
+
+void RWLock::lock(){
+  pthread_rwlock_wrlock(&rwlock);
+}
+
+void RWLock::unlock(){
+  pthread_rwlock_unlock(&rwlock);
+}
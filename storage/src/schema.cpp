@@ -0,0 +1,99 @@
+#include <stdexcept>
+#include <map>
+#include <vector>
+#include "config.h"
+#include "schema.h"
+using namespace std;
+
+
+// The tables are used as arrays, so they need a definition
+constexpr FieldBounds RecordSchema<CredentialFile>::fields[];
+constexpr FieldBounds RecordSchema<RelationFile>::fields[];
+constexpr FieldBounds RecordSchema<ProfilePostFile>::fields[];
+constexpr FieldBounds RecordSchema<TimelinePostFile>::fields[];
+
+template<StoredFileType T>
+RecordLayout makeRecordLayout(){
+  return {T, RecordSchema<T>::dataType, RecordSchema<T>::serialSize,
+          RecordSchema<T>::NUM_FIELDS, RecordSchema<T>::fields};
+}
+
+// Indexed by StoredFileType
+const RecordLayout recordLayouts[] = {
+  makeRecordLayout<CredentialFile>(),
+  makeRecordLayout<RelationFile>(),
+  makeRecordLayout<ProfilePostFile>(),
+  makeRecordLayout<TimelinePostFile>()
+};
+
+// Names only come from outside the server's code (requests, config.txt and
+// the arguments of the functions that take them): they're looked up in these
+// tables, built once, and the code that goes through items uses the bounds
+const map<string, const FieldBounds*>& getFieldsByName(StoredFileType type){
+  static const vector<map<string, const FieldBounds*>> fieldsByName = []{
+    vector<map<string, const FieldBounds*>> tables;
+
+    for(auto const& layout : recordLayouts){
+      map<string, const FieldBounds*> table;
+      for(int i = 0; i < layout.numFields; i++){ table[layout.fields[i].name] = &layout.fields[i]; }
+
+      tables.push_back(table);
+    }
+
+    return tables;
+  }();
+
+  return fieldsByName[type];
+}
+
+const FieldBounds& RecordLayout::getField(const string& fieldType) const{
+  auto field = getFieldsByName(type).find(fieldType);
+  if(field == getFieldsByName(type).end())
+    throw std::runtime_error(string(dataType) + " has no field " + fieldType);
+
+  return *field->second;
+}
+
+const RecordLayout& getRecordLayout(StoredFileType type){
+  return recordLayouts[type];
+}
+
+const RecordLayout& getRecordLayout(const string& dataType){
+  static const map<string, const RecordLayout*> layoutsByName = []{
+    map<string, const RecordLayout*> table;
+    for(auto const& layout : recordLayouts){ table[layout.dataType] = &layout; }
+
+    return table;
+  }();
+
+  auto layout = layoutsByName.find(dataType);
+  if(layout == layoutsByName.end()) throw std::runtime_error("Given dataType is unknown");
+
+  return *layout->second;
+}
+
+void validateSchemas(){
+  // Every size and bound in config.txt has to be the one in the schema
+  for(auto const& layout : recordLayouts){
+    string dataType = layout.dataType;
+
+    auto check = [&dataType](const string& param, int expected){
+      auto found = configParams.find(param);
+
+      if(found == configParams.end() || found->second != expected)
+        throw std::runtime_error("config.txt doesn't match the schema of " + dataType + " (" + param +
+                                 " should be " + to_string(expected) + ")");
+    };
+
+    check("SERIAL_SIZE_" + dataType, layout.serialSize);
+
+    for(int i = 0; i < layout.numFields; i++){
+      const FieldBounds& field = layout.fields[i];
+      string bounds = "SERIAL_" + dataType + "_" + field.name;
+
+      check(bounds + "_START", field.start);
+      check(bounds + "_END", field.end);
+      check(field.sizeParam, field.end - field.start);
+    }
+  }
+}
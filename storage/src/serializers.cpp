@@ -1,7 +1,12 @@
 #include <iostream>
 #include <sstream>
+#include <algorithm>
 #include <stdexcept>
+#include <stdint.h>
+#include <cstring>
+#include <arpa/inet.h>
 #include "config.h"
+#include "schema.h"
 #include "serializers.h"
 using namespace std;
 
@@ -16,11 +21,15 @@ string serializeCredential(Credential& credential){
 }
 
 string serializeRelation(Relation& relation){
+  if(relation.timestamp.length() != 10){
+    throw std::runtime_error("Length of the str. version of the timestamp must be 10");
+  }
+
   string active = relation.active == Active::Yes ? "1" : "0";
   string firstUsername = pad(relation.firstUsername, configParams.at("FIELD_SIZE_USERNAME"));
   string secondUsername = pad(relation.secondUsername, configParams.at("FIELD_SIZE_USERNAME"));
 
-  return active + firstUsername + relation.direction + secondUsername;
+  return active + firstUsername + relation.direction + secondUsername + relation.timestamp;
 }
 
 string serializeProfilePost(ProfilePost& profilePost){
@@ -52,40 +61,135 @@ string serializeTimelinePost(TimelinePost& timelinePost){
   return active + username + author + timelinePost.timestamp + text;
 }
 
-bool matchesSerialized(const string& serialized, string& dataType, const map<string, string> matchArgs){
-  // Determine whether the provided parameters match the serialized item
-  if(!configParams.count("FILE_COUNT_" + dataType))
-    throw std::runtime_error("Given dataType is unknown");
+void appendCompactString(string& out, const string& paddedValue);
+
+void appendCompactTimestamp(string& out, const string& timestamp);
+
+void appendCompactProfilePost(string& out, const string& serialized){
+  // <timestamp><text> (the username is the one the client asked for)
+  appendCompactTimestamp(out, extractField<ProfilePostFile>(serialized, ProfilePostSchema::TIMESTAMP));
+  appendCompactString(out, extractField<ProfilePostFile>(serialized, ProfilePostSchema::TEXT));
+}
+
+void appendCompactTimelinePost(string& out, const string& serialized){
+  // <author><timestamp><text> (the username is the one the client asked for)
+  appendCompactString(out, extractField<TimelinePostFile>(serialized, TimelinePostSchema::AUTHOR));
+  appendCompactTimestamp(out, extractField<TimelinePostFile>(serialized, TimelinePostSchema::TIMESTAMP));
+  appendCompactString(out, extractField<TimelinePostFile>(serialized, TimelinePostSchema::TEXT));
+}
+
+void appendCompactRelation(string& out, const string& serialized){
+  // <second_username> (the client knows the first one and the direction)
+  appendCompactString(out, extractField<RelationFile>(serialized, RelationSchema::SECOND_USERNAME));
+}
+
+void appendCompactString(string& out, const string& paddedValue){
+  string value = unpad(paddedValue);
+
+  out += (char) value.length();
+  out += value;
+}
+
+void appendCompactTimestamp(string& out, const string& timestamp){
+  uint32_t value = htonl(stoul(timestamp));
+  out.append((const char*) &value, sizeof(uint32_t));
+}
+
+bool matchesField(const char* serialized, const FieldBounds& field, const string& value);
+
+template<StoredFileType T>
+bool matchesRecord(const string& serialized, const map<string, string>& matchArgs){
+  // Each field is compared where it is in the item, padded, without copying it
+  if(serialized.length() < (size_t) RecordSchema<T>::serialSize) return false;
 
-  string ser, fieldType, potentialMatch;
   for(auto const& x : matchArgs){
-    fieldType = x.first;
-    potentialMatch = x.second;
-    ser = extractField(serialized, dataType, fieldType);
-
-    // Pad fields accordingly before comparing them to their serialized
-    // counterparts. Each type of field requires a different type of padding.
-    if(!fieldType.compare("USERNAME") || \
-       !fieldType.compare("AUTHOR") || \
-       !fieldType.compare("FIRST_USERNAME") || \
-       !fieldType.compare("SECOND_USERNAME")){
-      potentialMatch = pad(potentialMatch, configParams.at("FIELD_SIZE_USERNAME"));
-
-    }else if(!fieldType.compare("PASSWORD")){
-      potentialMatch = pad(potentialMatch, configParams.at("FIELD_SIZE_PASSWORD"));
-
-    }else if(!fieldType.compare("TEXT")){
-      potentialMatch = pad(potentialMatch, configParams.at("FIELD_SIZE_TEXT"));
-    }
+    if(!matchesField(serialized.data(), getRecordLayout(T).getField(x.first), x.second)) return false;
+  }
+
+  return true;
+}
+
+bool matchesSerialized(const string& serialized, string& dataType, const map<string, string>& matchArgs){
+  // Determine whether the provided parameters match the serialized item, with
+  // the code that is specialized for its type
+  switch(getRecordLayout(dataType).type){
+    case CredentialFile: return matchesRecord<CredentialFile>(serialized, matchArgs);
+    case RelationFile: return matchesRecord<RelationFile>(serialized, matchArgs);
+    case ProfilePostFile: return matchesRecord<ProfilePostFile>(serialized, matchArgs);
+    case TimelinePostFile: return matchesRecord<TimelinePostFile>(serialized, matchArgs);
+  }
+
+  return false;
+}
 
-    if(ser.compare(potentialMatch)){
-      return false;
+bool matchesField(const char* serialized, const FieldBounds& field, const string& value){
+  // Padded fields (usernames, passwords and texts) are compared to the value
+  // as pad() would pad it; the others have to be the value itself
+  size_t fieldSize = field.end - field.start, numFillers = fieldSize - value.length();
+  const char* data = serialized + field.start;
+
+  if(value.length() > fieldSize){
+    if(field.padded) throw std::runtime_error("Given value exceeds specified fieldSize");
+    return false;
+  }
+
+  if(numFillers && !field.padded) return false;
+
+  for(size_t i = 0; i < numFillers; i++){
+    if(data[i] != fillerChar) return false;
+  }
+
+  return !memcmp(data + numFillers, value.data(), value.length());
+}
+
+MatchPredicate::MatchPredicate(const string& dataType, const map<string, string>& matchArgs){
+  // The owner's field is checked late, since readers usually only visit the
+  // owner's items already (see LReader), and one-character fields (the
+  // active flag and the direction) last, since many items share them
+  const RecordLayout& layout = getRecordLayout(dataType);
+  const string& ownerField = getOwnerField(dataType);
+
+  serialSize = layout.serialSize;
+  satisfiable = true;
+
+  vector<pair<int, FieldMatch>> ranked;
+
+  for(auto const& x : matchArgs){
+    const FieldBounds& field = layout.getField(x.first);
+    int fieldSize = field.end - field.start;
+    int rank = fieldSize == 1 ? 2 : x.first == ownerField ? 1 : 0;
+
+    if(field.padded){
+      ranked.push_back(make_pair(rank, FieldMatch{field.start, pad(x.second, fieldSize)}));
+
+    }else if((int) x.second.length() == fieldSize){
+      ranked.push_back(make_pair(rank, FieldMatch{field.start, x.second}));
+
+    }else{
+      satisfiable = false;
     }
   }
 
+  stable_sort(ranked.begin(), ranked.end(),
+              [](const pair<int, FieldMatch>& a, const pair<int, FieldMatch>& b){ return a.first < b.first; });
+
+  for(auto& x : ranked){ fields.push_back(x.second); }
+}
+
+bool MatchPredicate::matches(const char* serialized) const{
+  if(!satisfiable) return false;
+
+  for(auto const& field : fields){
+    if(memcmp(serialized + field.start, field.expected.data(), field.expected.length())) return false;
+  }
+
   return true;
 }
 
+bool MatchPredicate::matches(const string& serialized) const{
+  return serialized.length() >= serialSize && matches(serialized.data());
+}
+
 string pad(const string& value, unsigned int fieldSize){
   // Create a string of size fieldSize where value is at the right and
   // the rest of the characters are fillers (padded)
@@ -108,13 +212,12 @@ string unpad(const string& value){
 
 string extractField(const string& serialized, string& dataType, string& fieldType){
   // Extract start and end bounds based on the type of the data and field
-  // The constants with the index information are provided by the config module
-  string wanted = "SERIAL_" + dataType + "_" + fieldType;
-
-  unsigned int startIdx = configParams.at(wanted + "_START");
-  unsigned int endIdx = configParams.at(wanted + "_END");
+  // The bounds are given by the schema of the type (see schema.h)
+  return extractField(serialized, getRecordLayout(dataType).getField(fieldType));
+}
 
-  string match = serialized.substr(startIdx, (endIdx - startIdx));
+string extractField(const string& serialized, const FieldBounds& field){
+  string match = serialized.substr(field.start, field.end - field.start);
   //cout << serialized.length() << endl;
   if(match.empty()){ throw std::runtime_error("No config parameter found"); }
 
@@ -1,16 +1,24 @@
 #include <iostream>
+#include <algorithm>
+#include <functional>
 #include <map>
+#include <queue>
+#include <tuple>
+#include <unordered_set>
 #include "config.h"
 #include "filehandler.h"
 #include "serializers.h"
 #include "utils.h"
+#include "fanout.h"
 #include "user.h"
 using namespace std;
 
 
+vector<string> mergeTimelines(const vector<vector<string>>& unsorted, int limit);
+
 bool exists(const string& username){
   // Check if the wanted account exists and is active
-  string credentialPath = getStoredFilePath(StoredFileType::CredentialFile, username);
+  StoredFile credentialFile = getStoredFile(StoredFileType::CredentialFile, username);
   string dataType = "CREDENTIAL";
 
   map<string, string> matchArgs = {
@@ -18,13 +26,13 @@ bool exists(const string& username){
     {"USERNAME", username}
   };
 
-  int matchLocation = itemMatch(credentialPath, dataType, matchArgs);
+  int matchLocation = itemMatch(credentialFile, dataType, matchArgs);
   return matchLocation != -1;
 }
 
 bool verifyCredential(const string& username, const string& password){
   // true iff there's an entry marked "active" that matches the user's username and password
-  string credentialPath = getStoredFilePath(StoredFileType::CredentialFile, username);
+  StoredFile credentialFile = getStoredFile(StoredFileType::CredentialFile, username);
   string dataType = "CREDENTIAL";
 
   map<string, string> matchArgs = {
@@ -33,13 +41,13 @@ bool verifyCredential(const string& username, const string& password){
     {"PASSWORD", password}
   };
 
-  int matchLocation = itemMatch(credentialPath, dataType, matchArgs);
+  int matchLocation = itemMatch(credentialFile, dataType, matchArgs);
   return matchLocation != -1;
 }
 
 bool saveCredential(const string& username, const string& password){
   // save the username, password combo to the system
-  string credentialPath = getStoredFilePath(StoredFileType::CredentialFile, username);
+  StoredFile credentialFile = getStoredFile(StoredFileType::CredentialFile, username);
   string dataType = "CREDENTIAL";
 
   const map<string, string> matchArgs = {
@@ -47,14 +55,14 @@ bool saveCredential(const string& username, const string& password){
     {"PASSWORD", password}
   };
 
-  int matchLocation = itemMatch(credentialPath, dataType, matchArgs);
+  int matchLocation = itemMatch(credentialFile, dataType, matchArgs);
 
   if(matchLocation == -1){
     // Means that the credential wasn't found in the system. Save it!
     Credential credential = {Active::Yes, username, password};
     string serialized = serializeCredential(credential);
 
-    appendToDataFile(credentialPath, serialized);
+    appendToDataFile(credentialFile, serialized);
     return true;
   }
 
@@ -62,15 +70,53 @@ bool saveCredential(const string& username, const string& password){
 }
 
 bool deleteCredential(const string& username, const string& password){
-  // Delete the credential as well as all of the relevant posts
-  string timestamp, dataType = "PROFILE_POST", fieldType = "TIMESTAMP";
-  for(string& serializedPost : getProfilePosts(username, -1)){
-    timestamp = extractField(serializedPost, dataType, fieldType);
-    deletePost(username, timestamp);
+  // Delete the credential as well as all of the relevant posts, at once.
+  // Rather than deleting the posts one by one, each file that has any of them
+  // is swept once, the files in parallel: the profile file for the user's
+  // items, and the timeline files of the followers for the items that the
+  // user wrote. The sweeps only find positions (the batch holds the files, on
+  // this thread, so that they don't move), which are deactivated along with
+  // the credential by a single batch.
+  if(!verifyCredential(username, password)) return false;
+  waitForFanout(username);
+
+  map<tuple<StoredFileType, unsigned int, unsigned int>, StoredFile> timelineFiles;
+
+  for(string& serializedRelation : getFollowers(username, -1)){
+    string followerUsername = unpad(extractField<RelationFile>(serializedRelation, RelationSchema::SECOND_USERNAME));
+    StoredFile timelinePostFile = getStoredFile(StoredFileType::TimelinePostFile, followerUsername);
+
+    auto key = make_tuple(timelinePostFile.type, timelinePostFile.generation, timelinePostFile.bucket);
+    timelineFiles[key] = timelinePostFile;
+  }
+
+  WriteBatch batch;
+  vector<StoredFile> sweptFiles(1, getStoredFile(StoredFileType::ProfilePostFile, username));
+  for(auto const& x : timelineFiles){ sweptFiles.push_back(x.second); }
+
+  for(auto const& sweptFile : sweptFiles){ batch.hold(sweptFile); }
+
+  vector<vector<long>> positions(sweptFiles.size());
+  vector<function<void()>> tasks;
+
+  tasks.push_back([&username, &sweptFiles, &positions]{
+    string dataType = "PROFILE_POST";
+    positions[0] = itemMatchPositions(sweptFiles[0], dataType, {{"ACTIVE", "1"}, {"USERNAME", username}});
+  });
+
+  for(size_t i = 1; i < sweptFiles.size(); i++){
+    tasks.push_back([&username, &sweptFiles, &positions, i]{
+      string dataType = "TIMELINE_POST";
+      positions[i] = itemMatchPositions(sweptFiles[i], dataType, {{"ACTIVE", "1"}, {"AUTHOR", username}});
+    });
   }
 
-  string credentialPath = getStoredFilePath(StoredFileType::CredentialFile, username);
-  dataType = "CREDENTIAL";
+  getFileWorkers().runAll(tasks);
+
+  for(size_t i = 0; i < sweptFiles.size(); i++){ batch.setActiveFlag(false, sweptFiles[i], positions[i]); }
+
+  StoredFile credentialFile = getStoredFile(StoredFileType::CredentialFile, username);
+  string dataType = "CREDENTIAL";
 
   map<string, string> matchArgs = {
     {"ACTIVE", "1"},
@@ -78,48 +124,111 @@ bool deleteCredential(const string& username, const string& password){
     {"PASSWORD", password}
   };
 
-  setActiveFlag(false, credentialPath, dataType, matchArgs);
-  return true; // iff everything has gone well
+  batch.setActiveFlag(false, credentialFile, dataType, matchArgs);
+
+  // Durable once it's applied: a crash leaves either the account and its
+  // posts or neither
+  batch.apply();
+  forgetPosts(username);
+
+  return true;
 }
 
 bool savePost(const string& username, const string& text){
   // Save the post (as seen by the user's profile file and the followers'
-  // timeline files) --slow
+  // timeline files) --slow, unless the timelines are written in the background
 
   // Record to the user's profile file
   // Note that the timestamp is created here... not by the client
   string postTimestamp = getTimeNow();
 
-  string profilePostPath = getStoredFilePath(StoredFileType::ProfilePostFile, username);
+  StoredFile profilePostFile = getStoredFile(StoredFileType::ProfilePostFile, username);
 
   ProfilePost profilePost = {Active::Yes, username, postTimestamp, text};
   string serialized = serializeProfilePost(profilePost);
-  appendToDataFile(profilePostPath, serialized);
 
-  // Record to each follower's timeline file
-  string paddedFollowerUsername, followerUsername, timelinePostPath;
-  string dataType = "RELATION", fieldType = "SECOND_USERNAME";
+  if(isHighFollower(username)){
+    // The followers read the post from the profile file (see getTimelinePosts())
+    appendToDataFile(profilePostFile, serialized);
+    forgetPosts(username);
+
+    return true;
+  }
+
+  if(isFanoutAsync()){
+    // The fan-out is recorded first, so that it isn't lost if the server stops
+    // once the post is in the profile file
+    long intent = logFanoutIntent(serialized);
+    appendToDataFile(profilePostFile, serialized);
+    queueFanout(intent, serialized);
+
+    return true;
+  }
+
+  // Every copy is saved at once (and none is, if the server stops first)
+  WriteBatch batch;
+  batch.append(profilePostFile, serialized);
+
+  fanOutPost(batch, username, postTimestamp, text, false);
+
+  batch.apply();
+  return true;
+}
+
+void fanOutPost(WriteBatch& batch, const string& username, const string& timestamp,
+                const string& text, bool recovering){
+  // Record to each follower's timeline file. A post that is fanned out again
+  // (see fanout.h) is skipped if it isn't in the profile file, and so are the
+  // timelines that already have it.
+  string dataType = "PROFILE_POST";
+
+  if(recovering){
+    StoredFile profilePostFile = getStoredFile(StoredFileType::ProfilePostFile, username);
+
+    map<string, string> matchArgs = {
+      {"USERNAME", username},
+      {"TIMESTAMP", timestamp},
+      {"TEXT", text}
+    };
+
+    if(itemMatch(profilePostFile, dataType, matchArgs) == -1) return;
+  }
+
+  string paddedFollowerUsername, followerUsername, serialized;
 
   for(string& serializedRelation : getFollowers(username, -1)){
-    paddedFollowerUsername = extractField(serializedRelation, dataType, fieldType);
+    paddedFollowerUsername = extractField<RelationFile>(serializedRelation, RelationSchema::SECOND_USERNAME);
 
     followerUsername = unpad(paddedFollowerUsername);
-    timelinePostPath = getStoredFilePath(StoredFileType::TimelinePostFile, followerUsername);
+    StoredFile timelinePostFile = getStoredFile(StoredFileType::TimelinePostFile, followerUsername);
+
+    if(recovering){
+      dataType = "TIMELINE_POST";
+
+      map<string, string> matchArgs = {
+        {"USERNAME", followerUsername},
+        {"AUTHOR", username},
+        {"TIMESTAMP", timestamp},
+        {"TEXT", text}
+      };
+
+      if(itemMatch(timelinePostFile, dataType, matchArgs) != -1) continue;
+    }
 
     // Create the timeline post and save it
-    TimelinePost timelinePost = {Active::Yes, followerUsername, username, postTimestamp, text};
+    TimelinePost timelinePost = {Active::Yes, followerUsername, username, timestamp, text};
     serialized = serializeTimelinePost(timelinePost);
-    appendToDataFile(timelinePostPath, serialized);
+    batch.append(timelinePostFile, serialized);
   }
-
-  return true;
 }
 
 bool deletePost(const string& username, const string& timestamp){
   // Delete the post (as seen by the user's profile file and the followers'
-  // timeline files) --slow
+  // timeline files) --slow. Posts that are still being fanned out would be
+  // copied to more timelines afterwards.
+  waitForFanout(username);
 
-  string profilePostPath = getStoredFilePath(StoredFileType::ProfilePostFile, username);
+  StoredFile profilePostFile = getStoredFile(StoredFileType::ProfilePostFile, username);
   string dataType = "PROFILE_POST";
 
   map<string, string> matchArgs = {
@@ -128,33 +237,31 @@ bool deletePost(const string& username, const string& timestamp){
     {"TIMESTAMP", timestamp}
   };
 
-  setActiveFlag(false, profilePostPath, dataType, matchArgs);
+  // Every copy is deleted at once
+  WriteBatch batch;
+  batch.setActiveFlag(false, profilePostFile, dataType, matchArgs);
 
-  // Delete from the followers' timelines
-  string paddedFollowerUsername, followerUsername, timelinePostPath, fieldType;
+  // Delete from the followers' timelines (the copies are looked up where they
+  // were written, once per timeline file)
+  string paddedFollowerUsername, followerUsername;
   for(string& serializedRelation : getFollowers(username, -1)){
-    dataType = "RELATION", fieldType = "SECOND_USERNAME";
-    paddedFollowerUsername = extractField(serializedRelation, dataType, fieldType);
+    paddedFollowerUsername = extractField<RelationFile>(serializedRelation, RelationSchema::SECOND_USERNAME);
 
     followerUsername = unpad(paddedFollowerUsername);
-    timelinePostPath = getStoredFilePath(StoredFileType::TimelinePostFile, followerUsername);
-    dataType = "TIMELINE_POST";
+    StoredFile timelinePostFile = getStoredFile(StoredFileType::TimelinePostFile, followerUsername);
 
-    matchArgs.clear();
-    matchArgs["ACTIVE"] = "1";
-    matchArgs["USERNAME"] = followerUsername;
-    matchArgs["AUTHOR"] = username;
-    matchArgs["TIMESTAMP"] = timestamp;
-
-    setActiveFlag(false, timelinePostPath, dataType, matchArgs);
+    batch.setPostActiveFlag(false, timelinePostFile, followerUsername, username, timestamp);
   }
 
+  batch.apply();
+  forgetPosts(username);
+
   return true; // iff everything has gone well
 }
 
 vector<string> getTimelinePosts(const string& username, int limit){
   // Retrieve the posts that belong on the user's timeline (read from single file --fast)
-  string timelinePostPath = getStoredFilePath(StoredFileType::TimelinePostFile, username);
+  StoredFile timelinePostFile = getStoredFile(StoredFileType::TimelinePostFile, username);
   string dataType = "TIMELINE_POST";
 
   map<string, string> matchArgs = {
@@ -162,13 +269,93 @@ vector<string> getTimelinePosts(const string& username, int limit){
     {"USERNAME", username}
   };
 
-  vector<string> timelinePosts = itemMatchSweep(timelinePostPath, dataType, matchArgs, limit);
-  return timelinePosts;
+  vector<string> timelinePosts = itemMatchSweep(timelinePostFile, dataType, matchArgs, limit);
+  if(!isHybridFanout()) return timelinePosts;
+
+  // The posts of the high-follower accounts that the user follows aren't in
+  // the timeline file: their newest ones are merged in, as timeline posts, as
+  // long as they were saved since the user followed them
+  vector<vector<string>> sources(1, timelinePosts);
+
+  for(auto const& x : getHighFollowerFriends(username)){
+    const string& friendUsername = x.first, & followTime = x.second;
+    sources.push_back(vector<string>());
+
+    for(string& serializedPost : getRecentPosts(friendUsername, limit)){
+      string timestamp = extractField<ProfilePostFile>(serializedPost, ProfilePostSchema::TIMESTAMP);
+      if(timestamp < followTime) break;
+
+      TimelinePost timelinePost = {Active::Yes, username, friendUsername, timestamp,
+                                   unpad(extractField<ProfilePostFile>(serializedPost, ProfilePostSchema::TEXT))};
+
+      sources.back().push_back(serializeTimelinePost(timelinePost));
+    }
+  }
+
+  if(sources.size() == 1) return timelinePosts;
+  return mergeTimelines(sources, limit);
+}
+
+vector<string> mergeTimelines(const vector<vector<string>>& unsorted, int limit){
+  // k-way merge of lists of timeline posts by timestamp, newest first (ties
+  // keep the order of the sources). Posts that were copied to the timeline
+  // before their author had as many followers are also in the author's
+  // profile: they're only kept once.
+  typedef tuple<string, size_t, size_t> Head; // Timestamp, source, index
+  auto older = [](const Head& first, const Head& second){
+    return get<0>(first) != get<0>(second) ? get<0>(first) < get<0>(second)
+                                           : get<1>(first) > get<1>(second);
+  };
+
+  priority_queue<Head, vector<Head>, decltype(older)> heads(older);
+  auto timestamp = [](const string& post){
+    return extractField<TimelinePostFile>(post, TimelinePostSchema::TIMESTAMP);
+  };
+
+  // Timeline files are in the order in which posts were delivered, which
+  // isn't the order in which they were saved when several fan-out workers
+  // deliver them: each source is sorted (stably) before it's merged
+  vector<vector<string>> sources(unsorted.size());
+
+  for(size_t source = 0; source < unsorted.size(); source++){
+    vector<pair<string, size_t>> timestamps;
+
+    for(size_t i = 0; i < unsorted[source].size(); i++){
+      timestamps.push_back(make_pair(timestamp(unsorted[source][i]), i));
+    }
+
+    stable_sort(timestamps.begin(), timestamps.end(),
+                [](const pair<string, size_t>& first, const pair<string, size_t>& second){
+      return first.first > second.first;
+    });
+
+    for(auto const& x : timestamps){ sources[source].push_back(unsorted[source][x.second]); }
+
+    if(!timestamps.empty()) heads.push(make_tuple(timestamps[0].first, source, 0));
+  }
+
+  vector<string> merged;
+  unordered_set<string> seen;
+
+  while(!heads.empty() && (limit == -1 || (int) merged.size() < limit)){
+    Head head = heads.top();
+    heads.pop();
+
+    const vector<string>& source = sources[get<1>(head)];
+    const string& post = source[get<2>(head)];
+    if(seen.insert(post).second) merged.push_back(post);
+
+    size_t next = get<2>(head) + 1;
+    if(next < source.size())
+      heads.push(make_tuple(timestamp(source[next]), get<1>(head), next));
+  }
+
+  return merged;
 }
 
 vector<string> getProfilePosts(const string& username, int limit){
   // Retrieve the posts that belong on the user's profile (read from single file --fast)
-  string profilePostPath = getStoredFilePath(StoredFileType::ProfilePostFile, username);
+  StoredFile profilePostFile = getStoredFile(StoredFileType::ProfilePostFile, username);
   string dataType = "PROFILE_POST";
 
   map<string, string> matchArgs = {
@@ -176,13 +363,13 @@ vector<string> getProfilePosts(const string& username, int limit){
     {"USERNAME", username}
   };
 
-  vector<string> profilePosts = itemMatchSweep(profilePostPath, dataType, matchArgs, limit);
+  vector<string> profilePosts = itemMatchSweep(profilePostFile, dataType, matchArgs, limit);
   return profilePosts;
 }
 
 bool isFollowing(const string& username, const string& friendUsername){
   // True if username follows friendUsername, false otherwise --fast
-  string relationPath = getStoredFilePath(StoredFileType::RelationFile, username);
+  StoredFile relationFile = getStoredFile(StoredFileType::RelationFile, username);
   string dataType = "RELATION";
 
   map<string, string> matchArgs = {
@@ -192,7 +379,7 @@ bool isFollowing(const string& username, const string& friendUsername){
     {"SECOND_USERNAME", friendUsername}
   };
 
-  int matchLocation = itemMatch(relationPath, dataType, matchArgs);
+  int matchLocation = itemMatch(relationFile, dataType, matchArgs);
   return matchLocation != -1;
 }
 
@@ -201,54 +388,41 @@ bool follow(const string& username, const string& friendUsername){
   // friendUsername's --slow
   if(!exists(friendUsername)) return false;
 
-  // Record the user's relation (only make a change if not following already)
-  string relationPath = getStoredFilePath(StoredFileType::RelationFile, username);
-  string dataType = "RELATION";
+  // Both relations are recorded at once, with the time of the follow. Each one
+  // is looked up once, when the batch is applied: only a change is made if not
+  // following already.
+  WriteBatch batch;
+  string followTime = getTimeNow();
 
-  map<string, string> matchArgs = {
-    {"ACTIVE", "1"},
+  StoredFile relationFile = getStoredFile(StoredFileType::RelationFile, username);
+  Relation relation = {Active::Yes, username, '>', friendUsername, followTime};
+
+  map<string, string> keyArgs = {
     {"FIRST_USERNAME", username},
     {"DIRECTION", ">"},
     {"SECOND_USERNAME", friendUsername}
   };
 
-  int numModified = setActiveFlag(true, relationPath, dataType, matchArgs);
-
-  if(!numModified){
-    matchArgs["ACTIVE"] = "0";
-    numModified = setActiveFlag(true, relationPath, dataType, matchArgs);
+  batch.upsert(relationFile, serializeRelation(relation), keyArgs);
 
-    if(!numModified){
-      Relation relation = {Active::Yes, username, '>', friendUsername};
-      string serialized = serializeRelation(relation);
+  StoredFile friendRelationFile = getStoredFile(StoredFileType::RelationFile, friendUsername);
+  Relation friendRelation = {Active::Yes, friendUsername, '<', username, followTime};
 
-      appendToDataFile(relationPath, serialized);
-    }
-  }
+  keyArgs["FIRST_USERNAME"] = friendUsername;
+  keyArgs["DIRECTION"] = "<";
+  keyArgs["SECOND_USERNAME"] = username;
 
-  // Record the friend's relation (only make a change if not following already)
-  relationPath = getStoredFilePath(StoredFileType::RelationFile, friendUsername);
+  bool followed = false;
+  batch.upsert(friendRelationFile, serializeRelation(friendRelation), keyArgs, &followed);
 
-  matchArgs.clear();
-  matchArgs["ACTIVE"] = "1";
-  matchArgs["FIRST_USERNAME"] = friendUsername;
-  matchArgs["DIRECTION"] = "<";
-  matchArgs["SECOND_USERNAME"] = username;
-
-  numModified = setActiveFlag(true, relationPath, dataType, matchArgs);
-
-  if(!numModified){
-    matchArgs["ACTIVE"] = "0";
-    numModified = setActiveFlag(true, relationPath, dataType, matchArgs);
-
-    if(!numModified){
-      Relation relation = {Active::Yes, friendUsername, '<', username};
-      string serialized = serializeRelation(relation);
-
-      appendToDataFile(relationPath, serialized);
-    }
-  }
+  // If the friend becomes a high-follower account, their posts stop being
+  // fanned out from now on (see catchUpFanout() for the other way around)
+  changeFollowers(friendUsername, [&batch, &followed]{
+    batch.apply();
+    return followed ? 1L : 0L;
+  });
 
+  forgetFriends(username);
   return true;
 }
 
@@ -256,9 +430,15 @@ bool unfollow(const string& username, const string& friendUsername){
   // Record the unfollow as a relation in username's file as well as
   // friendUsername's. Also delete friendUsername's posts from username's
   // timeline --slow
+  waitForFanout(friendUsername);
+  bool wasHighFollower = isHighFollower(friendUsername);
+
   string dataType = "RELATION";
 
-  string relationPath = getStoredFilePath(StoredFileType::RelationFile, username);
+  // Every change is made at once
+  WriteBatch batch;
+
+  StoredFile relationFile = getStoredFile(StoredFileType::RelationFile, username);
 
   map<string, string> matchArgs = {
     {"ACTIVE", "1"},
@@ -267,9 +447,9 @@ bool unfollow(const string& username, const string& friendUsername){
     {"SECOND_USERNAME", friendUsername}
   };
 
-  setActiveFlag(false, relationPath, dataType, matchArgs);
+  batch.setActiveFlag(false, relationFile, dataType, matchArgs);
 
-  relationPath = getStoredFilePath(StoredFileType::RelationFile, friendUsername);
+  StoredFile friendRelationFile = getStoredFile(StoredFileType::RelationFile, friendUsername);
 
   matchArgs.clear();
   matchArgs["ACTIVE"] = "1";
@@ -277,23 +457,56 @@ bool unfollow(const string& username, const string& friendUsername){
   matchArgs["DIRECTION"] = "<";
   matchArgs["SECOND_USERNAME"] = username;
 
-  setActiveFlag(false, relationPath, dataType, matchArgs);
+  // Concurrent unfollows may find the same relation: only the one that
+  // deactivates it counts
+  int numUnfollowed = 0;
+  batch.setActiveFlag(false, friendRelationFile, dataType, matchArgs, &numUnfollowed);
+
+  // Delete the friend's posts from the user's timeline: each one is looked up
+  // where it was copied (through the post index) if the friend has fewer posts
+  // than the timeline has items. Otherwise, and for timelines without a post
+  // index (rings keep few items) or friends whose posts mostly weren't copied
+  // (high-follower ones), the timeline's items are all read instead.
+  StoredFile timelinePostFile = getStoredFile(StoredFileType::TimelinePostFile, username);
+  StoredFile profilePostFile = getStoredFile(StoredFileType::ProfilePostFile, friendUsername);
+  long numFriendPosts = countItems(profilePostFile, friendUsername);
+
+  bool lookUpPosts = hasPostIndex(timelinePostFile) && !wasHighFollower && numFriendPosts != -1 &&
+                     numFriendPosts < countItems(timelinePostFile, username);
+
+  if(lookUpPosts){
+    for(string& serializedPost : getProfilePosts(friendUsername, -1)){
+      batch.setPostActiveFlag(false, timelinePostFile, username, friendUsername,
+                              extractField<ProfilePostFile>(serializedPost, ProfilePostSchema::TIMESTAMP));
+    }
 
-  dataType = "TIMELINE_POST";
-  string timelinePostPath = getStoredFilePath(StoredFileType::TimelinePostFile, username);
+  }else{
+    dataType = "TIMELINE_POST";
 
-  matchArgs.clear();
-  matchArgs["ACTIVE"] = "1";
-  matchArgs["USERNAME"] = username;
-  matchArgs["AUTHOR"] = friendUsername;
+    matchArgs.clear();
+    matchArgs["ACTIVE"] = "1";
+    matchArgs["USERNAME"] = username;
+    matchArgs["AUTHOR"] = friendUsername;
+
+    batch.setActiveFlag(false, timelinePostFile, dataType, matchArgs);
+  }
+
+  changeFollowers(friendUsername, [&batch, &numUnfollowed]{
+    batch.apply();
+    return (long) -numUnfollowed;
+  });
+
+  forgetFriends(username);
+
+  // The friend's posts weren't fanned out while they had more followers
+  if(wasHighFollower && !isHighFollower(friendUsername)) catchUpFanout(friendUsername);
 
-  setActiveFlag(false, timelinePostPath, dataType, matchArgs);
   return true; // iff everything has gone well
 }
 
 vector<string> getFollowers(const string& username, int limit){
   // Retrieve follower relations (read from single file --fast)
-  string relationPath = getStoredFilePath(StoredFileType::RelationFile, username);
+  StoredFile relationFile = getStoredFile(StoredFileType::RelationFile, username);
   string dataType = "RELATION";
 
   map<string, string> matchArgs = {
@@ -302,13 +515,13 @@ vector<string> getFollowers(const string& username, int limit){
     {"DIRECTION", "<"},
   };
 
-  vector<string> serializedRelations = itemMatchSweep(relationPath, dataType, matchArgs, limit);
+  vector<string> serializedRelations = itemMatchSweep(relationFile, dataType, matchArgs, limit);
   return serializedRelations;
 }
 
 vector<string> getFriends(const string& username, int limit){
   // Retrieve friend relations (read from single file --fast)
-  string relationPath = getStoredFilePath(StoredFileType::RelationFile, username);
+  StoredFile relationFile = getStoredFile(StoredFileType::RelationFile, username);
   string dataType = "RELATION";
 
   map<string, string> matchArgs = {
@@ -317,6 +530,6 @@ vector<string> getFriends(const string& username, int limit){
     {"DIRECTION", ">"},
   };
 
-  vector<string> serializedRelations = itemMatchSweep(relationPath, dataType, matchArgs, limit);
+  vector<string> serializedRelations = itemMatchSweep(relationFile, dataType, matchArgs, limit);
   return serializedRelations;
 }
@@ -0,0 +1,351 @@
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <stdexcept>
+#include <map>
+#include <vector>
+#include <mutex>
+#include <atomic>
+#include <condition_variable>
+#include <stdint.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <arpa/inet.h>
+#include "config.h"
+#include "rwlock.h"
+#include "filehandler.h"
+#include "wal.h"
+using namespace std;
+
+
+// Kinds of entries in the log. Each one is its length and checksum (4 bytes
+// each, like every other number in network byte order), followed by its kind,
+// the file's type (1 byte each), generation, bucket, position (8 bytes) and
+// the records that were appended or the new flag. Batches are their kind
+// followed by the changes that they're made of, each one preceded by its
+// length.
+const char appendEntry = 'A';
+const char flagEntry = 'F';
+const char batchEntry = 'B';
+
+const size_t entryHeaderSize = 2 * sizeof(uint32_t);
+
+DurabilityMode durabilityMode = NoDurability;
+
+// Changes hold it from the moment they're logged until they're in their data
+// file; checkpoints hold it exclusively (and are let in before new changes)
+RWLock changesInFlight(true);
+
+// Entries are logged into memory and written along with the fsync() that
+// makes them durable. Positions in the log are counted in bytes since the
+// server started (they keep growing when the log is emptied).
+mutex logAccess;
+condition_variable logSynced;
+int logFd = -1;
+string unwritten;
+long loggedEnd = 0, durableEnd = 0, logSize = 0;
+bool syncing = false;
+
+// Where the last change that this thread logged ends
+thread_local long lastLogged = 0;
+
+// Only one checkpoint at a time: the log that a checkpoint swaps out is only
+// deleted once the data files are synced
+mutex checkpoints;
+
+atomic<long> numCommits(0), numSyncs(0);
+
+string getLogPath();
+
+void replayLogFile(const string& path, map<string, int>& files, long& numReplayed);
+
+string encodeChange(char kind, const StoredFile& storedFile, long position, const string& data);
+
+bool replayChange(const string& change, map<string, int>& files);
+
+unique_ptr<SharedLock> logEntry(const string& payload);
+
+void waitUntilDurable(unique_lock<mutex>& lck);
+
+void writeAndSync(unique_lock<mutex>& lck, bool unlockWhileSyncing);
+
+void appendNumber(string& out, uint32_t number);
+
+uint32_t readNumber(const string& in, size_t offset);
+
+uint32_t checksum(const char* data, size_t length);
+
+
+void replayLog(){
+  // Changes are made again in the order in which they were logged: first the
+  // ones in a log that a checkpoint swapped out but didn't get to delete
+  durabilityMode = (DurabilityMode) configParams.at("WAL_MODE");
+
+  map<string, int> files;
+  long numReplayed = 0;
+
+  replayLogFile(getLogPath() + ".old", files, numReplayed);
+  replayLogFile(getLogPath(), files, numReplayed);
+
+  for(auto const& x : files){
+    if(x.second == -1) continue;
+
+    if(fsync(x.second) == -1) throw std::runtime_error("Could not sync " + x.first);
+    close(x.second);
+  }
+
+  if(numReplayed) cerr << "Replayed " << numReplayed << " changes from the write-ahead log\n";
+
+  // Everything in the log is in the data files now
+  logFd = open(getLogPath().c_str(), O_WRONLY | O_CREAT | O_APPEND, 0644);
+  if(logFd == -1 || ftruncate(logFd, 0) == -1 || fsync(logFd) == -1)
+    throw std::runtime_error("Could not open " + getLogPath());
+
+  unlink((getLogPath() + ".old").c_str());
+}
+
+void replayLogFile(const string& path, map<string, int>& files, long& numReplayed){
+  // The log ends at the first entry that is incomplete (i.e. that was being
+  // written)
+  ifstream infile(path, ios::binary);
+  string log((istreambuf_iterator<char>(infile)), istreambuf_iterator<char>());
+
+  for(size_t offset = 0; offset + entryHeaderSize <= log.length();){
+    uint32_t length = readNumber(log, offset);
+    size_t payload = offset + entryHeaderSize;
+
+    if(!length || payload + length > log.length() ||
+       checksum(log.data() + payload, length) != readNumber(log, offset + sizeof(uint32_t))) break;
+
+    string entry = log.substr(payload, length);
+    offset = payload + length;
+
+    if(entry[0] != batchEntry){
+      numReplayed += replayChange(entry, files);
+      continue;
+    }
+
+    // Every change of a batch is in the log, since the entry is complete
+    for(size_t change = 1; change + sizeof(uint32_t) <= entry.length();){
+      uint32_t changeLength = readNumber(entry, change);
+      change += sizeof(uint32_t);
+
+      numReplayed += replayChange(entry.substr(change, changeLength), files);
+      change += changeLength;
+    }
+  }
+}
+
+unique_ptr<SharedLock> logAppend(const StoredFile& storedFile, long position, const string& records){
+  if(durabilityMode == NoDurability) return nullptr;
+  return logEntry(encodeChange(appendEntry, storedFile, position, records));
+}
+
+unique_ptr<SharedLock> logBatch(const vector<LoggedChange>& changes){
+  // A single entry, so that either all of the changes are made again or none
+  if(durabilityMode == NoDurability) return nullptr;
+
+  string payload(1, batchEntry);
+
+  for(auto const& change : changes){
+    string encoded = encodeChange(change.append ? appendEntry : flagEntry, change.storedFile,
+                                  change.position, change.data);
+    appendNumber(payload, encoded.length());
+    payload += encoded;
+  }
+
+  return logEntry(payload);
+}
+
+void commitLog(){
+  // Every change was durable before it was made (see logEntry()), so all
+  // that's left is to empty the log if it's full. That can't be done while
+  // the request's changes are in flight, which is why it waits until here.
+  if(durabilityMode == NoDurability) return;
+
+  unique_lock<mutex> lck(logAccess);
+  bool full = logSize > configParams.at("WAL_CHECKPOINT_SIZE");
+  lck.unlock();
+
+  if(full) checkpointLog();
+}
+
+LogStats getLogStats(){
+  return {numCommits.load(), numSyncs.load()};
+}
+
+void checkpointLog(){
+  // No change is under way once changesInFlight is held: whatever has been
+  // logged is in the data files. The log is swapped for an empty one right
+  // away, so that changes go on while the data files are synced, and the old
+  // one is deleted once they are (replayLog() reads both in the meantime).
+  if(durabilityMode == NoDurability) return;
+
+  lock_guard<mutex> onlyCheckpoint(checkpoints);
+  string oldPath = getLogPath() + ".old", newPath = getLogPath() + ".new";
+
+  {
+    ExclusiveLock noChanges(changesInFlight);
+    unique_lock<mutex> lck(logAccess);
+
+    while(syncing) logSynced.wait(lck);
+
+    int emptyLog = open(newPath.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_APPEND, 0644);
+    if(emptyLog == -1 || fsync(emptyLog) == -1 || rename(getLogPath().c_str(), oldPath.c_str()) == -1 ||
+       rename(newPath.c_str(), getLogPath().c_str()) == -1)
+      throw std::runtime_error("Could not swap " + getLogPath());
+
+    // The renames have to be durable before anything is logged to the new log
+    int directory = open(STORAGE_FILES_PATH.c_str(), O_RDONLY);
+    if(directory == -1 || fsync(directory) == -1)
+      throw std::runtime_error("Could not sync " + STORAGE_FILES_PATH);
+    close(directory);
+
+    close(logFd);
+    logFd = emptyLog;
+
+    unwritten.clear();
+    logSize = 0;
+    durableEnd = loggedEnd;
+
+    logSynced.notify_all();
+  }
+
+  syncDataFiles();
+  unlink(oldPath.c_str());
+}
+
+unique_ptr<SharedLock> logEntry(const string& payload){
+  // The lock is taken before the entry is logged, so that a checkpoint can't
+  // swap the log out between the entry and the change. The change may only be
+  // made once the entry is durable: if it reached its data file first, it
+  // would stay there even if the entry didn't make it to the log.
+  unique_ptr<SharedLock> inFlight(new SharedLock(changesInFlight));
+
+  string entry;
+  appendNumber(entry, payload.length());
+  appendNumber(entry, checksum(payload.data(), payload.length()));
+  entry += payload;
+
+  unique_lock<mutex> lck(logAccess);
+  unwritten += entry;
+  loggedEnd += entry.length();
+  lastLogged = loggedEnd;
+
+  numCommits++;
+  waitUntilDurable(lck);
+
+  return inFlight;
+}
+
+string encodeChange(char kind, const StoredFile& storedFile, long position, const string& data){
+  string change(1, kind);
+  change += (char) storedFile.type;
+  appendNumber(change, storedFile.generation);
+  appendNumber(change, storedFile.bucket);
+  appendNumber(change, position >> 32);
+  appendNumber(change, position & 0xffffffff);
+
+  return change + data;
+}
+
+bool replayChange(const string& change, map<string, int>& files){
+  // Make a single change again, unless it's past the end of its file (which
+  // was then emptied by a checkpoint, or replaced by compaction)
+  if(change.length() < 18) return false;
+
+  char kind = change[0];
+  StoredFile storedFile = {(StoredFileType) change[1], readNumber(change, 6),
+                           readNumber(change, 2), nullptr};
+  long position = ((long) readNumber(change, 10) << 32) | readNumber(change, 14);
+  string data = change.substr(18);
+
+  // Files that have been deleted since (e.g. by resharding) stay deleted
+  string path = getStoredFilePath(storedFile);
+  if(!files.count(path)) files[path] = open(path.c_str(), O_RDWR);
+
+  int fd = files[path];
+  if(fd == -1) return false;
+
+  long size = lseek(fd, 0, SEEK_END);
+  if((kind == appendEntry && position > size) || (kind == flagEntry && position >= size)) return false;
+
+  if(pwrite(fd, data.data(), data.length(), position) != (ssize_t) data.length())
+    throw std::runtime_error("Could not replay a change to " + path);
+
+  return true;
+}
+
+void waitUntilDurable(unique_lock<mutex>& lck){
+  // Until whatever this thread has logged is durable. With group commit, the
+  // first change that finds the log unsynced becomes the leader: it writes and
+  // syncs everything that has been logged by then while the others wait for it
+  // (and for the next leader, if its change was logged too late).
+  if(durabilityMode == RequestDurability){
+    if(durableEnd < lastLogged) writeAndSync(lck, false);
+
+  }else{
+    while(durableEnd < lastLogged){
+      if(syncing) logSynced.wait(lck);
+      else writeAndSync(lck, true);
+    }
+  }
+}
+
+void writeAndSync(unique_lock<mutex>& lck, bool unlockWhileSyncing){
+  // Write whatever has been logged so far and make it durable. Group commit
+  // lets requests log more changes in the meantime.
+  syncing = true;
+
+  string entries;
+  entries.swap(unwritten);
+  long end = loggedEnd;
+
+  if(unlockWhileSyncing) lck.unlock();
+
+  for(size_t numWritten = 0; numWritten < entries.length();){
+    ssize_t n = write(logFd, entries.data() + numWritten, entries.length() - numWritten);
+
+    if(n <= 0) throw std::runtime_error("Could not write to " + getLogPath());
+    numWritten += n;
+  }
+
+  if(fdatasync(logFd) == -1) throw std::runtime_error("Could not sync " + getLogPath());
+  numSyncs++;
+
+  if(unlockWhileSyncing) lck.lock();
+
+  logSize += entries.length();
+  durableEnd = max(durableEnd, end);
+  syncing = false;
+
+  logSynced.notify_all();
+}
+
+string getLogPath(){
+  // Next to the data files that it describes
+  return STORAGE_FILES_PATH + "/wal.log";
+}
+
+void appendNumber(string& out, uint32_t number){
+  uint32_t encoded = htonl(number);
+  out.append((const char*) &encoded, sizeof(uint32_t));
+}
+
+uint32_t readNumber(const string& in, size_t offset){
+  uint32_t encoded;
+  in.copy((char*) &encoded, sizeof(uint32_t), offset);
+  return ntohl(encoded);
+}
+
+uint32_t checksum(const char* data, size_t length){
+  // FNV-1a: enough to tell an entry that was only partly written
+  uint32_t hashed = 2166136261u;
+
+  for(size_t i = 0; i < length; i++){
+    hashed ^= (unsigned char) data[i];
+    hashed *= 16777619u;
+  }
+
+  return hashed;
+}
@@ -0,0 +1,71 @@
+#include "workerpool.h"
+using namespace std;
+
+
+WorkerPool::WorkerPool(unsigned int numWorkers) : stopping(false){
+  // hardware_concurrency() may return 0 if it can't tell how many cores exist
+  if(!numWorkers) numWorkers = thread::hardware_concurrency();
+  if(!numWorkers) numWorkers = 1;
+
+  for(unsigned int i = 0; i < numWorkers; i++){
+    workers.push_back(thread([this] { work(); }));
+  }
+}
+
+WorkerPool::~WorkerPool(){
+  {
+    unique_lock<mutex> lck(tasksAccess);
+    stopping = true;
+  }
+
+  tasksAvailable.notify_all();
+  for(thread& th:workers){ th.join(); }
+}
+
+void WorkerPool::submit(const function<void()>& task){
+  {
+    unique_lock<mutex> lck(tasksAccess);
+    tasks.push(task);
+  }
+
+  tasksAvailable.notify_one();
+}
+
+void WorkerPool::runAll(const vector<function<void()>>& tasks){
+  // Count the tasks down as they finish
+  size_t remaining = tasks.size();
+  mutex remainingAccess;
+  condition_variable finished;
+
+  for(auto& task:tasks){
+    submit([&, task] {
+      task();
+
+      unique_lock<mutex> lck(remainingAccess);
+      if(!--remaining) finished.notify_one();
+    });
+  }
+
+  unique_lock<mutex> lck(remainingAccess);
+  finished.wait(lck, [&remaining] { return !remaining; });
+}
+
+void WorkerPool::work(){
+  // Take tasks off of the queue until the pool is destroyed (the remaining
+  // tasks are drained before quitting)
+  for(;;){
+    function<void()> task;
+
+    {
+      unique_lock<mutex> lck(tasksAccess);
+      tasksAvailable.wait(lck, [this] { return stopping || !tasks.empty(); });
+
+      if(tasks.empty()) return;
+
+      task = tasks.front();
+      tasks.pop();
+    }
+
+    task();
+  }
+}
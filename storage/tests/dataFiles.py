@@ -14,7 +14,12 @@ def serialized_item_size(item_type):
                     constant, value = line.strip().split('=')
                     config_constants[constant] = int(value)
 
-    return config_constants['SERIAL_SIZE_' + item_type]
+    # Items are followed by a chain field in files with the chained layout
+    item_size = config_constants['SERIAL_SIZE_' + item_type]
+    if config_constants['CHAINED_LAYOUT'] and item_type != 'CREDENTIAL':
+        item_size += config_constants['FIELD_SIZE_CHAIN']
+
+    return item_size
 
 def filetype_from_filename(filename):
     return filename[:filename.rfind('_', 0, -1)]
@@ -30,7 +35,8 @@ class TestDataIntegrity(unittest.TestCase):
 
         data_files = process_output[0].decode('utf-8').split('\n')
 
-        for filename in filter(lambda x:x, data_files):
+        # Only the data files themselves (not their indexes)
+        for filename in filter(lambda x:x.endswith('.txt'), data_files):
             data_file = os.path.join(volumes_dir, filename)
 
             with open(data_file, 'r') as f:
@@ -1,11 +1,27 @@
 #include <iostream>
 #include <sstream>
+#include <fstream>
+#include <iterator>
+#include <algorithm>
 #include <thread>
+#include <atomic>
 #include <cassert>
 #include <chrono>
 #include <ctime>
+#include <regex>
+#include <cstring>
+#include <cmath>
 #include <stdlib.h>
 #include "config.h"
+#include "filehandler.h"
+#include "layout.h"
+#include "schema.h"
+#include "wal.h"
+#include "fanout.h"
+#include "serializers.h"
+#include "matchkernel.h"
+#include "parser.h"
+#include "utils.h"
 #include "user.h"
 using namespace std;
 
@@ -36,7 +52,7 @@ bool testSaveCredential(){
     string username = randomString(10), password = randomString(10);
 
     testers.push_back(
-      thread([&] { saveCredential(username, password); })
+      thread([=] { saveCredential(username, password); })
     );
   }
 
@@ -62,7 +78,7 @@ bool testSavePost(){
     string username = randomString(10), text = randomString(20);
 
     testers.push_back(
-      thread([&] { savePost(username, text); })
+      thread([=] { savePost(username, text); })
     );
   }
 
@@ -75,6 +91,1065 @@ bool testSavePost(){
   return true;
 }
 
+CommandType parseWithRegex(const string& input){
+  // How commands used to be parsed (the baseline for testParseCommand())
+  static const regex reGet("GET/.*"), reSave("SAVE/.*"), reDelete("DELETE/.*"), reMode("MODE/.*");
+
+  static const vector<pair<regex, CommandType>> getPatterns = {
+    {regex("GET/credential/([a-z]+)"), ExistsCommand},
+    {regex("GET/credential/([a-z]+):([a-z]+)"), VerifyCredentialCommand},
+    {regex("GET/posts/profile/([a-z]+):(-?[0-9]+)"), GetProfilePostsCommand},
+    {regex("GET/posts/timeline/([a-z]+):(-?[0-9]+)"), GetTimelinePostsCommand},
+    {regex("GET/relations/([a-z]+):([a-z]+)"), IsFollowingCommand},
+    {regex("GET/relations/followers/([a-z]+):(-?[0-9]+)"), GetFollowersCommand},
+    {regex("GET/relations/friends/([a-z]+):(-?[0-9]+)"), GetFriendsCommand}
+  };
+
+  static const vector<pair<regex, CommandType>> savePatterns = {
+    {regex("SAVE/credential/([a-z]+):([a-z]+)"), SaveCredentialCommand},
+    {regex("SAVE/posts/([a-z]+):(.*)"), SavePostCommand},
+    {regex("SAVE/relations/([a-z]+):([a-z]+)"), FollowCommand}
+  };
+
+  static const vector<pair<regex, CommandType>> deletePatterns = {
+    {regex("DELETE/credential/([a-z]+):([a-z]+)"), DeleteCredentialCommand},
+    {regex("DELETE/posts/([a-z]+):([0-9]{10})"), DeletePostCommand},
+    {regex("DELETE/relations/([a-z]+):([a-z]+)"), UnfollowCommand}
+  };
+
+  static const vector<pair<regex, CommandType>> modePatterns = {
+    {regex("MODE/persistent"), PersistentModeCommand},
+    {regex("MODE/framed"), FramedModeCommand}
+  };
+
+  const vector<pair<regex, CommandType>>* patterns = NULL;
+  if(regex_match(input, reGet)) patterns = &getPatterns;
+  else if(regex_match(input, reSave)) patterns = &savePatterns;
+  else if(regex_match(input, reDelete)) patterns = &deletePatterns;
+  else if(regex_match(input, reMode)) patterns = &modePatterns;
+  else return InvalidCommand;
+
+  // Copy the fields out of the matches, like the regex-based parser did
+  smatch matches;
+  for(auto& pattern:*patterns){
+    if(regex_match(input, matches, pattern.first)){
+      string first = matches[1], second = matches[2];
+      return pattern.second;
+    }
+  }
+
+  return InvalidCommand;
+}
+
+bool testParseCommand(){
+  vector<string> commands = {
+    "GET/credential/alice",
+    "GET/credential/alice:secret",
+    "GET/posts/profile/alice:10",
+    "GET/posts/timeline/alice:-1",
+    "GET/relations/alice:bob",
+    "GET/relations/followers/alice:25",
+    "GET/relations/friends/alice:-1",
+    "SAVE/credential/alice:secret",
+    "SAVE/posts/alice:hello: this is a post",
+    "SAVE/posts/alice:",
+    "SAVE/relations/alice:bob",
+    "DELETE/credential/alice:secret",
+    "DELETE/posts/alice:1459384834",
+    "DELETE/relations/alice:bob",
+    "MODE/persistent",
+    "MODE/framed",
+    // Invalid commands
+    "GET/credential/Alice",
+    "GET/credential/alice:",
+    "GET/posts/profile/alice:-",
+    "GET/relations/others/alice:1",
+    "DELETE/posts/alice:145938483",
+    "SAVE/posts/alice:two\nlines",
+    "MODE/persistently",
+    "PUT/credential/alice"
+  };
+
+  // Both parsers must agree on every command
+  for(auto& input:commands){
+    Command command = parseCommand(input.data(), input.length());
+    if(command.type != parseWithRegex(input)){
+      cerr << "FAIL:\t parse: '" << input << "'" << endl;
+      return false;
+    }
+  }
+
+  Command command = parseCommand(commands[3].data(), commands[3].length());
+  if(command.username.str() != "alice" || command.limit != -1) return false;
+
+  command = parseCommand(commands[8].data(), commands[8].length());
+  if(command.argument.str() != "hello: this is a post") return false;
+
+  // Binary commands: GetTimelinePostsCommand, limit 5, fields "alice"
+  const char binary[] = {4, 0, 0, 0, 5, 1, 0, 5, 'a', 'l', 'i', 'c', 'e'};
+  size_t consumed;
+
+  command = parseBinaryCommand(binary, sizeof(binary), consumed);
+  if(command.type != GetTimelinePostsCommand || consumed != sizeof(binary)) return false;
+  if(command.username.str() != "alice" || command.limit != 5) return false;
+
+  parseBinaryCommand(binary, sizeof(binary) - 1, consumed);
+  if(consumed) return false; // Incomplete
+
+  // Batches hold between 1 and maxBatchSize sub-commands
+  command = parseCommand("BATCH/3", 7);
+  if(command.type != BatchCommand || command.limit != 3) return false;
+  if(parseCommand("BATCH/0", 7).type != InvalidCommand) return false;
+  if(parseCommand("BATCH/65", 8).type != InvalidCommand) return false;
+
+  const char batch[] = {17, 0, 0, 0, 2, 0};
+  command = parseBinaryCommand(batch, sizeof(batch), consumed);
+  if(command.type != BatchCommand || command.limit != 2 || consumed != sizeof(batch)) return false;
+
+  int numRounds = 2000;
+  cerr << "START:\t parse: " << numRounds * commands.size() << " commands." << endl;
+
+  std::chrono::time_point<std::chrono::system_clock> start, end;
+  std::chrono::duration<double> regexSeconds, parserSeconds;
+  unsigned int numValid = 0;
+
+  start = std::chrono::system_clock::now();
+  for(int i = 0; i < numRounds; i++){
+    for(auto& input:commands){ numValid += parseWithRegex(input) != InvalidCommand; }
+  }
+  end = std::chrono::system_clock::now();
+  regexSeconds = end - start;
+
+  start = std::chrono::system_clock::now();
+  for(int i = 0; i < numRounds; i++){
+    for(auto& input:commands){ numValid += parseCommand(input.data(), input.length()).type != InvalidCommand; }
+  }
+  end = std::chrono::system_clock::now();
+  parserSeconds = end - start;
+
+  double numParsed = numRounds * commands.size();
+  cerr << "END:\t parse: regex " << regexSeconds.count() / numParsed * 1e9 << " ns/command, "
+       << "parser " << parserSeconds.count() / numParsed * 1e9 << " ns/command ("
+       << numValid << " valid)." << endl;
+
+  return true;
+}
+
+bool testReaderBackends(){
+  // Scan the same profile with each backend of LReader
+  string username = "readerbackends";
+  int numPosts = 2000, numRounds = 20;
+
+  for(int i = 0; i < numPosts; i++){ savePost(username, randomString(20)); }
+
+  cerr << "START:\t readers: " << numRounds << " scans of " << numPosts << " posts." << endl;
+
+  std::chrono::time_point<std::chrono::system_clock> start, end;
+  std::chrono::duration<double> seconds[3];
+  vector<string> posts[3];
+
+  int backend = configParams.at("READER_BACKEND");
+
+  for(int b = 0; b < 3; b++){
+    configParams["READER_BACKEND"] = b;
+
+    start = std::chrono::system_clock::now();
+    for(int i = 0; i < numRounds; i++){ posts[b] = getProfilePosts(username, -1); }
+    end = std::chrono::system_clock::now();
+
+    seconds[b] = end - start;
+  }
+
+  configParams["READER_BACKEND"] = backend;
+
+  cerr << "END:\t readers: items " << seconds[0].count() << " seconds, mmap ";
+  cerr << seconds[1].count() << " seconds, blocks " << seconds[2].count() << " seconds." << endl;
+
+  return posts[0] == posts[1] && posts[0] == posts[2] && (int) posts[0].size() >= numPosts;
+}
+
+bool testReadContention(){
+  // Readers of a hot timeline file shouldn't wait on one another, nor on the
+  // posts that keep being appended to it
+  string reader = "hotreader", author = "hotauthor";
+  int numPosts = 1000, numScans = 20;
+
+  saveCredential(reader, "secret");
+  saveCredential(author, "secret");
+  if(!follow(reader, author)) return false;
+
+  for(int i = 0; i < numPosts; i++){ savePost(author, randomString(20)); }
+  waitForFanout(author);
+
+  for(int numThreads = 1; numThreads <= 8; numThreads *= 2){
+    cerr << "START:\t contention: " << numThreads << " readers, 1 writer." << endl;
+
+    std::chrono::time_point<std::chrono::system_clock> start, end;
+    start = std::chrono::system_clock::now();
+
+    // Keep appending (at a steady pace, so that scans don't keep growing)
+    atomic<bool> writing(true);
+    thread writer([&] {
+      while(writing){
+        savePost(author, randomString(20));
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+      }
+    });
+
+    vector<thread> readers;
+    vector<int> complete(numThreads, 0);
+
+    for(int t = 0; t < numThreads; t++){
+      readers.push_back(thread([&, t] {
+        bool sawAll = true;
+        for(int i = 0; i < numScans; i++){
+          sawAll = sawAll && (int) getTimelinePosts(reader, -1).size() >= numPosts;
+        }
+        complete[t] = sawAll;
+      }));
+    }
+
+    for(auto& th:readers){ th.join(); }
+    end = std::chrono::system_clock::now();
+
+    writing = false;
+    writer.join();
+
+    for(int t = 0; t < numThreads; t++){ if(!complete[t]) return false; }
+
+    std::chrono::duration<double> elapsed_seconds = end - start;
+    cerr << "END:\t contention: " << numThreads * numScans / elapsed_seconds.count();
+    cerr << " scans/second." << endl;
+  }
+
+  return true;
+}
+
+bool testFileIndex(){
+  // The sparse user shares a profile file with "indexab": reading its few
+  // posts shouldn't go through the other user's
+  string crowded = "indexab", sparse = "indexb";
+  int numCrowded = 5000, numSparse = 3, numRounds = 100;
+
+  StoredFile storedFile = getStoredFile(StoredFileType::ProfilePostFile, crowded);
+  for(int i = 0; getStoredFile(StoredFileType::ProfilePostFile, sparse).bucket != storedFile.bucket; i++){
+    sparse = string("indexb") + (char) ('a' + i % 26) + (char) ('a' + i / 26 % 26);
+  }
+
+  for(int i = 0; i < numSparse; i++){ savePost(sparse, randomString(20)); }
+  for(int i = 0; i < numCrowded; i++){ savePost(crowded, randomString(20)); }
+
+  cerr << "START:\t index: " << numRounds << " reads of " << numSparse << " posts among ";
+  cerr << numCrowded + numSparse << "." << endl;
+
+  std::chrono::time_point<std::chrono::system_clock> start, end;
+  start = std::chrono::system_clock::now();
+
+  for(int i = 0; i < numRounds; i++){
+    if(getProfilePosts(sparse, -1).size() != (size_t) numSparse) return false;
+  }
+
+  end = std::chrono::system_clock::now();
+
+  std::chrono::duration<double> elapsed_seconds = end - start;
+  cerr << "END:\t index: " << elapsed_seconds.count() / numRounds << " seconds per read." << endl;
+
+  // The persisted index has a line per item of the file (files with the
+  // chained layout don't have one)
+  if(isChained("PROFILE_POST")) return true;
+
+  ifstream index(getStoredIndexPath(storedFile));
+  long numLines = count(istreambuf_iterator<char>(index), istreambuf_iterator<char>(), '\n');
+
+  return numLines * configParams.at("SERIAL_SIZE_PROFILE_POST") == getDataFile(storedFile).size &&
+         countItems(storedFile, sparse) == numSparse && countItems(storedFile, crowded) == numCrowded;
+}
+
+bool testHashDistribution(){
+  // How evenly short lowercase usernames (every one with up to 3 letters, and
+  // random ones with 4 to 8) spread among 100 files with each hash function
+  const unsigned int numBuckets = 100;
+  vector<string> usernames;
+
+  for(int length = 1; length <= 3; length++){
+    for(int n = 0, total = pow(26, length); n < total; n++){
+      string username;
+      for(int i = 0, rest = n; i < length; i++, rest /= 26){ username += 'a' + rest % 26; }
+      usernames.push_back(username);
+    }
+  }
+
+  for(int i = 0; i < 50000; i++){
+    string username(4 + rand() % 5, 'a');
+    for(auto& c:username){ c = 'a' + rand() % 26; }
+    usernames.push_back(username);
+  }
+
+  double mean = (double) usernames.size() / numBuckets;
+  vector<double> maxLoads;
+
+  for(auto hash:{SumHash, FnvHash}){
+    vector<int> buckets(numBuckets, 0);
+    for(auto& username:usernames){ buckets[hashUsername(hash, username) % numBuckets]++; }
+
+    double variance = 0;
+    for(int load:buckets){ variance += (load - mean) * (load - mean) / numBuckets; }
+
+    int maxLoad = *max_element(buckets.begin(), buckets.end());
+    maxLoads.push_back(maxLoad / mean);
+
+    cerr << "END:\t distribution (" << (hash == SumHash ? "sum" : "fnv") << "): max/mean ";
+    cerr << maxLoad / mean << ", empty " << count(buckets.begin(), buckets.end(), 0);
+    cerr << ", stddev/mean " << sqrt(variance) / mean << "." << endl;
+  }
+
+  return maxLoads[1] < maxLoads[0] && maxLoads[1] < 1.2;
+}
+
+bool testCompaction(){
+  // Deactivate most of a user's posts and compact its file while the user's
+  // posts keep being read: readers only ever see the live posts
+  string username = "compaction", dataType = "PROFILE_POST";
+  int numPosts = 1000, numKept = 100;
+
+  StoredFile storedFile = getStoredFile(StoredFileType::ProfilePostFile, username);
+  DataFile& dataFile = getDataFile(storedFile);
+
+  for(int i = 0; i < numPosts; i++){ savePost(username, "post" + to_string(i)); }
+
+  setActiveFlag(false, storedFile, dataType, {{"USERNAME", username}});
+  for(int i = 0; i < numKept; i++){
+    setActiveFlag(true, storedFile, dataType, {{"USERNAME", username}, {"TEXT", "post" + to_string(i * 10)}});
+  }
+
+  vector<string> before = getProfilePosts(username, -1);
+  if(before.size() != (size_t) numKept) return false;
+
+  cerr << "START:\t compaction: " << numPosts - numKept << " of " << numPosts << " posts are inactive." << endl;
+
+  atomic<bool> compacting(true);
+  atomic<int> mismatches(0);
+
+  thread reader([&] {
+    while(compacting){ if(getProfilePosts(username, -1) != before) mismatches++; }
+  });
+
+  std::chrono::time_point<std::chrono::system_clock> start, end;
+  start = std::chrono::system_clock::now();
+
+  long deadBytes;
+  long reclaimed = compactDataFile(storedFile, 0, deadBytes, nullptr);
+
+  end = std::chrono::system_clock::now();
+  compacting = false;
+  reader.join();
+
+  std::chrono::duration<double> elapsed_seconds = end - start;
+  cerr << "END:\t compaction: " << reclaimed << " bytes reclaimed in " << elapsed_seconds.count();
+  cerr << " seconds." << endl;
+
+  // The swapped file is what's on disk, and it's still indexed
+  if(mismatches || getProfilePosts(username, -1) != before) return false;
+  if(reclaimed < (long) (numPosts - numKept) * getRecordSize(dataType)) return false;
+
+  return getFileSize(dataFile.path) == (unsigned int) dataFile.size && !compactDataFile(storedFile, 0, deadBytes, nullptr);
+}
+
+bool testGroupCommit(){
+  // Concurrent requests that save posts, whose changes wait to be durable:
+  // with group commit (WAL_MODE=1), they share fsync()s of the log
+  int numThreads = 8, numPosts = 50;
+  vector<thread> writers;
+
+  LogStats before = getLogStats();
+  cerr << "START:\t commit: " << numThreads << " threads, " << numPosts << " posts each." << endl;
+
+  std::chrono::time_point<std::chrono::system_clock> start, end;
+  start = std::chrono::system_clock::now();
+
+  for(int t = 0; t < numThreads; t++){
+    string username = "committer" + string(1, 'a' + t);
+
+    writers.push_back(thread([=] {
+      for(int i = 0; i < numPosts; i++){
+        savePost(username, "post" + to_string(i));
+        commitLog();
+      }
+    }));
+  }
+
+  for(auto& th:writers){ th.join(); }
+  end = std::chrono::system_clock::now();
+
+  LogStats after = getLogStats();
+  long commits = after.commits - before.commits, syncs = after.syncs - before.syncs;
+
+  std::chrono::duration<double> elapsed_seconds = end - start;
+  cerr << "END:\t commit: " << commits / elapsed_seconds.count() << " commits/second, ";
+  cerr << syncs << " syncs for " << commits << " commits." << endl;
+
+  if(configParams.at("WAL_MODE") == NoDurability) return commits == 0;
+  return commits >= numThreads * numPosts && syncs <= commits;
+}
+
+bool testWriteBatch(){
+  // Authors that share followers post at the same time (their batches lock
+  // the same files), while one of the followers unfollows and follows again
+  int numAuthors = 4, numFollowers = 30, numPosts = 20;
+  vector<thread> writers;
+
+  for(int f = 0; f < numFollowers; f++){
+    string follower = "batchfollower" + string(1, 'a' + f / 26) + string(1, 'a' + f % 26);
+    saveCredential(follower, "password");
+
+    for(int a = 0; a < numAuthors; a++){
+      string author = "batchauthor" + string(1, 'a' + a);
+      saveCredential(author, "password");
+      follow(follower, author);
+    }
+  }
+
+  cerr << "START:\t batches: " << numAuthors << " authors, " << numFollowers << " followers." << endl;
+
+  std::chrono::time_point<std::chrono::system_clock> start, end;
+  start = std::chrono::system_clock::now();
+
+  for(int a = 0; a < numAuthors; a++){
+    string author = "batchauthor" + string(1, 'a' + a);
+
+    writers.push_back(thread([=] {
+      for(int i = 0; i < numPosts; i++){ savePost(author, "post" + to_string(i)); }
+    }));
+  }
+
+  writers.push_back(thread([=] {
+    for(int i = 0; i < numPosts; i++){
+      unfollow("batchfollowerab", "batchauthora");
+      follow("batchfollowerab", "batchauthora");
+    }
+  }));
+
+  for(auto& th:writers){ th.join(); }
+  end = std::chrono::system_clock::now();
+
+  std::chrono::duration<double> elapsed_seconds = end - start;
+  cerr << "END:\t batches: " << numAuthors * numPosts / elapsed_seconds.count() << " posts/second." << endl;
+
+  // Every follower that kept following got every post, and following again
+  // reactivated the old relations instead of adding new ones
+  waitForFanout();
+
+  for(int f = 0; f < numFollowers; f++){
+    string follower = "batchfollower" + string(1, 'a' + f / 26) + string(1, 'a' + f % 26);
+    if(follower == "batchfollowerab") continue;
+
+    if((int) getTimelinePosts(follower, -1).size() != numAuthors * numPosts) return false;
+  }
+
+  StoredFile relationFile = getStoredFile(StoredFileType::RelationFile, "batchauthora");
+  string dataType = "RELATION";
+  map<string, string> matchArgs = {
+    {"FIRST_USERNAME", "batchauthora"},
+    {"SECOND_USERNAME", "batchfollowerab"}
+  };
+
+  return itemMatchSweep(relationFile, dataType, matchArgs, -1).size() == 1 &&
+         (int) getFollowers("batchauthora", -1).size() == numFollowers;
+}
+
+bool testFanout(){
+  // An author with many followers: posts are acknowledged before they're in
+  // the timelines (if FANOUT_WORKERS isn't 0), and all of them get there
+  int numFollowers = 200, numPosts = 20;
+  string author = "fanoutauthor";
+  saveCredential(author, "password");
+
+  for(int f = 0; f < numFollowers; f++){
+    string follower = "fanoutfollower" + string(1, 'a' + f / 26 / 26) + string(1, 'a' + f / 26 % 26) +
+                      string(1, 'a' + f % 26);
+    saveCredential(follower, "password");
+    follow(follower, author);
+  }
+
+  cerr << "START:\t fan-out: " << numFollowers << " followers, " << numPosts << " posts." << endl;
+
+  std::chrono::time_point<std::chrono::system_clock> start, acknowledged, end;
+  start = std::chrono::system_clock::now();
+
+  for(int i = 0; i < numPosts; i++){
+    savePost(author, "post" + to_string(i));
+    commitLog();
+  }
+
+  acknowledged = std::chrono::system_clock::now();
+  FanoutStats queued = getFanoutStats();
+
+  waitForFanout();
+  end = std::chrono::system_clock::now();
+
+  FanoutStats stats = getFanoutStats();
+  std::chrono::duration<double> ackSeconds = acknowledged - start, totalSeconds = end - start;
+
+  cerr << "END:\t fan-out: acknowledged in " << ackSeconds.count() << " seconds, delivered in ";
+  cerr << totalSeconds.count() << " seconds (" << queued.depth << " queued after the last post, ";
+  cerr << stats.averageLag << " s average lag, " << stats.maxLag << " s max)." << endl;
+
+  // The newest posts are first in every timeline
+  vector<string> timeline = getTimelinePosts("fanoutfollowerahb", -1);
+  string dataType = "TIMELINE_POST", fieldType = "TEXT";
+
+  return stats.depth == 0 && (int) timeline.size() == numPosts &&
+         unpad(extractField(timeline[0], dataType, fieldType)) == "post" + to_string(numPosts - 1);
+}
+
+bool testFanoutLogCompaction(){
+  // While one post stays queued, fanout.log never empties: it's rewritten
+  // with only the unfinished intents instead of growing with every post
+  if(!isFanoutAsync()) return true;
+
+  string author = "compactauthor", stuck = "compactstuck";
+  int numPosts = 1500;
+
+  saveCredential(author, "password");
+  saveCredential(stuck, "password");
+
+  ProfilePost post = {Active::Yes, stuck, getTimeNow(), "stuck"};
+  string serialized = serializeProfilePost(post);
+  long intent = logFanoutIntent(serialized);
+
+  cerr << "START:\t fan-out log: " << numPosts << " posts while one is queued." << endl;
+
+  for(int i = 0; i < numPosts; i++){ savePost(author, "post" + to_string(i)); }
+  waitForFanout(author);
+
+  ifstream log(STORAGE_FILES_PATH + "/fanout.log", ios::binary | ios::ate);
+  long logSize = log.tellg();
+  long entrySize = 1 + 16 + configParams.at("SERIAL_SIZE_PROFILE_POST");
+
+  // Let the stuck post go
+  queueFanout(intent, serialized);
+  waitForFanout();
+
+  cerr << "END:\t fan-out log: " << logSize / entrySize << " entries left of " << 2 * numPosts + 1 << "." << endl;
+
+  return logSize > 0 && logSize / entrySize <= 1100;
+}
+
+bool testHybridFanout(){
+  // Posts of an author with more followers than FANOUT_THRESHOLD stay in their
+  // profile and are merged into the timelines when they're read, until the
+  // author has few enough followers again
+  int threshold = configParams.at("FANOUT_THRESHOLD");
+  configParams["FANOUT_THRESHOLD"] = 10;
+
+  int numFollowers = 20, numPosts = 30;
+  string star = "hybridstar", author = "hybridauthor", reader = "hybridfollowera";
+  saveCredential(star, "password");
+  saveCredential(author, "password");
+
+  for(int f = 0; f < numFollowers; f++){
+    string follower = "hybridfollower" + string(1, 'a' + f);
+    saveCredential(follower, "password");
+    follow(follower, star);
+  }
+
+  follow(reader, author);
+
+  for(int i = 0; i < numPosts; i++){
+    savePost(star, "star" + to_string(i));
+    savePost(author, "author" + to_string(i));
+  }
+
+  waitForFanout();
+
+  string dataType = "TIMELINE_POST";
+  StoredFile timelineFile = getStoredFile(StoredFileType::TimelinePostFile, reader);
+  map<string, string> starPosts = {{"USERNAME", reader}, {"AUTHOR", star}};
+
+  cerr << "START:\t hybrid: " << numPosts << " posts from each of 2 authors." << endl;
+
+  std::chrono::time_point<std::chrono::system_clock> start, end;
+  start = std::chrono::system_clock::now();
+
+  vector<string> timeline;
+  for(int i = 0; i < 100; i++){ timeline = getTimelinePosts(reader, 20); }
+
+  end = std::chrono::system_clock::now();
+  std::chrono::duration<double> elapsed_seconds = end - start;
+  cerr << "END:\t hybrid: " << elapsed_seconds.count() / 100 << " seconds per merged read." << endl;
+
+  bool merged = timeline.size() == 20 && getTimelinePosts(reader, -1).size() == 2 * (size_t) numPosts &&
+                itemMatchSweep(timelineFile, dataType, starPosts, -1).empty();
+
+  // Only the posts saved since the follow are merged in
+  string late = "hybridlate";
+  saveCredential(late, "password");
+
+  std::this_thread::sleep_for(std::chrono::seconds(1));
+  follow(late, star);
+  bool sinceFollow = getTimelinePosts(late, -1).empty();
+
+  savePost(star, "starlate");
+  sinceFollow = sinceFollow && getTimelinePosts(late, -1).size() == 1 &&
+                getTimelinePosts(reader, -1).size() == 2 * (size_t) numPosts + 1;
+
+  // Timeline posts that were delivered out of order (as fan-out workers may)
+  // are still merged newest first, and the limit keeps the newest ones
+  StoredFile lateFile = getStoredFile(StoredFileType::TimelinePostFile, late);
+  TimelinePost newer = {Active::Yes, late, author, "9999999999", "newer"};
+  TimelinePost older = {Active::Yes, late, author, "1000000000", "older"};
+  appendToDataFile(lateFile, serializeTimelinePost(newer) + serializeTimelinePost(older));
+
+  vector<string> outOfOrder = getTimelinePosts(late, -1), newest = getTimelinePosts(late, 2);
+  string timestampField = "TIMESTAMP";
+  bool ordered = outOfOrder.size() == 3 && newest.size() == 2 &&
+                 extractField(outOfOrder[0], dataType, timestampField) == "9999999999" &&
+                 extractField(outOfOrder[2], dataType, timestampField) == "1000000000" &&
+                 newest[0] == outOfOrder[0] && newest[1] == outOfOrder[1];
+
+  unfollow(late, star);
+
+  // Dropping to the threshold copies the star's posts to the timelines
+  for(int f = numFollowers - 1; f >= 10; f--){
+    unfollow("hybridfollower" + string(1, 'a' + f), star);
+  }
+
+  waitForFanout();
+  bool caughtUp = itemMatchSweep(timelineFile, dataType, starPosts, -1).size() == (size_t) numPosts + 1 &&
+                  getTimelinePosts(reader, -1).size() == 2 * (size_t) numPosts + 1;
+
+  configParams["FANOUT_THRESHOLD"] = threshold;
+  return merged && sinceFollow && ordered && caughtUp;
+}
+
+bool testFanoutThreshold(){
+  // An author that rises above FANOUT_THRESHOLD keeps the copies that are in
+  // the timelines already (they're only read once). One that drops to it gets
+  // its newest FANOUT_CATCHUP_POSTS posts copied to the timelines, but only
+  // the ones saved since each follower followed it. The caches only keep two
+  // users each, so values are evicted all along.
+  int threshold = configParams.at("FANOUT_THRESHOLD"), catchUpPosts = configParams.at("FANOUT_CATCHUP_POSTS");
+  int cacheUsers = configParams.at("FANOUT_CACHE_USERS");
+  configParams["FANOUT_THRESHOLD"] = 5;
+  configParams["FANOUT_CATCHUP_POSTS"] = 4;
+  configParams["FANOUT_CACHE_USERS"] = 2;
+
+  string author = "crossauthor", early = "crossfollowera", late = "crosslate";
+  saveCredential(author, "password");
+  saveCredential(late, "password");
+
+  for(int f = 0; f < 6; f++){
+    string follower = "crossfollower" + string(1, 'a' + f);
+    saveCredential(follower, "password");
+    if(f < 5) follow(follower, author);
+  }
+
+  for(int i = 0; i < 3; i++){ savePost(author, "before" + to_string(i)); }
+  waitForFanout();
+
+  string dataType = "TIMELINE_POST";
+  StoredFile earlyFile = getStoredFile(StoredFileType::TimelinePostFile, early);
+  StoredFile lateFile = getStoredFile(StoredFileType::TimelinePostFile, late);
+  map<string, string> earlyCopies = {{"ACTIVE", "1"}, {"USERNAME", early}, {"AUTHOR", author}};
+  map<string, string> lateCopies = {{"ACTIVE", "1"}, {"USERNAME", late}, {"AUTHOR", author}};
+
+  // Rising: the 6th follower
+  follow("crossfollowerf", author);
+  savePost(author, "above");
+  waitForFanout();
+
+  bool rose = isHighFollower(author) && itemMatchSweep(earlyFile, dataType, earlyCopies, -1).size() == 3 &&
+              getTimelinePosts(early, -1).size() == 4;
+
+  // The late follower only merges in what was saved since it followed
+  std::this_thread::sleep_for(std::chrono::seconds(1));
+  follow(late, author);
+  for(int i = 0; i < 2; i++){ savePost(author, "after" + to_string(i)); }
+
+  rose = rose && getTimelinePosts(late, -1).size() == 2 && getTimelinePosts(early, -1).size() == 6;
+
+  // Dropping: 7 followers down to 5. Unfollowing more than once at the same
+  // time only counts once.
+  vector<thread> unfollowers;
+  for(int t = 0; t < 4; t++){ unfollowers.push_back(thread([=] { unfollow("crossfollowerf", author); })); }
+  for(auto& th:unfollowers){ th.join(); }
+
+  bool counted = isHighFollower(author);
+
+  unfollow("crossfollowere", author);
+  waitForFanout();
+
+  // The early follower gets the 4 newest posts (3 of which it didn't have),
+  // the late one only the 2 that it was merging in
+  bool dropped = !isHighFollower(author) && itemMatchSweep(earlyFile, dataType, earlyCopies, -1).size() == 6 &&
+                 itemMatchSweep(lateFile, dataType, lateCopies, -1).size() == 2 &&
+                 getTimelinePosts(early, -1).size() == 6 && getTimelinePosts(late, -1).size() == 2;
+
+  configParams["FANOUT_THRESHOLD"] = threshold;
+  configParams["FANOUT_CATCHUP_POSTS"] = catchUpPosts;
+  configParams["FANOUT_CACHE_USERS"] = cacheUsers;
+  return rose && counted && dropped;
+}
+
+bool testTimelineRing(){
+  // With TIMELINE_RING_SIZE, a timeline only keeps its newest posts, and the
+  // file only holds that many items for its user (plus the ring's header)
+  int ringSize = configParams.at("TIMELINE_RING_SIZE");
+  configParams["TIMELINE_RING_SIZE"] = 5;
+
+  string reader = "ringreader", author = "ringauthor";
+  int numPosts = 12;
+
+  saveCredential(reader, "password");
+  saveCredential(author, "password");
+  follow(reader, author);
+
+  cerr << "START:\t ring: " << numPosts << " posts, rings of 5." << endl;
+
+  StoredFile timelineFile = getStoredFile(StoredFileType::TimelinePostFile, reader);
+  long sizeBefore = getDataFile(timelineFile).size;
+
+  for(int i = 0; i < numPosts; i++){ savePost(author, "post" + to_string(i)); }
+  waitForFanout();
+
+  vector<string> timeline = getTimelinePosts(reader, -1), newest = getTimelinePosts(reader, 3);
+
+  string dataType = "TIMELINE_POST", fieldType = "TEXT";
+  long numItems = (getDataFile(timelineFile).size - sizeBefore) / getRecordSize(dataType);
+
+  bool kept = timeline.size() == 5 && newest.size() == 3 && numItems == 6;
+  for(int i = 0; kept && i < 5; i++){
+    kept = unpad(extractField(timeline[i], dataType, fieldType)) == "post" + to_string(numPosts - 1 - i);
+  }
+
+  // Deleting a post only deactivates its slot
+  string timestampField = "TIMESTAMP";
+  deletePost(author, extractField(timeline[2], dataType, timestampField));
+  bool deleted = getTimelinePosts(reader, -1).size() < 5;
+
+  cerr << "END:\t ring: " << timeline.size() << " posts kept in " << numItems << " items." << endl;
+
+  configParams["TIMELINE_RING_SIZE"] = ringSize;
+  return kept && deleted;
+}
+
+bool testPostIndex(){
+  // Deleting a post finds its copies through the post index of each timeline
+  // file, and unfollowing only deletes the friend's posts from that timeline,
+  // whether it looks them up (the first follower's timeline has more items
+  // than the author has posts) or reads the timeline
+  string author = "pidxauthor", keeper = "pidxkeeper", other = "pidxother";
+  int numFollowers = 20, numPosts = 5;
+
+  saveCredential(author, "password");
+  saveCredential(keeper, "password");
+  saveCredential(other, "password");
+  follow(keeper, author);
+
+  for(int i = 0; i < numFollowers; i++){
+    string follower = "pidxfollower" + to_string(i);
+    saveCredential(follower, "password");
+    follow(follower, author);
+  }
+
+  follow("pidxfollower0", other);
+
+  for(int i = 0; i < numPosts; i++){ savePost(author, "post" + to_string(i)); }
+  for(int i = 0; i < 2 * numPosts; i++){ savePost(other, "other" + to_string(i)); }
+  waitForFanout();
+
+  cerr << "START:\t post index: " << numPosts << " posts to " << numFollowers + 1 << " followers." << endl;
+
+  string dataType = "PROFILE_POST", fieldType = "TIMESTAMP";
+  string timestamp = extractField(getProfilePosts(author, 1)[0], dataType, fieldType);
+
+  std::chrono::time_point<std::chrono::system_clock> start = std::chrono::system_clock::now();
+  deletePost(author, timestamp);
+  std::chrono::duration<double, milli> elapsed = std::chrono::system_clock::now() - start;
+
+  // Posts saved within the same second share their timestamp, and are all
+  // deleted at once
+  size_t numLeft = getProfilePosts(author, -1).size();
+
+  bool deleted = numLeft < (size_t) numPosts && getTimelinePosts(keeper, -1).size() == numLeft &&
+                 getTimelinePosts("pidxfollower0", -1).size() == numLeft + 2 * numPosts;
+  for(int i = 1; deleted && i < numFollowers; i++){
+    deleted = getTimelinePosts("pidxfollower" + to_string(i), -1).size() == numLeft;
+  }
+
+  unfollow("pidxfollower0", author);
+  unfollow("pidxfollower1", author);
+  bool unfollowed = getTimelinePosts("pidxfollower0", -1).size() == 2 * (size_t) numPosts &&
+                    getTimelinePosts("pidxfollower1", -1).empty() &&
+                    getTimelinePosts(keeper, -1).size() == numLeft;
+
+  cerr << "END:\t post index: deleted a post in " << elapsed.count() << " ms." << endl;
+
+  return deleted && unfollowed;
+}
+
+bool testRelationUpsert(){
+  // Users that follow the same friend at the same time, again and again, only
+  // ever get one relation on each side, and following again after unfollowing
+  // reactivates it
+  string friendUsername = "upsertfriend";
+  int numThreads = 8, numFollows = 50;
+  vector<thread> followers;
+
+  saveCredential(friendUsername, "password");
+  for(int t = 0; t < numThreads / 2; t++){ saveCredential("upsertfollower" + to_string(t), "password"); }
+
+  cerr << "START:\t upsert: " << numThreads << " threads, " << numFollows << " follows each." << endl;
+
+  std::chrono::time_point<std::chrono::system_clock> start = std::chrono::system_clock::now();
+
+  // Two threads per follower
+  for(int t = 0; t < numThreads; t++){
+    string username = "upsertfollower" + to_string(t / 2);
+
+    followers.push_back(thread([=] {
+      for(int i = 0; i < numFollows; i++){ follow(username, friendUsername); }
+    }));
+  }
+
+  for(auto& th:followers){ th.join(); }
+  std::chrono::duration<double> elapsed = std::chrono::system_clock::now() - start;
+
+  unfollow("upsertfollower0", friendUsername);
+  follow("upsertfollower0", friendUsername);
+
+  StoredFile relationFile = getStoredFile(StoredFileType::RelationFile, friendUsername);
+  string dataType = "RELATION";
+  map<string, string> matchArgs = {{"FIRST_USERNAME", friendUsername}};
+
+  size_t numRows = itemMatchSweep(relationFile, dataType, matchArgs, -1).size();
+  size_t numFollowers = getFollowers(friendUsername, -1).size();
+
+  bool single = true;
+  for(int t = 0; single && t < numThreads / 2; t++){
+    string username = "upsertfollower" + to_string(t);
+    StoredFile userRelationFile = getStoredFile(StoredFileType::RelationFile, username);
+    map<string, string> userArgs = {{"FIRST_USERNAME", username}};
+
+    single = itemMatchSweep(userRelationFile, dataType, userArgs, -1).size() == 1 &&
+             isFollowing(username, friendUsername);
+  }
+
+  cerr << "END:\t upsert: " << numThreads * numFollows / elapsed.count() << " follows/second, "
+       << numRows << " relations." << endl;
+
+  return single && numRows == (size_t) numThreads / 2 && numFollowers == (size_t) numThreads / 2;
+}
+
+bool testDeleteAccount(){
+  // Deleting an account deletes its posts from every follower's timeline at
+  // once, and leaves the other posts there alone. The wrong password deletes
+  // nothing.
+  string author = "bulkauthor", bystander = "bulkbystander";
+  int numFollowers = 40, numPosts = 30;
+
+  saveCredential(author, "password");
+  saveCredential(bystander, "password");
+
+  for(int i = 0; i < numFollowers; i++){
+    string follower = "bulkfollower" + to_string(i);
+    saveCredential(follower, "password");
+    follow(follower, author);
+    follow(follower, bystander);
+  }
+
+  for(int i = 0; i < numPosts; i++){
+    savePost(author, "post" + to_string(i));
+    if(i % 10 == 0) savePost(bystander, "post" + to_string(i));
+  }
+
+  waitForFanout();
+
+  bool refused = !deleteCredential(author, "wrongpassword") && exists(author) &&
+                 getProfilePosts(author, -1).size() == (size_t) numPosts &&
+                 getTimelinePosts("bulkfollower0", -1).size() == (size_t) numPosts + 3;
+
+  cerr << "START:\t delete account: " << numPosts << " posts, " << numFollowers << " followers." << endl;
+
+  std::chrono::time_point<std::chrono::system_clock> start = std::chrono::system_clock::now();
+  bool succeeded = deleteCredential(author, "password");
+  std::chrono::duration<double> elapsed = std::chrono::system_clock::now() - start;
+
+  bool deleted = succeeded && !exists(author) && getProfilePosts(author, -1).empty();
+
+  string dataType = "TIMELINE_POST", fieldType = "AUTHOR";
+  for(int i = 0; deleted && i < numFollowers; i++){
+    vector<string> timeline = getTimelinePosts("bulkfollower" + to_string(i), -1);
+    deleted = timeline.size() == 3;
+
+    for(string& serializedPost : timeline){
+      deleted = deleted && unpad(extractField(serializedPost, dataType, fieldType)) == bystander;
+    }
+  }
+
+  cerr << "END:\t delete account: " << elapsed.count() << " seconds." << endl;
+
+  return refused && deleted;
+}
+
+bool testRecordSchemas(){
+  // The schemas agree with config.txt (and a config that doesn't is refused),
+  // and items are matched field by field as before
+  bool refused = false;
+  int textEnd = configParams.at("SERIAL_TIMELINE_POST_TEXT_END");
+
+  configParams["SERIAL_TIMELINE_POST_TEXT_END"] = textEnd + 1;
+  try{ validateSchemas(); }catch(const std::runtime_error&){ refused = true; }
+  configParams["SERIAL_TIMELINE_POST_TEXT_END"] = textEnd;
+
+  TimelinePost post = {Active::Yes, "schemaowner", "schemaauthor", getTimeNow(), "some text"};
+  string serialized = serializeTimelinePost(post), dataType = "TIMELINE_POST", fieldType = "AUTHOR";
+
+  bool extracted = unpad(extractField(serialized, dataType, fieldType)) == "schemaauthor";
+
+  map<string, string> matching = {{"ACTIVE", "1"}, {"USERNAME", "schemaowner"}, {"AUTHOR", "schemaauthor"}};
+  map<string, string> other = {{"ACTIVE", "1"}, {"USERNAME", "schemaowner"}, {"AUTHOR", "author"}};
+  map<string, string> inactive = {{"ACTIVE", "0"}, {"USERNAME", "schemaowner"}};
+
+  int numMatches = 1000000;
+  cerr << "START:\t schemas: " << numMatches << " matches." << endl;
+
+  std::chrono::time_point<std::chrono::system_clock> start = std::chrono::system_clock::now();
+  bool matched = true;
+
+  for(int i = 0; i < numMatches; i++){
+    matched = matched && matchesSerialized(serialized, dataType, matching);
+  }
+
+  std::chrono::duration<double> elapsed = std::chrono::system_clock::now() - start;
+  cerr << "END:\t schemas: " << numMatches / elapsed.count() << " matches/second." << endl;
+
+  return refused && extracted && matched &&
+         !matchesSerialized(serialized, dataType, other) && !matchesSerialized(serialized, dataType, inactive);
+}
+
+bool testMatchPredicate(){
+  // Compiled predicates agree with matchesSerialized() on every item, and
+  // match many more of them per second
+  string dataType = "TIMELINE_POST";
+  vector<string> items;
+
+  for(int i = 0; i < 1000; i++){
+    TimelinePost post = {i % 3 ? Active::Yes : Active::No, "owner" + to_string(i % 7),
+                         "author" + to_string(i % 11), to_string(1400000000 + i % 5), "text"};
+    items.push_back(serializeTimelinePost(post));
+  }
+
+  vector<map<string, string>> queries = {
+    {{"ACTIVE", "1"}, {"USERNAME", "owner3"}},
+    {{"ACTIVE", "1"}, {"USERNAME", "owner3"}, {"AUTHOR", "author5"}, {"TIMESTAMP", "1400000002"}},
+    {{"AUTHOR", "author10"}},
+    {{"TIMESTAMP", "14"}},
+    {{"ACTIVE", "0"}, {"TEXT", "text"}}
+  };
+
+  bool agreed = true;
+  for(auto const& query : queries){
+    MatchPredicate predicate(dataType, query);
+
+    for(string& item : items){
+      agreed = agreed && predicate.matches(item) == matchesSerialized(item, dataType, query);
+    }
+  }
+
+  int numRounds = 1000;
+  cerr << "START:\t predicates: " << numRounds * items.size() << " matches." << endl;
+
+  long numMatches = 0;
+  std::chrono::time_point<std::chrono::system_clock> start = std::chrono::system_clock::now();
+
+  for(int r = 0; r < numRounds; r++){
+    for(string& item : items){ numMatches += matchesSerialized(item, dataType, queries[1]); }
+  }
+
+  std::chrono::time_point<std::chrono::system_clock> middle = std::chrono::system_clock::now();
+  MatchPredicate predicate(dataType, queries[1]);
+
+  for(int r = 0; r < numRounds; r++){
+    for(string& item : items){ numMatches -= predicate.matches(item); }
+  }
+
+  std::chrono::duration<double> serialized = middle - start, compiled = std::chrono::system_clock::now() - middle;
+  cerr << "END:\t predicates: " << numRounds * items.size() / serialized.count() << " matches/second (serialized), "
+       << numRounds * items.size() / compiled.count() << " (compiled)." << endl;
+
+  return agreed && !numMatches;
+}
+
+bool testMatchKernel(){
+  // Every kernel that the CPU supports agrees with matchesSerialized(), on
+  // items whose fields end where the items do too (relations), and the
+  // microbenchmark compares how many items each of them matches per second
+  int numItems = 100000;
+  string timelineType = "TIMELINE_POST", relationType = "RELATION", timelineItems, relationItems;
+
+  for(int i = 0; i < numItems; i++){
+    TimelinePost post = {i % 3 ? Active::Yes : Active::No, "owner" + to_string(i % 7),
+                         "author" + to_string(i % 11), to_string(1400000000 + i), "text"};
+    Relation relation = {i % 2 ? Active::Yes : Active::No, "first" + to_string(i % 5), i % 3 ? '>' : '<',
+                         "second" + to_string(i % 13), to_string(1400000000 + i % 17)};
+
+    timelineItems += serializeTimelinePost(post);
+    relationItems += serializeRelation(relation);
+  }
+
+  map<string, string> timelineArgs = {{"ACTIVE", "1"}, {"USERNAME", "owner3"}, {"AUTHOR", "author5"}};
+  map<string, string> relationArgs = {{"ACTIVE", "1"}, {"DIRECTION", ">"}, {"SECOND_USERNAME", "second4"},
+                                      {"TIMESTAMP", "1400000003"}};
+
+  MatchPredicate timelinePredicate(timelineType, timelineArgs), relationPredicate(relationType, relationArgs);
+  int timelineSize = getRecordLayout(timelineType).serialSize, relationSize = getRecordLayout(relationType).serialSize;
+
+  cerr << "START:\t match kernel: " << numItems << " items, " << getKernelName(getMatchKernel()) << " picked." << endl;
+
+  // The current per-item matching
+  vector<bool> expected(numItems), expectedRelations(numItems);
+  std::chrono::time_point<std::chrono::system_clock> start = std::chrono::system_clock::now();
+
+  for(int i = 0; i < numItems; i++){
+    expected[i] = matchesSerialized(timelineItems.substr(i * timelineSize, timelineSize), timelineType, timelineArgs);
+  }
+
+  std::chrono::duration<double> elapsed = std::chrono::system_clock::now() - start;
+  cerr << "\t matchesSerialized: " << numItems / elapsed.count() << " items/second." << endl;
+
+  for(int i = 0; i < numItems; i++){
+    expectedRelations[i] = matchesSerialized(relationItems.substr(i * relationSize, relationSize),
+                                             relationType, relationArgs);
+  }
+
+  bool agreed = true;
+  vector<uint64_t> bitmap;
+
+  for(MatchKernel kernel : {ScalarKernel, SseKernel, Avx2Kernel}){
+    if(!isKernelSupported(kernel)) continue;
+
+    int numRounds = 10;
+    start = std::chrono::system_clock::now();
+
+    for(int r = 0; r < numRounds; r++){
+      matchItems(timelineItems.data(), numItems, timelineSize, timelinePredicate, bitmap, kernel);
+    }
+
+    elapsed = std::chrono::system_clock::now() - start;
+    cerr << "\t " << getKernelName(kernel) << ": " << numRounds * numItems / elapsed.count() << " items/second." << endl;
+
+    for(int i = 0; agreed && i < numItems; i++){ agreed = isMatch(bitmap, i) == expected[i]; }
+
+    matchItems(relationItems.data(), numItems, relationSize, relationPredicate, bitmap, kernel);
+    for(int i = 0; agreed && i < numItems; i++){ agreed = isMatch(bitmap, i) == expectedRelations[i]; }
+  }
+
+  cerr << "END:\t match kernel: " << (agreed ? "all kernels agree." : "kernels disagree!") << endl;
+
+  return agreed;
+}
+
 int main(){
   configServer();
 
@@ -82,6 +1157,25 @@ int main(){
   vector<bool (*)()> testFunctions;
   testFunctions.push_back(testSaveCredential);
   testFunctions.push_back(testSavePost);
+  testFunctions.push_back(testParseCommand);
+  testFunctions.push_back(testReaderBackends);
+  testFunctions.push_back(testReadContention);
+  testFunctions.push_back(testFileIndex);
+  testFunctions.push_back(testHashDistribution);
+  testFunctions.push_back(testCompaction);
+  testFunctions.push_back(testGroupCommit);
+  testFunctions.push_back(testWriteBatch);
+  testFunctions.push_back(testFanout);
+  testFunctions.push_back(testFanoutLogCompaction);
+  testFunctions.push_back(testHybridFanout);
+  testFunctions.push_back(testFanoutThreshold);
+  testFunctions.push_back(testTimelineRing);
+  testFunctions.push_back(testPostIndex);
+  testFunctions.push_back(testRelationUpsert);
+  testFunctions.push_back(testDeleteAccount);
+  testFunctions.push_back(testRecordSchemas);
+  testFunctions.push_back(testMatchPredicate);
+  testFunctions.push_back(testMatchKernel);
 
   // Execute each test function and abort if there's a failure
   for(auto func:testFunctions){ assert(func()); }
@@ -115,19 +115,17 @@ class User:
         Args:
             limit (int): the max. number of returned posts. -1 means no limit.
         """
-        command = 'GET/posts/timeline/%s:%s\0' % (self.username, limit)
-        output = client.request(command)
-
-        serialized_posts = split_chunk(output, config.SERIAL_SIZE_TIMELINE_POST)
+        reply = client.binary_request(
+            client.Opcode.GET_TIMELINE_POSTS, [self.username], limit
+        )
 
         posts = []
-        for serialized_post in serialized_posts:
-            deserialized = serializers.deserialize_timeline_post(serialized_post)
+        for author, timestamp, text in client.decode_items(reply, ('str', 'timestamp', 'str')):
             posts.append(Post(
-                active=deserialized.get('active'),
-                username=deserialized.get('author'),
-                timestamp=deserialized.get('timestamp'),
-                text=deserialized.get('text')
+                active=True,
+                username=author,
+                timestamp=timestamp,
+                text=text
             ))
 
         return posts
@@ -139,18 +137,52 @@ class User:
         Args:
             limit (int): the max. number of returned posts. -1 means no limit.
         """
-        command = 'GET/posts/profile/%s:%s\0' % (self.username, limit)
-        output = client.request(command)
-
-        serialized_posts = split_chunk(output, config.SERIAL_SIZE_PROFILE_POST)
+        reply = client.binary_request(
+            client.Opcode.GET_PROFILE_POSTS, [self.username], limit
+        )
 
         posts = []
-        for serialized_post in serialized_posts:
-            deserialized = serializers.deserialize_profile_post(serialized_post)
-            posts.append(Post(**deserialized))
+        for timestamp, text in client.decode_items(reply, ('timestamp', 'str')):
+            posts.append(Post(
+                active=True,
+                username=self.username,
+                timestamp=timestamp,
+                text=text
+            ))
 
         return posts
 
+    def get_profile_as_seen_by(self, viewer, limit=-1):
+        """
+        Returns the user's profile posts and whether the user and "viewer"
+        follow one another, as (posts, viewer_follows_user, user_follows_viewer).
+        All of it is read in a single batch. Returns None if the user does not
+        exist.
+
+        Args:
+            limit (int): the max. number of returned posts. -1 means no limit.
+        """
+        exists, posts, is_following, is_followed_by = client.binary_batch([
+            (client.Opcode.EXISTS, [self.username], 0),
+            (client.Opcode.GET_PROFILE_POSTS, [self.username], limit),
+            (client.Opcode.IS_FOLLOWING, [viewer.username, self.username], 0),
+            (client.Opcode.IS_FOLLOWING, [self.username, viewer.username], 0),
+        ])
+
+        if exists != bytes([client.BinaryStatus.TRUE]):
+            return None
+
+        posts = [
+            Post(active=True, username=self.username, timestamp=timestamp, text=text)
+            for timestamp, text in client.decode_items(posts, ('timestamp', 'str'))
+        ]
+
+        return (
+            posts,
+            is_following == bytes([client.BinaryStatus.TRUE]),
+            is_followed_by == bytes([client.BinaryStatus.TRUE])
+        )
+
     def is_following(self, friend): # GET/relations/self.username:friend.username\0
         """
         True if the user is following "friend". Otherwise, False.
@@ -187,17 +219,11 @@ class User:
         Args:
             limit (int): the max. number of returned profiles. -1 means no limit.
         """
-        command = 'GET/relations/followers/%s:%s\0' % (self.username, limit)
-        output = client.request(command)
+        reply = client.binary_request(
+            client.Opcode.GET_FOLLOWERS, [self.username], limit
+        )
 
-        serialized_relations = split_chunk(output, config.SERIAL_SIZE_RELATION)
-
-        usernames = []
-        for serialized_relation in serialized_relations:
-            deserialized = serializers.deserialize_relation(serialized_relation)
-            usernames.append(User(username=deserialized['second_username']))
-
-        return usernames
+        return [User(username=username) for username, in client.decode_items(reply, ('str',))]
 
     def get_friends(self, limit=-1): # GET/relations/friends/self.username:limit\0
         """
@@ -206,17 +232,11 @@ class User:
         Args:
             limit (int): the max. number of returned profiles. -1 means no limit.
         """
-        command = 'GET/relations/friends/%s:%s\0' % (self.username, limit)
-        output = client.request(command)
-
-        serialized_relations = split_chunk(output, config.SERIAL_SIZE_RELATION)
-
-        usernames = []
-        for serialized_relation in serialized_relations:
-            deserialized = serializers.deserialize_relation(serialized_relation)
-            usernames.append(User(username=deserialized['second_username']))
+        reply = client.binary_request(
+            client.Opcode.GET_FRIENDS, [self.username], limit
+        )
 
-        return usernames
+        return [User(username=username) for username, in client.decode_items(reply, ('str',))]
 
 class Post:
     def __init__(self, active, username, timestamp, text):
@@ -1,5 +1,7 @@
 """Defines workflow through which requests are made to the server"""
 import socket
+import struct
+import threading
 import re
 import os
 
@@ -18,10 +20,268 @@ class ClientResponseSignal:
 class ErrorRetrievingFromServer(Exception):
     pass
 
+class Opcode:
+    """Commands of the binary protocol (see CommandType in storage/include/parser.h)"""
+    EXISTS = 1
+    VERIFY_CREDENTIAL = 2
+    GET_PROFILE_POSTS = 3
+    GET_TIMELINE_POSTS = 4
+    IS_FOLLOWING = 5
+    GET_FOLLOWERS = 6
+    GET_FRIENDS = 7
+    SAVE_CREDENTIAL = 8
+    SAVE_POST = 9
+    FOLLOW = 10
+    DELETE_CREDENTIAL = 11
+    DELETE_POST = 12
+    UNFOLLOW = 13
+    BATCH = 17
+
+class BinaryStatus:
+    """First byte of every reply in the binary protocol"""
+    FALSE = 0
+    TRUE = 1
+    ITEMS = 2
+
+
+class Connection:
+    """Socket that stays open across requests (see MODE/persistent\\0).
+
+    Commands may be pipelined: pipeline() sends all of them before reading any
+    of the responses, which the server returns in the same order. Unless
+    framed=False, each response arrives in one go, prefixed by its length (see
+    MODE/framed\\0).
+    """
+    def __init__(self, host=DATASERVER_HOST, port=DATASERVER_PORT, framed=True):
+        self.sock = socket.create_connection((host, port))
+        self.sock.setsockopt(socket.IPPROTO_TCP, socket.TCP_NODELAY, 1)
+        self.framed = False
+
+        modes = ['MODE/persistent\0']
+        if framed:
+            modes.append('MODE/framed\0')
+
+        self._set_modes(modes)
+
+    def _set_modes(self, modes):
+        # The reply to each MODE command already follows the mode it sets
+        self.sock.sendall(''.join(modes).encode('utf-8'))
+        for mode in modes:
+            self.framed = self.framed or mode == 'MODE/framed\0'
+            if self._receive_response() != 'success':
+                raise ErrorRetrievingFromServer()
+
+    def request(self, command):
+        return self.pipeline([command])[0]
+
+    def pipeline(self, commands):
+        """Returns the full string output of each of the commands, in order."""
+        self.sock.sendall(''.join(commands).encode('utf-8'))
+        return [self._receive_response() for _ in commands]
+
+    def close(self):
+        self.sock.close()
+
+    def _receive_response(self):
+        if self.framed:
+            return self._receive_frame().decode('utf-8')
+
+        # The server doesn't wait for ACKs on persistent connections: the header
+        # is immediately followed by as many packets as it announces
+        header = parse_as_utf8(self._receive_packet())
+        match = re_successful_header.match(header)
+
+        if match:
+            num_expected = int(match.group(1))
+            return ''.join(
+                parse_as_utf8(self._receive_packet()) for _ in range(num_expected)
+            )
+
+        raise ErrorRetrievingFromServer()
+
+    def _receive_packet(self):
+        # Every packet is exactly DATASERVER_BUFFSIZE bytes long
+        return self._receive_exactly(DATASERVER_BUFFSIZE)
+
+    def _receive_frame(self):
+        # Length of the response (4 bytes, network byte order), then the
+        # response itself
+        length, = struct.unpack('!I', self._receive_exactly(4))
+        return self._receive_exactly(length)
+
+    def _receive_exactly(self, num_bytes):
+        received = bytearray()
+        while len(received) < num_bytes:
+            chunk = self.sock.recv(num_bytes - len(received))
+            if not chunk:
+                raise ErrorRetrievingFromServer()
+            received += chunk
+
+        return bytes(received)
+
+
+class BinaryConnection(Connection):
+    """Persistent connection that speaks the binary protocol (MODE/binary\\0).
+
+    Commands are an opcode, a limit and length-prefixed fields; replies are a
+    status followed, for commands that return items, by the items' compact
+    fields (see decode_items()).
+    """
+    def __init__(self, host=DATASERVER_HOST, port=DATASERVER_PORT):
+        self.sock = socket.create_connection((host, port))
+        self.sock.setsockopt(socket.IPPROTO_TCP, socket.TCP_NODELAY, 1)
+        self.framed = False
+
+        self._set_modes(['MODE/persistent\0'])
+
+        self.sock.sendall('MODE/binary\0'.encode('utf-8'))
+        if self._receive_frame() != bytes([BinaryStatus.TRUE]):
+            raise ErrorRetrievingFromServer()
+
+    def pipeline(self, calls):
+        """Takes (opcode, fields, limit) tuples and returns the raw reply of
+        each one, in order."""
+        self.sock.sendall(b''.join(encode_command(*call) for call in calls))
+        return [self._receive_frame() for _ in calls]
+
+    def batch(self, calls):
+        """Sends the (opcode, fields, limit) tuples as a single batch (only
+        reads may be batched) and returns the raw reply of each one, in order.
+        The server executes calls that read different files in parallel."""
+        self.sock.sendall(
+            encode_command(Opcode.BATCH, limit=len(calls)) +
+            b''.join(encode_command(*call) for call in calls)
+        )
+        return split_frames(self._receive_frame())
+
+
+def encode_command(opcode, fields=(), limit=0):
+    """opcode (1 byte) | limit (4 bytes) | number of fields (1 byte) | fields,
+    where each field is prefixed by its length (2 bytes)."""
+    encoded = [field.encode('utf-8') for field in fields]
+
+    return struct.pack('!BiB', opcode, limit, len(encoded)) + b''.join(
+        struct.pack('!H', len(field)) + field for field in encoded
+    )
+
+def split_frames(reply):
+    """Split the reply to a batch into the replies to each of its commands
+    (each one is prefixed by its length)."""
+    offset, frames = 0, []
+
+    while offset < len(reply):
+        length, = struct.unpack_from('!I', reply, offset)
+        frames.append(reply[offset + 4:offset + 4 + length])
+        offset += 4 + length
+
+    return frames
+
+def decode_items(reply, item_format):
+    """Decode the items of a binary reply. item_format lists the type of each of
+    the fields of an item: 'str' (1-byte length, then the characters) or
+    'timestamp' (4-byte integer). Returns a list of tuples."""
+    if not reply or reply[0] != BinaryStatus.ITEMS:
+        raise ErrorRetrievingFromServer()
+
+    num_items, = struct.unpack_from('!I', reply, 1)
+    offset, items = 5, []
+
+    for _ in range(num_items):
+        item = []
+        for field_type in item_format:
+            if field_type == 'timestamp':
+                item.append('%010d' % struct.unpack_from('!I', reply, offset))
+                offset += 4
+            else:
+                length = reply[offset]
+                item.append(reply[offset + 1:offset + 1 + length].decode('utf-8'))
+                offset += 1 + length
+
+        items.append(tuple(item))
+
+    return items
+
+
+# Each thread of the web app keeps its own connections to the server
+_local = threading.local()
+
+def connection(binary=False):
+    """Returns this thread's persistent connection (opens it if needed)."""
+    name = 'binary_connection' if binary else 'connection'
+
+    if getattr(_local, name, None) is None:
+        setattr(_local, name, BinaryConnection() if binary else Connection())
+
+    return getattr(_local, name)
+
+def is_read_request(request, binary):
+    """True if the command only reads (GET/... in text, or one of the binary
+    opcodes up to GET_FRIENDS; see isReadCommand() in the server's parser)."""
+    if binary:
+        return Opcode.EXISTS <= request[0] <= Opcode.GET_FRIENDS
+
+    return request.startswith('GET/')
+
+def _drop_connection(name):
+    if getattr(_local, name, None) is not None:
+        getattr(_local, name).close()
+        setattr(_local, name, None)
+
+def _pipeline(requests, binary, batch=False):
+    # Retries once over a new connection if the server hung up on the old one,
+    # but only when that can't make a change twice: either nothing was sent
+    # (the connection couldn't be opened) or every request only reads. Writes
+    # that may have reached the server are left to the caller.
+    name = 'binary_connection' if binary else 'connection'
+    read_only = all(is_read_request(request, binary) for request in requests)
+
+    for attempt in range(2):
+        try:
+            conn = connection(binary)
+        except (socket.error, ErrorRetrievingFromServer):
+            _drop_connection(name)
+            if attempt:
+                raise
+            continue
+
+        try:
+            if batch:
+                return conn.batch(requests)
+
+            return conn.pipeline(requests)
+
+        except (socket.error, ErrorRetrievingFromServer):
+            _drop_connection(name)
+
+            if attempt or not read_only:
+                raise
+
+def pipeline(commands):
+    """Sends all of the commands at once over this thread's connection and
+    returns their outputs in order."""
+    return _pipeline(commands, binary=False)
+
+def binary_request(opcode, fields=(), limit=0):
+    """Sends a command of the binary protocol and returns its raw reply."""
+    return _pipeline([(opcode, fields, limit)], binary=True)[0]
+
+def binary_batch(calls):
+    """Sends the (opcode, fields, limit) tuples as one batch of the binary
+    protocol and returns their raw replies in order."""
+    return _pipeline(calls, binary=True, batch=True)
 
 def request(command, host=DATASERVER_HOST, port=DATASERVER_PORT):
     """Returns full string output of the command to the user (regardless of how
     many packets are sent from the server; they're all concatenated here).
+    """
+    if (host, port) == (DATASERVER_HOST, DATASERVER_PORT):
+        return pipeline([command])[0]
+
+    return request_once(command, host, port)
+
+def request_once(command, host=DATASERVER_HOST, port=DATASERVER_PORT):
+    """Sends the command over its own connection, following the original
+    handshake (ACK after the header and after each packet).
 
     If unsuccessful, returns None.
     """
@@ -41,11 +301,12 @@ def request(command, host=DATASERVER_HOST, port=DATASERVER_PORT):
 
         # Receive as many packets as indicated
         output = ""
-        for i in range(num_expected + 1):
+        for i in range(num_expected):
             output += parse_as_utf8(s.recv(DATASERVER_BUFFSIZE))
             # Signal that we have received the packet
             s.send(ClientResponseSignal.Ack)
 
+        s.close()
         return output
 
     elif header.startswith('500'):
@@ -53,7 +314,11 @@ def request(command, host=DATASERVER_HOST, port=DATASERVER_PORT):
 
 def parse_as_utf8(buffer_bytes):
     """Read until we encounter the '\x00' (control character) in UTF-8. Assumes
-    that read bytes will be terminated with this. Then, decode accordingly."""
+    that read bytes will be terminated with this, unless they fill the whole
+    buffer. Then, decode accordingly."""
 
     end_idx = buffer_bytes.find(b'\x00')
+    if end_idx == -1:
+        end_idx = len(buffer_bytes)
+
     return (buffer_bytes[:end_idx]).decode('utf-8')
@@ -109,18 +109,23 @@ def profile(requested_username=None):
         # Dealing with a secondary user (i.e. not the one who's logged in)
         secondary_user = User(requested_username)
 
-        if not secondary_user.exists():
+        # Fetch the secondary user's posts and the relationship to the main
+        # user (all at once)
+        seen = secondary_user.get_profile_as_seen_by(user)
+
+        if seen is None:
             return render_template('404.html',
                 message='User "%s" does not exist' % secondary_user.username
             )
 
-        # Fetch the secondary user's posts and the relationship to the main user
+        posts, is_following, is_followed_by = seen
+
         return render_template('profile.html',
             username=user.username,
-            posts=secondary_user.get_profile_posts(),
+            posts=posts,
             secondary_username=secondary_user.username,
-            is_following=user.is_following(secondary_user),
-            is_followed_by=secondary_user.is_following(user)
+            is_following=is_following,
+            is_followed_by=is_followed_by
         )
 
     else:
@@ -66,11 +66,11 @@ def matches_credential(serialized, active=None, username=None, password=None):
 
     return True
 
-def serialize_relation(active, first_username, direction, second_username):
+def serialize_relation(active, first_username, direction, second_username, timestamp):
     """Combine the provided parameters into the following format, which is
     returned as a string:
 
-    <active><first_username><direction><second_username>
+    <active><first_username><direction><second_username><timestamp>
 
     This is like a directed edge on a graph of relationships, where its direction
     is determined by the `direction` param.: either '>' (forward) or '<' (backward).
@@ -80,6 +80,7 @@ def serialize_relation(active, first_username, direction, second_username):
         first_username (str): user on whose timeline this post belongs
         direction (str): author of the post
         second_username (str): user on whose timeline this post belongs
+        timestamp (time.time): when the follow was made
     """
     if not isinstance(active, bool):
         raise TypeError('"active" must be a boolean')
@@ -96,8 +97,9 @@ def serialize_relation(active, first_username, direction, second_username):
     active = '1' if active else 0
     first_username = pad(first_username, config.FIELD_SIZE_USERNAME)
     second_username = pad(second_username, config.FIELD_SIZE_USERNAME)
+    timestamp = str(int(timestamp))
 
-    return '%s%s%s%s' % (active, first_username, direction, second_username)
+    return '%s%s%s%s%s' % (active, first_username, direction, second_username, timestamp)
 
 def deserialize_relation(serialized):
     """Parse the serialized relation and build a dictionary with its parameters."""
@@ -105,12 +107,14 @@ def deserialize_relation(serialized):
     first_username = extract_field(serialized, 'relation', 'first_username')
     direction = extract_field(serialized, 'relation', 'direction')
     second_username = extract_field(serialized, 'relation', 'second_username')
+    timestamp = extract_field(serialized, 'relation', 'timestamp')
 
     return dict(
         active=True if active == '1' else False,
         first_username=unpad(first_username),
         direction=direction,
-        second_username=unpad(second_username)
+        second_username=unpad(second_username),
+        timestamp=timestamp
     )
 
 def matches_relation(serialized, active=None, first_username=None, direction=None, second_username=None):
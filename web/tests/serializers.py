@@ -53,14 +53,16 @@ class TestRelation(unittest.TestCase):
     first_username = 'yaBoy211'
     direction = '>'
     second_username = 'brotasaurus'
-    serialized = '1~~~~~~~~~~~~yaBoy211>~~~~~~~~~brotasaurus'
+    timestamp = int(time.time())
+    serialized = '1~~~~~~~~~~~~yaBoy211>~~~~~~~~~brotasaurus1457969970'
 
     def test_serialize(self):
         value = ser.serialize_relation(
             self.active,
             self.first_username,
             self.direction,
-            self.second_username
+            self.second_username,
+            self.timestamp
         )
 
         # Right length?
@@ -68,7 +70,7 @@ class TestRelation(unittest.TestCase):
 
         # All fields fully contained?
         active = '1' if True else '0'
-        for field in [active, self.first_username, self.direction, self.second_username]:
+        for field in [active, self.first_username, self.direction, self.second_username, str(self.timestamp)]:
             self.assertTrue(field in value)
 
     def test_deserialize(self):
@@ -78,6 +80,7 @@ class TestRelation(unittest.TestCase):
         self.assertTrue(values.get('first_username') == 'yaBoy211')
         self.assertTrue(values.get('direction') == '>')
         self.assertTrue(values.get('second_username') == 'brotasaurus')
+        self.assertTrue(values.get('timestamp') == '1457969970')
 
     def test_match(self):
         # All asserts will have to take the serialized string as the first arg